@@ -15,12 +15,12 @@
  ******************************************************************************/
  
 #include "BatchGlobals.h"
+#include "BinaryInterface.h"
 
 unsigned int BatchGlobals::VERB = 3;
 
 bool BatchGlobals::fileExists(const std::string& fileName) {
-  std::ifstream infile(fileName.c_str());
-  return infile.good();
+  return BinaryInterface::exists(fileName);
 }
 
 void BatchGlobals::reportProgress(time_t& startTime, clock_t& startClock,
@@ -19,12 +19,15 @@
 
 #include "PvalueCalculator.h"
 
-struct BatchPvalueVector {
+// record of the p-value vector files, the coefficients and peaks are stored
+// in the precision and capacity of the layout
+template <class Layout>
+struct BasicBatchPvalueVector {
   double precMass;
   double retentionTime;
-  double polyfit[PvalueCalculator::kPolyfitDegree + 1];
-  short peakBins[PvalueCalculator::kMaxScoringPeaks];
-  short peakScores[PvalueCalculator::kMaxScoringPeaks];
+  typename Layout::PolyfitValue polyfit[PvalueCalculator::kNumPolyfitCoeffs];
+  short peakBins[Layout::kMaxScoringPeaks];
+  short peakScores[Layout::kMaxScoringPeaks];
   int charge, queryCharge;
   ScanId scannr;
 };
@@ -19,8 +19,41 @@
 
 double BatchPvalueVectors::massRangePPM_ = 20.0; // in ppm
 double BatchPvalueVectors::dbPvalThreshold_ = -5.0; // logPval
+const size_t BatchPvalueVectors::kMinLookupWindowSize = 8u;
+const size_t BatchPvalueVectors::kTileRows;
+const size_t BatchPvalueVectors::kTileBlockRows = 256u;
+bool BatchPvalueVectors::dotProduct_ = false;
+bool BatchPvalueVectors::fingerprintFilter_ = false;
 
-void BatchPvalueVectors::initPvecRow(const MassChargeCandidate& mcc, 
+namespace {
+
+template <typename PolyfitValue>
+BatchPvalueVectors* createWithPrecision(const std::string& pvaluesFN) {
+  unsigned int maxScoringPeaks = PvalueCalculator::maxScoringPeaks_;
+  if (maxScoringPeaks <= 20u) {
+    return new BasicBatchPvalueVectors<
+        PvalueVectorLayout<PolyfitValue, 20u> >(pvaluesFN);
+  } else if (maxScoringPeaks <= 30u) {
+    return new BasicBatchPvalueVectors<
+        PvalueVectorLayout<PolyfitValue, 30u> >(pvaluesFN);
+  } else {
+    return new BasicBatchPvalueVectors<PvalueVectorLayout<PolyfitValue, 
+        PvalueCalculator::kMaxScoringPeaks> >(pvaluesFN);
+  }
+}
+
+} // namespace
+
+BatchPvalueVectors* BatchPvalueVectors::create(const std::string& pvaluesFN) {
+  if (PvalueCalculator::singlePrecision_) {
+    return createWithPrecision<float>(pvaluesFN);
+  } else {
+    return createWithPrecision<double>(pvaluesFN);
+  }
+}
+
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::initPvecRow(const MassChargeCandidate& mcc, 
                                     const BatchSpectrum& spec,
                                     PvalueVectorsDbRow& pvecRow) {
   pvecRow.precMass = mcc.mass;
@@ -29,29 +62,51 @@ void BatchPvalueVectors::initPvecRow(const MassChargeCandidate& mcc,
   pvecRow.retentionTime = spec.retentionTime;
   
   unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaks(spec.precMass);
-#ifdef DOT_PRODUCT
-  numScoringPeaks *= 2;
-  pvecRow.peakBins.reserve(numScoringPeaks);
-  for (unsigned int j = 0; j < numScoringPeaks; ++j) {
-    if (spec.fragBins[j] != 0) {
-      pvecRow.peakBins.push_back(spec.fragBins[j]);
-    } else if (j % 2 == 0) {
-      break;
-    }
+  if (dotProduct_) {
+    initDotProductPeaks(spec, numScoringPeaks, pvecRow);
+    return;
   }
-#else
-  pvecRow.peakBins.reserve(numScoringPeaks);
+  
+  pvecRow.numPeakBins = 0u;
   for (unsigned int j = 0; j < numScoringPeaks; ++j) {
     if (spec.fragBins[j] != 0) {
-      pvecRow.peakBins.push_back(spec.fragBins[j]);
+      pvecRow.peakBins[pvecRow.numPeakBins++] = spec.fragBins[j];
     } else {
       break;
     }
   }
-#endif
 }
 
-void BatchPvalueVectors::insertMassChargeCandidate(
+// for the dot product every peak bin of the spectrum is followed by its 
+// intensity. The row only keeps the peak bins, the peaks with their 
+// intensities relative to the first, i.e. the most intense, peak go to 
+// dotProductPeaks_, sorted by bin. The rows are initialized serially by 
+// insertMassChargeCandidate, so dotProductPeaks_ needs no lock here.
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::initDotProductPeaks(
+    const BatchSpectrum& spec, unsigned int numScoringPeaks, 
+    PvalueVectorsDbRow& pvecRow) {
+  pvecRow.numPeakBins = 0u;
+  pvecRow.dotProductOffset = dotProductPeaks_.size();
+  double sumSquares = 0.0;
+  double div = spec.fragBins[1];
+  for (unsigned int j = 0; j < numScoringPeaks; ++j) {
+    if (spec.fragBins[2*j] == 0) break;
+    DotProductPeak peak;
+    peak.bin = spec.fragBins[2*j];
+    peak.intensity = static_cast<double>(spec.fragBins[2*j+1])/div;
+    dotProductPeaks_.push_back(peak);
+    sumSquares += peak.intensity*peak.intensity;
+    pvecRow.peakBins[pvecRow.numPeakBins++] = spec.fragBins[2*j];
+  }
+  std::sort(dotProductPeaks_.begin() + pvecRow.dotProductOffset, 
+            dotProductPeaks_.end());
+  pvecRow.numDotProductPeaks = pvecRow.numPeakBins;
+  pvecRow.dotProductNorm = std::sqrt(sumSquares);
+}
+
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::insertMassChargeCandidate(
     MassChargeCandidate& mcc, BatchSpectrum& spec) {
   if (BatchGlobals::VERB > 4) {
     std::cerr << "Inserting mass charge candidate into database" << std::endl;
@@ -76,15 +131,54 @@ void BatchPvalueVectors::insertMassChargeCandidate(
   }
 }
 
-void BatchPvalueVectors::batchInsert(PeakCounts& peakCounts, bool forceInsert) {
+// precomputes the peak distributions for all (charge, precursor bin) pairs 
+// that insertMassChargeCandidate will generate for these spectra, so that the
+// parallel p-value vector calculation only needs read access to the table
+void BatchPvalueVectors::initPeakDistributionTable(
+    const std::vector<BatchSpectrum>& spectra, const PeakCounts& peakCounts) {
+  std::vector<PeakDistributionKey> keys;
+  keys.reserve(spectra.size());
+  BOOST_FOREACH (const BatchSpectrum& spec, spectra) {
+    int minCharge = spec.charge;
+    int maxCharge = spec.charge;
+    for (int charge = minCharge; charge <= maxCharge; ++charge) {
+      double precMz = SpectrumHandler::calcPrecMz(spec.precMass, charge);
+      unsigned int numQueryPeaks = PvalueCalculator::getMaxScoringPeaks(spec.precMass);
+      keys.push_back(peakCounts.getPeakDistributionKey(precMz, charge, numQueryPeaks));
+    }
+  }
+  peakCounts.generatePeakDistributionTable(keys, peakDistTable_);
+  
+  if (BatchGlobals::VERB > 3) {
+    std::cerr << "Generated " << peakDistTable_.size() << " peak distributions" << std::endl;
+  }
+}
+
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::batchInsert(const PeakCounts& peakCounts, bool forceInsert) {
   if (pvalVecBatch_.size() >= 5000 || forceInsert) {
     if (BatchGlobals::VERB > 3) {
       std::cerr << "Inserting " << pvalVecBatch_.size() << " spectra into database" << std::endl;
     }
     //std::cerr << "Calculating " << pvalVecBatch_.size() << " p-value vectors" << std::endl;
-  #pragma omp parallel for schedule(dynamic, 100)
-    for (size_t i = 0; i < pvalVecBatch_.size(); ++i) {
-      calculatePvalueVector(pvalVecBatch_[i], peakCounts);
+    
+    // grow geometrically, so that the insertions inside the critical section 
+    // do not reallocate the collection
+    size_t numRequired = pvalVecCollection_.size() + pvalVecBatch_.size();
+    if (pvalVecCollection_.capacity() < numRequired) {
+      pvalVecCollection_.reserve(
+          (std::max)(numRequired, 2 * pvalVecCollection_.capacity()));
+    }
+    
+  #pragma omp parallel
+    {
+      PvalueCalculator::Scratch scratch;
+      scratch.reserve();
+      std::vector<PolyfitValue> pvalTable;
+    #pragma omp for schedule(dynamic, 100)
+      for (size_t i = 0; i < pvalVecBatch_.size(); ++i) {
+        calculatePvalueVector(pvalVecBatch_[i], peakCounts, scratch, pvalTable);
+      }
     }
     pvalVecBatch_.clear();
     
@@ -94,39 +188,59 @@ void BatchPvalueVectors::batchInsert(PeakCounts& peakCounts, bool forceInsert) {
   }
 }
 
-void BatchPvalueVectors::initPvalCalc(PvalueCalculator& pvalCalc, 
-    PvalueVectorsDbRow& pvecRow, PeakCounts& peakCounts, 
-    const int numQueryPeaks, const bool polyfit) {
-#ifdef DOT_PRODUCT
-  pvalCalc.init(pvecRow.peakBins, std::vector<double>() );
-#else
-  PeakDistribution distribution;
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::initPvalCalc(LayoutPvalueCalculator& pvalCalc, 
+    PvalueVectorsDbRow& pvecRow, const PeakCounts& peakCounts, 
+    const int numQueryPeaks, const bool polyfit, 
+    PvalueCalculator::Scratch& scratch) {
+  if (dotProduct_) {
+    pvalCalc.init(pvecRow.peakBins, pvecRow.numPeakBins);
+    return;
+  }
+  
+  PeakDistribution fallbackDistribution;
+  const double* peakDist = NULL;
   double precMz = SpectrumHandler::calcPrecMz(pvecRow.precMass, pvecRow.queryCharge);
-  peakCounts.generatePeakDistribution(precMz, pvecRow.queryCharge, 
-                                      distribution, numQueryPeaks);
+  size_t numBins = peakCounts.getPeakDistribution(peakDistTable_, 
+      peakCounts.getPeakDistributionKey(precMz, pvecRow.queryCharge, numQueryPeaks), 
+      fallbackDistribution, peakDist);
   
-  pvalCalc.initFromPeakBins(pvecRow.peakBins, distribution.getDistribution());
+  pvalCalc.initFromPeakBins(pvecRow.peakBins, pvecRow.numPeakBins, 
+                            peakDist, numBins, scratch);
   
   if (polyfit) {
-    pvalCalc.computePvalVectorPolyfit();
+    pvalCalc.computePvalVectorPolyfit(scratch);
+    pvalCalc.initScoreCutoff(dbPvalThreshold_);
+    pvecRow.signature.init(pvecRow.peakBins, pvecRow.numPeakBins);
   } else {
-    pvalCalc.computePvalVector();
+    pvalCalc.computePvalVector(scratch);
   } 
-#endif
 }
 
-void BatchPvalueVectors::calculatePvalueVector(PvalueVectorsDbRow& pvecRow,
-    PeakCounts& peakCounts) {
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::calculatePvalueVector(PvalueVectorsDbRow& pvecRow,
+    const PeakCounts& peakCounts, PvalueCalculator::Scratch& scratch,
+    std::vector<PolyfitValue>& pvalTable) {
   if (BatchGlobals::VERB > 4) {
     std::cerr << "Inserting pvalue vector " << pvecRow.scannr << std::endl;
   }
   bool polyfit = true;
   unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaks(pvecRow.precMass);
-  initPvalCalc(pvecRow.pvalCalc, pvecRow, peakCounts, numScoringPeaks, polyfit);
+  initPvalCalc(pvecRow.pvalCalc, pvecRow, peakCounts, numScoringPeaks, polyfit, 
+               scratch);
   
   if (pvecRow.pvalCalc.getNumScoringPeaks() >= PvalueCalculator::getMinScoringPeaks(pvecRow.precMass)) {    
+    // the table is evaluated outside of the critical section, pvalTable is 
+    // reused for all rows of the calling thread
+    pvalTable.clear();
+    if (!dotProduct_) {
+      pvalTable.resize(pvecRow.pvalCalc.getPvalueTableSize());
+      if (!pvalTable.empty()) pvecRow.pvalCalc.initPvalueTable(&pvalTable[0]);
+    }
   #pragma omp critical (store_pvec)
     {
+      pvecRow.pvalTableOffset = pvalTables_.size();
+      pvalTables_.insert(pvalTables_.end(), pvalTable.begin(), pvalTable.end());
       pvalVecCollection_.push_back(pvecRow);
     }
         
@@ -138,14 +252,16 @@ void BatchPvalueVectors::calculatePvalueVector(PvalueVectorsDbRow& pvecRow,
   }
 }
 
-void BatchPvalueVectors::sortPvalueVectors() {
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::sortPvalueVectors() {
   if (BatchGlobals::VERB > 2) {
     std::cerr << "Sorting pvalue vectors" << std::endl;
   }
   std::sort(pvalVecCollection_.begin(), pvalVecCollection_.end());
 }
 
-void BatchPvalueVectors::writePvalueVectors(
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::writePvalueVectors(
     const std::string& pvalueVectorsBaseFN) {
   std::string pvalueVectorsFN = pvalueVectorsBaseFN + ".dat";
   std::string pvalueVectorsHeadFN = pvalueVectorsBaseFN + ".head.dat";
@@ -185,7 +301,8 @@ void BatchPvalueVectors::writePvalueVectors(
   }
 }
 
-void BatchPvalueVectors::insert(PvalueVectorsDbRow& pvecRow, std::vector<BatchPvalueVector>& pvecList) {
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::insert(PvalueVectorsDbRow& pvecRow, std::vector<BatchPvalueVector>& pvecList) {
   if (BatchGlobals::VERB > 4) {
     std::cerr << "Inserting pvalue vector into pvalue vectors " <<
                  "table asynchronously" << std::endl;
@@ -208,8 +325,10 @@ void BatchPvalueVectors::insert(PvalueVectorsDbRow& pvecRow, std::vector<BatchPv
   }
 }
 
-void BatchPvalueVectors::readPvalueVectorsFile(const std::string& pvalueVectorsFN,
-    std::vector<PvalueVectorsDbRow>& pvalVecCollection) {  
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::readPvalueVectorsFile(const std::string& pvalueVectorsFN,
+    std::vector<PvalueVectorsDbRow>& pvalVecCollection,
+    std::vector<PolyfitValue>& pvalTables) {  
   if (BatchGlobals::VERB > 1) {
     std::cerr << "Reading in pvalue vectors from " << pvalueVectorsFN << std::endl;
   }
@@ -219,17 +338,11 @@ void BatchPvalueVectors::readPvalueVectorsFile(const std::string& pvalueVectorsF
     return;
   }
 
-  boost::iostreams::mapped_file mmap(pvalueVectorsFN,
-            boost::iostreams::mapped_file::readonly);
+  std::vector<BatchPvalueVector> pvecList;
+  BinaryInterface::read<BatchPvalueVector>(pvalueVectorsFN, pvecList);
   
-  const char* f = mmap.const_data();
-  const char* l = f + mmap.size();
-  
-  errno = 0;
-  BatchPvalueVector tmp;
-  while (errno == 0 && f && f<=(l-sizeof(tmp)) ) {
-    memcpy(&tmp, f, sizeof(tmp));
-    f += sizeof(tmp);
+  pvalVecCollection.reserve(pvalVecCollection.size() + pvecList.size());
+  BOOST_FOREACH (const BatchPvalueVector& tmp, pvecList) {
     PvalueVectorsDbRow pvecRow;
     
     pvecRow.precMass = tmp.precMass;
@@ -239,22 +352,24 @@ void BatchPvalueVectors::readPvalueVectorsFile(const std::string& pvalueVectorsF
     pvecRow.retentionTime = tmp.retentionTime;
     pvecRow.queryCharge = tmp.queryCharge;
     
-    std::vector<unsigned int> peakScores;
-    for (unsigned int j = 0; j < PvalueCalculator::kMaxScoringPeaks; ++j) {
+    pvecRow.numPeakBins = 0u;
+    for (unsigned int j = 0; j < Layout::kMaxScoringPeaks; ++j) {
       if (tmp.peakBins[j] != 0) {
-        pvecRow.peakBins.push_back(tmp.peakBins[j]);
-        peakScores.push_back(tmp.peakScores[j]);
+        pvecRow.peakBins[pvecRow.numPeakBins++] = tmp.peakBins[j];
       } else {
         break;
       }
     }
     
-    std::vector<double> polyfit;
-    for (unsigned int j = 0; j < PvalueCalculator::kPolyfitDegree + 1; ++j) {
-      polyfit.push_back(tmp.polyfit[j]);
-    }
+    pvecRow.pvalCalc.initPolyfit(tmp.peakBins, tmp.peakScores, tmp.polyfit);
+    pvecRow.pvalCalc.initScoreCutoff(dbPvalThreshold_);
+    pvecRow.signature.init(pvecRow.peakBins, pvecRow.numPeakBins);
     
-    pvecRow.pvalCalc.initPolyfit(pvecRow.peakBins, peakScores, polyfit);
+    pvecRow.pvalTableOffset = pvalTables.size();
+    pvalTables.resize(pvalTables.size() + pvecRow.pvalCalc.getPvalueTableSize());
+    if (pvalTables.size() > pvecRow.pvalTableOffset) {
+      pvecRow.pvalCalc.initPvalueTable(&pvalTables[pvecRow.pvalTableOffset]);
+    }
     
     pvalVecCollection.push_back(pvecRow);
   }
@@ -281,15 +396,18 @@ void BatchPvalueVectors::parseBatchOverlapFile(
   }
 }
 
-void BatchPvalueVectors::processOverlapFiles(
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::processOverlapFiles(
     std::vector< std::pair<std::string, std::string> >& overlapFNs) {
   typedef std::pair<std::string, std::string> OverlapPair;
   BOOST_FOREACH(OverlapPair& p, overlapFNs) {
     std::vector<PvalueVectorsDbRow> pvalVecCollectionTail;
     std::vector<PvalueVectorsDbRow> pvalVecCollectionHead;
     
-    readPvalueVectorsFile(p.first, pvalVecCollectionTail);
-    readPvalueVectorsFile(p.second, pvalVecCollectionHead);
+    // the tables of both collections share pvalTables_
+    pvalTables_.clear();
+    readPvalueVectorsFile(p.first, pvalVecCollectionTail, pvalTables_);
+    readPvalueVectorsFile(p.second, pvalVecCollectionHead, pvalTables_);
     
     batchCalculatePvaluesOverlap(pvalVecCollectionTail, pvalVecCollectionHead);
   }
@@ -298,50 +416,113 @@ void BatchPvalueVectors::processOverlapFiles(
   PvalueFilterAndSort::filterAndSort(pvalues_.getPvaluesFN());
 }
 
-void BatchPvalueVectors::parsePvalueVectorFile(const std::string& pvalVecInFileFN) {
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::parsePvalueVectorFile(const std::string& pvalVecInFileFN) {
   if (BatchGlobals::VERB > 2) {
     std::cerr << "Reading p-value vectors file" << std::endl;
   }
-  readPvalueVectorsFile(pvalVecInFileFN, pvalVecCollection_);
+  readPvalueVectorsFile(pvalVecInFileFN, pvalVecCollection_, pvalTables_);
   if (BatchGlobals::VERB > 2) {
     std::cerr << "Read in " << pvalVecCollection_.size() << " p-value vectors from file" << std::endl;
   }
 }
 
-/* This function presumes that the pvalue vectors are sorted by precursor
-   mass by writePvalueVectors() */
-void BatchPvalueVectors::batchCalculatePvalues() {    
+/* Reorders pvalVecCollection_ into contiguous, mass sorted, partitions of 
+   equal charge and query charge. isPvecMatch only matches the rows of a 
+   partition with those of its partner partition, i.e. with charge and query
+   charge swapped, so the partitions are split into tiles of kTileRows rows 
+   that are each paired with the range of their partner. */
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::partitionByCharge(std::vector<ChargeTile>& tiles) {
+  std::sort(pvalVecCollection_.begin(), pvalVecCollection_.end(), 
+            lessChargesAndMass);
+  
+  std::vector<size_t> partitionBegins;
+  size_t n = pvalVecCollection_.size();
+  for (size_t i = 0; i < n; ++i) {
+    if (i == 0 || !isSameCharges(pvalVecCollection_[i-1], pvalVecCollection_[i])) {
+      partitionBegins.push_back(i);
+    }
+  }
+  partitionBegins.push_back(n);
+  
+  size_t numPartitions = partitionBegins.size() - 1;
+  for (size_t p = 0; p < numPartitions; ++p) {
+    const PvalueVectorsDbRow& first = pvalVecCollection_[partitionBegins[p]];
+    for (size_t q = 0; q < numPartitions; ++q) {
+      if (!isPvecMatch(first, pvalVecCollection_[partitionBegins[q]])) {
+        continue;
+      }
+      for (size_t tileBegin = partitionBegins[p]; 
+           tileBegin < partitionBegins[p+1]; tileBegin += kTileRows) {
+        ChargeTile t;
+        t.rowBegin = tileBegin;
+        t.rowEnd = (std::min)(tileBegin + kTileRows, partitionBegins[p+1]);
+        t.partnerBegin = partitionBegins[q];
+        t.partnerEnd = partitionBegins[q+1];
+        tiles.push_back(t);
+      }
+    }
+  }
+}
+
+/* Only the rows within the precursor window and with matching charges are 
+   visited, the rows are reordered by partitionByCharge() for this */
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::batchCalculatePvalues() {    
   if (BatchGlobals::VERB > 1) {
     std::cerr << "Calculating pvalues" << std::endl;
   }
   
-  size_t n = pvalVecCollection_.size();
-  
   time_t startTime;
   time(&startTime);
   clock_t startClock = clock();
   
+  std::vector<ChargeTile> tiles;
+  partitionByCharge(tiles);
+  
   //long long numPvalsNoThresh = 0;
-#pragma omp parallel for schedule(dynamic, 1000)
-  for (size_t i = 0; i < n; ++i) {
-    if (i % 10000 == 0 && BatchGlobals::VERB > 2) {
-      std::cerr << "Processing pvalue vector " << i+1 << "/" << n << " (" <<
-                   i*100/n << "%)." << std::endl;
-      BatchGlobals::reportProgress(startTime, startClock, i, n);
-    }
-    double precLimit = pvalVecCollection_[i].precMass * 
-                       (1 + massRangePPM_*1e-6);
-    std::vector<PvalueTriplet> pvalBuffer;                       
-    for (size_t j = i+1; j < n; ++j) {
-      if (pvalVecCollection_[j].precMass < precLimit) { 
-        calculatePvalues(pvalVecCollection_[i], pvalVecCollection_[j], pvalBuffer);
-        //#pragma omp atomic
-        //++numPvalsNoThresh;
-      } else {
-        break;
+  size_t numTiles = tiles.size();
+#pragma omp parallel
+  {
+    std::vector<PeakScoreLookup> lookups(kTileRows);
+    std::vector<size_t> windowBegins(kTileRows), windowEnds(kTileRows);
+  #pragma omp for schedule(dynamic, 1000 / kTileRows)
+    for (size_t tile = 0; tile < numTiles; ++tile) {
+      const ChargeTile& t = tiles[tile];
+      if (tile % (10000 / kTileRows) == 0 && BatchGlobals::VERB > 2) {
+        std::cerr << "Processing pvalue vector tile " << tile+1 << "/" << numTiles << " (" <<
+                     tile*100/numTiles << "%)." << std::endl;
+        BatchGlobals::reportProgress(startTime, startClock, tile, numTiles);
       }
+      // the windows only contain the rows of the partner range that come 
+      // after the tile's rows in the mass sorted order
+      PvalueVectorsDbRowIterator partnerBegin = 
+          pvalVecCollection_.begin() + t.partnerBegin;
+      size_t windowBegin = t.partnerBegin + (std::upper_bound(partnerBegin, 
+          pvalVecCollection_.begin() + t.partnerEnd, 
+          pvalVecCollection_[t.rowBegin]) - partnerBegin);
+      size_t windowEnd = windowBegin;
+      for (size_t i = t.rowBegin; i < t.rowEnd; ++i) {
+        const PvalueVectorsDbRow& pvecRow = pvalVecCollection_[i];
+        while (windowBegin < t.partnerEnd && 
+               !(pvecRow < pvalVecCollection_[windowBegin])) {
+          ++windowBegin;
+        }
+        double precLimit = pvecRow.precMass * (1 + massRangePPM_*1e-6);
+        windowEnd = (std::max)(windowEnd, windowBegin);
+        while (windowEnd < t.partnerEnd && 
+               pvalVecCollection_[windowEnd].precMass < precLimit) {
+          ++windowEnd;
+        }
+        windowBegins[i - t.rowBegin] = windowBegin;
+        windowEnds[i - t.rowBegin] = windowEnd;
+      }
+      std::vector<PvalueTriplet> pvalBuffer;
+      calculatePvaluesTile(t.rowBegin, t.rowEnd, windowBegins, windowEnds, 
+                           lookups, pvalBuffer);
+      pvalues_.batchWrite(pvalBuffer);
     }
-    pvalues_.batchWrite(pvalBuffer);
   }
   clearPvalueVectors();
   
@@ -355,7 +536,8 @@ void BatchPvalueVectors::batchCalculatePvalues() {
 
 /* This function presumes that the pvalue vectors are sorted by precursor
    mass by writePvalueVectors() */
-void BatchPvalueVectors::batchCalculatePvaluesLibrarySearch(
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::batchCalculatePvaluesLibrarySearch(
     std::vector<BatchSpectrum>& querySpectra) {    
   if (BatchGlobals::VERB > 1) {
     std::cerr << "Calculating pvalues" << std::endl;
@@ -368,30 +550,44 @@ void BatchPvalueVectors::batchCalculatePvaluesLibrarySearch(
   clock_t startClock = clock();
   
   //long long numPvalsNoThresh = 0;
-  int k = 0;
-#pragma omp parallel for schedule(dynamic, 1000)
-  for (size_t i = 0; i < n; ++i) {
-    if (i % 10000 == 0 && BatchGlobals::VERB > 2) {
-      std::cerr << "Processing pvalue vector " << i+1 << "/" << n << " (" <<
-                   i*100/n << "%)." << std::endl;
-      BatchGlobals::reportProgress(startTime, startClock, i, n);
-    }
-    std::vector<PvalueTriplet> pvalBuffer;
-    double precLimitLower = pvalVecCollection_[i].precMass * 
-                         (1 - massRangePPM_*1e-6);
-    double precLimitUpper = pvalVecCollection_[i].precMass * 
-                         (1 + massRangePPM_*1e-6);
-    for (size_t j = 0; j < querySpectra.size(); ++j) {
-      if (querySpectra[j].precMass < precLimitLower) {
-        continue;
+#pragma omp parallel
+  {
+    PeakScoreLookup lookup;
+  #pragma omp for schedule(dynamic, 1000)
+    for (size_t i = 0; i < n; ++i) {
+      if (i % 10000 == 0 && BatchGlobals::VERB > 2) {
+        std::cerr << "Processing pvalue vector " << i+1 << "/" << n << " (" <<
+                     i*100/n << "%)." << std::endl;
+        BatchGlobals::reportProgress(startTime, startClock, i, n);
       }
-      if (querySpectra[j].precMass < precLimitUpper) { 
-        calculatePvalue(pvalVecCollection_[i], querySpectra[j], pvalBuffer);
-      } else {
-        break;
+      std::vector<PvalueTriplet> pvalBuffer;
+      double precLimitLower = pvalVecCollection_[i].precMass * 
+                           (1 - massRangePPM_*1e-6);
+      double precLimitUpper = pvalVecCollection_[i].precMass * 
+                           (1 + massRangePPM_*1e-6);
+      size_t windowEnd = 0, windowSize = 0;
+      for (; windowEnd < querySpectra.size() && 
+             querySpectra[windowEnd].precMass < precLimitUpper; ++windowEnd) {
+        if (querySpectra[windowEnd].precMass >= precLimitLower) ++windowSize;
+      }
+      
+      bool useLookup = !dotProduct_ && (windowSize >= kMinLookupWindowSize);
+      if (useLookup) {
+        pvalVecCollection_[i].pvalCalc.initPeakScoreLookup(
+            pvalVecCollection_[i].peakBins, pvalVecCollection_[i].numPeakBins, lookup);
       }
+      for (size_t j = 0; j < windowEnd; ++j) {
+        if (querySpectra[j].precMass < precLimitLower) {
+          continue;
+        }
+        if (useLookup) {
+          calculatePvalue(pvalVecCollection_[i], lookup, querySpectra[j], pvalBuffer);
+        } else {
+          calculatePvalue(pvalVecCollection_[i], querySpectra[j], pvalBuffer);
+        }
+      }
+      pvalues_.batchWrite(pvalBuffer);
     }
-    pvalues_.batchWrite(pvalBuffer);
   }
   clearPvalueVectors();
   
@@ -403,7 +599,8 @@ void BatchPvalueVectors::batchCalculatePvaluesLibrarySearch(
   PvalueFilterAndSort::filterAndSort(pvalues_.getPvaluesFN());
 }
 
-void BatchPvalueVectors::readFingerprints(
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::readFingerprints(
     std::vector<std::vector<unsigned short> >& mol_features, 
     std::vector<ScanId>& mol_identifiers, 
     std::vector<float>& prec_masses) {
@@ -411,12 +608,12 @@ void BatchPvalueVectors::readFingerprints(
   
   unsigned int mol_count = 0;
   for (size_t i = 0; i < numSpectra; ++i) {
-    PvalueVectorsDbRow s = pvalVecCollection_[i];
+    const PvalueVectorsDbRow& s = pvalVecCollection_[i];
     
     unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaks(s.precMass);
     
     std::vector<unsigned short> features;
-    for (unsigned int j = 0; j < (std::min)(numScoringPeaks, static_cast<unsigned int>(s.peakBins.size())); ++j) {
+    for (unsigned int j = 0; j < (std::min)(numScoringPeaks, s.numPeakBins); ++j) {
       if (s.peakBins[j] != 0) {
         features.push_back(s.peakBins[j]);
       } else {
@@ -436,8 +633,8 @@ void BatchPvalueVectors::readFingerprints(
   }
 }
 
-#ifdef FINGERPRINT_FILTER
-void BatchPvalueVectors::batchCalculatePvaluesJaccardFilter() {    
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::batchCalculatePvaluesJaccardFilter() {    
   std::vector<ScanId> lib_identifiers;
   std::vector<std::vector<unsigned short> > lib_features;
   std::vector<float> lib_prec_masses;
@@ -484,13 +681,12 @@ void BatchPvalueVectors::batchCalculatePvaluesJaccardFilter() {
     if (tmpPvalBuffer.size() > 0) {
       //std::cerr << i << " cand " << tmpPvalBuffer.size() << std::endl;
       
-      BOOST_FOREACH(const PvalueTriplet& t, tmpPvalBuffer) {
-        if (pvalVecCollection_[t.scannr1.scannr].precMass > 
-            pvalVecCollection_[t.scannr2.scannr].precMass * (1 - massRangePPM_*1e-6)) {
-          calculatePvalues(pvalVecCollection_[t.scannr1.scannr], 
-                           pvalVecCollection_[t.scannr2.scannr], pvalBuffer);
-          ++fingerPrintPairCandidatesLocal;
-        }
+      if (dotProduct_) {
+        fingerPrintPairCandidatesLocal = 
+            calculatePvaluesCandidates<DotProductSimilarity>(tmpPvalBuffer, pvalBuffer);
+      } else {
+        fingerPrintPairCandidatesLocal = 
+            calculatePvaluesCandidates<PvalueSimilarity>(tmpPvalBuffer, pvalBuffer);
       }
       
       //std::cerr << i << " real " << pvalBuffer.size() << std::endl;
@@ -523,9 +719,28 @@ void BatchPvalueVectors::batchCalculatePvaluesJaccardFilter() {
   
   PvalueFilterAndSort::filterAndSort(pvalues_.getPvaluesFN());
 }
-#endif
 
-void BatchPvalueVectors::batchCalculatePvaluesOverlap(
+// scores the candidate pairs of the fingerprint filter that are within the 
+// precursor tolerance and returns their number
+template <class Layout>
+template <class SimilarityPolicy>
+size_t BasicBatchPvalueVectors<Layout>::calculatePvaluesCandidates(
+    const std::vector<PvalueTriplet>& candidates,
+    std::vector<PvalueTriplet>& pvalBuffer) {
+  size_t numCandidates = 0u;
+  BOOST_FOREACH(const PvalueTriplet& t, candidates) {
+    if (pvalVecCollection_[t.scannr1.scannr].precMass > 
+        pvalVecCollection_[t.scannr2.scannr].precMass * (1 - massRangePPM_*1e-6)) {
+      calculatePvalues<SimilarityPolicy>(pvalVecCollection_[t.scannr1.scannr], 
+          pvalVecCollection_[t.scannr2.scannr], pvalBuffer);
+      ++numCandidates;
+    }
+  }
+  return numCandidates;
+}
+
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::batchCalculatePvaluesOverlap(
     std::vector<PvalueVectorsDbRow>& pvalVecCollectionTail,
     std::vector<PvalueVectorsDbRow>& pvalVecCollectionHead) {
   if (BatchGlobals::VERB > 1) {
@@ -534,22 +749,21 @@ void BatchPvalueVectors::batchCalculatePvaluesOverlap(
   
   size_t n1 = pvalVecCollectionTail.size();
   size_t n2 = pvalVecCollectionHead.size();
+  PeakScoreLookup lookup;
   for (size_t i = 0; i < n1; ++i) {
     if (i % 10000 == 0 && BatchGlobals::VERB > 2) {
       std::cerr << "Processing pvalue vector " << i+1 << "/" << n1 << std::endl;
     }
     double precLimit = pvalVecCollectionTail[i].precMass * 
                        (1 + massRangePPM_*1e-6);
-    std::vector<PvalueTriplet> pvalBuffer;
-    for (size_t j = 0; j < n2; ++j) {
-      //std::cerr << pvalVecCollectionHead[j].precMass << " " << precLimit << std::endl;
-      if (pvalVecCollectionHead[j].precMass < precLimit) { 
-        //std::cerr << pvalVecCollectionHead[j].precMass << " " << precLimit << std::endl;
-        calculatePvalues(pvalVecCollectionTail[i], pvalVecCollectionHead[j], pvalBuffer);
-      } else {
-        break;
-      }
+    size_t windowEnd = 0;
+    while (windowEnd < n2 && pvalVecCollectionHead[windowEnd].precMass < precLimit) {
+      ++windowEnd;
     }
+    std::vector<PvalueTriplet> pvalBuffer;
+    calculatePvaluesWindow(pvalVecCollectionTail[i], 
+        pvalVecCollectionHead.begin(), 
+        pvalVecCollectionHead.begin() + windowEnd, lookup, pvalBuffer);
     
     pvalues_.batchWrite(pvalBuffer);
   }
@@ -559,58 +773,124 @@ void BatchPvalueVectors::batchCalculatePvaluesOverlap(
   }
 }
 
-void BatchPvalueVectors::calculatePvalues(PvalueVectorsDbRow& pvecRow, 
-    PvalueVectorsDbRow& queryPvecRow, std::vector<PvalueTriplet>& pvalBuffer) {
-  // skip if we are trying to score a spectrum against itself or if the charges
-  // do not match
-  if (queryPvecRow.scannr == pvecRow.scannr || 
-      !isPvecMatch(pvecRow, queryPvecRow)) {
-    return;
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::calculatePvaluesWindow(PvalueVectorsDbRow& pvecRow, 
+    PvalueVectorsDbRowIterator windowBegin,
+    PvalueVectorsDbRowIterator windowEnd,
+    PeakScoreLookup& lookup, std::vector<PvalueTriplet>& pvalBuffer) {
+  if (dotProduct_) {
+    calculatePvaluesWindow<DotProductSimilarity>(pvecRow, windowBegin, 
+        windowEnd, lookup, pvalBuffer);
+  } else {
+    calculatePvaluesWindow<PvalueSimilarity>(pvecRow, windowBegin, 
+        windowEnd, lookup, pvalBuffer);
   }
-#ifdef DOT_PRODUCT
-  double numerator = 0.0, numerator2 = 0.0;
-  std::vector<std::pair<unsigned int, double> > mziPairs, queryMziPairs;
-  double div = pvecRow.peakBins[1];
-  for (size_t i = 0; i < pvecRow.peakBins.size(); i += 2) {
-    double normalizedIntensity = static_cast<double>(pvecRow.peakBins[i+1])/div;
-    mziPairs.push_back(std::make_pair(pvecRow.peakBins[i], normalizedIntensity));
-    numerator += normalizedIntensity*normalizedIntensity;
+}
+
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::calculatePvaluesTile(size_t tileBegin, 
+    size_t tileEnd, const std::vector<size_t>& windowBegins, 
+    const std::vector<size_t>& windowEnds, 
+    std::vector<PeakScoreLookup>& lookups, 
+    std::vector<PvalueTriplet>& pvalBuffer) {
+  if (dotProduct_) {
+    calculatePvaluesTile<DotProductSimilarity>(tileBegin, tileEnd, 
+        windowBegins, windowEnds, lookups, pvalBuffer);
+  } else {
+    calculatePvaluesTile<PvalueSimilarity>(tileBegin, tileEnd, 
+        windowBegins, windowEnds, lookups, pvalBuffer);
   }
-  std::sort(mziPairs.begin(), mziPairs.end());
-  
-  div = queryPvecRow.peakBins[1];
-  for (size_t i = 0; i < queryPvecRow.peakBins.size(); i += 2) {
-    double normalizedIntensity = static_cast<double>(queryPvecRow.peakBins[i+1])/div;
-    queryMziPairs.push_back(std::make_pair(queryPvecRow.peakBins[i], normalizedIntensity));
-    numerator2 += normalizedIntensity*normalizedIntensity;
+}
+
+// scores the rows tileBegin, ..., tileEnd - 1 against the rows of their 
+// windows [windowBegins[k], windowEnds[k]), both bounds are non-decreasing 
+// over the tile. The windows of neighbouring rows mostly overlap, so instead
+// of scanning the whole window for each row, the windows are traversed in 
+// blocks of kTileBlockRows rows, which are scored against all rows of the 
+// tile while they are in cache.
+template <class Layout>
+template <class SimilarityPolicy>
+void BasicBatchPvalueVectors<Layout>::calculatePvaluesTile(size_t tileBegin, 
+    size_t tileEnd, const std::vector<size_t>& windowBegins, 
+    const std::vector<size_t>& windowEnds, 
+    std::vector<PeakScoreLookup>& lookups, 
+    std::vector<PvalueTriplet>& pvalBuffer) {
+  size_t numRows = tileEnd - tileBegin;
+  bool useLookup[kTileRows];
+  for (size_t k = 0; k < numRows; ++k) {
+    PvalueVectorsDbRow& pvecRow = pvalVecCollection_[tileBegin + k];
+    size_t windowSize = windowEnds[k] - windowBegins[k];
+    useLookup[k] = SimilarityPolicy::kUsePeakScoreLookup && 
+                   (windowSize >= kMinLookupWindowSize);
+    if (useLookup[k]) {
+      pvecRow.pvalCalc.initPeakScoreLookup(pvecRow.peakBins, 
+          pvecRow.numPeakBins, lookups[k]);
+    }
   }
-  std::sort(queryMziPairs.begin(), queryMziPairs.end());
-  numerator = std::sqrt(numerator) * std::sqrt(numerator2);
   
-  int candIdx = 0;
-  double dotProduct = 0.0;
-  for (int i = 0; i < mziPairs.size(); ++i) {
-    if (candIdx >= queryMziPairs.size()) break;
-    while (mziPairs[i].first > queryMziPairs[candIdx].first) {
-      if (++candIdx >= queryMziPairs.size()) break;
-    }
-    if (candIdx >= queryMziPairs.size()) break;
-    if (mziPairs[i].first == queryMziPairs[candIdx].first) {
-      dotProduct += mziPairs[i].second*queryMziPairs[candIdx].second;
-      ++candIdx;
+  size_t tileWindowEnd = windowEnds[numRows - 1];
+  for (size_t blockBegin = windowBegins[0]; blockBegin < tileWindowEnd; 
+       blockBegin += kTileBlockRows) {
+    size_t blockEnd = (std::min)(blockBegin + kTileBlockRows, tileWindowEnd);
+    for (size_t k = 0; k < numRows; ++k) {
+      PvalueVectorsDbRow& pvecRow = pvalVecCollection_[tileBegin + k];
+      size_t rowBegin = (std::max)(blockBegin, windowBegins[k]);
+      size_t rowEnd = (std::min)(blockEnd, windowEnds[k]);
+      for (size_t j = rowBegin; j < rowEnd; ++j) {
+        if (useLookup[k]) {
+          calculatePvalues(pvecRow, lookups[k], pvalVecCollection_[j], 
+                           pvalBuffer);
+        } else {
+          calculatePvalues<SimilarityPolicy>(pvecRow, pvalVecCollection_[j], 
+                                             pvalBuffer);
+        }
+      }
     }
   }
-  double cosDist = -100.0 * dotProduct / numerator;
-  if (cosDist < dbPvalThreshold_) {
-    pvalBuffer.push_back(PvalueTriplet(pvecRow.scannr, queryPvecRow.scannr, 
-                                       cosDist));
-    pvalBuffer.push_back(PvalueTriplet(queryPvecRow.scannr, pvecRow.scannr, 
-                                       cosDist));
+}
+
+// scores pvecRow against all rows in the window. For large windows a 
+// PeakScoreLookup of pvecRow is built, so that each pair only needs 
+// lookups of the other row's peaks instead of merging the peak lists.
+template <class Layout>
+template <class SimilarityPolicy>
+void BasicBatchPvalueVectors<Layout>::calculatePvaluesWindow(PvalueVectorsDbRow& pvecRow, 
+    PvalueVectorsDbRowIterator windowBegin,
+    PvalueVectorsDbRowIterator windowEnd,
+    PeakScoreLookup& lookup, std::vector<PvalueTriplet>& pvalBuffer) {
+  bool useLookup = SimilarityPolicy::kUsePeakScoreLookup && 
+      (static_cast<size_t>(windowEnd - windowBegin) >= kMinLookupWindowSize);
+  if (useLookup) {
+    pvecRow.pvalCalc.initPeakScoreLookup(pvecRow.peakBins, pvecRow.numPeakBins, lookup);
+    for (PvalueVectorsDbRowIterator it = windowBegin; it != windowEnd; ++it) {
+      calculatePvalues(pvecRow, lookup, *it, pvalBuffer);
+    }
+  } else {
+    for (PvalueVectorsDbRowIterator it = windowBegin; it != windowEnd; ++it) {
+      calculatePvalues<SimilarityPolicy>(pvecRow, *it, pvalBuffer);
+    }
+  }
+}
+
+// same as calculatePvalues below, with the peak matching done through the
+// PeakScoreLookup of pvecRow
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::calculatePvalues(PvalueVectorsDbRow& pvecRow, 
+    PeakScoreLookup& lookup, PvalueVectorsDbRow& queryPvecRow, 
+    std::vector<PvalueTriplet>& pvalBuffer) {
+  if (queryPvecRow.scannr == pvecRow.scannr || 
+      !isPvecMatch(pvecRow, queryPvecRow) || 
+      !PvalueSimilarity::canPass(pvecRow, queryPvecRow)) {
+    return;
   }
-#else  
-  double queryPval = queryPvecRow.pvalCalc.computePvalPolyfit(pvecRow.peakBins);
+  
+  const PolyfitValue* pvalTables = getPvalTables();
+  double queryPval = queryPvecRow.pvalCalc.computePvalPolyfitWithCutoff(lookup, 
+      queryPvecRow.getPvalTable(pvalTables));
   if (queryPval < dbPvalThreshold_) {
-    double targetPval = pvecRow.pvalCalc.computePvalPolyfit(queryPvecRow.peakBins);
+    double targetPval = pvecRow.pvalCalc.computePvalPolyfitWithCutoff(lookup,
+        queryPvecRow.peakBins, queryPvecRow.numPeakBins, 
+        pvecRow.getPvalTable(pvalTables));
     if (targetPval < dbPvalThreshold_) {
       pvalBuffer.push_back(PvalueTriplet(pvecRow.scannr, queryPvecRow.scannr, 
                                          targetPval));
@@ -618,31 +898,365 @@ void BatchPvalueVectors::calculatePvalues(PvalueVectorsDbRow& pvecRow,
                                          queryPval));
     }
   }
-#endif
 }
 
-void BatchPvalueVectors::calculatePvalue(PvalueVectorsDbRow& pvecRow, 
-                                         BatchSpectrum& querySpectrum,
-                                         std::vector<PvalueTriplet>& pvalBuffer) {  
-  // skip if the charges do not match
-  if (pvecRow.queryCharge != querySpectrum.charge) {
+template <class Layout>
+template <class SimilarityPolicy>
+void BasicBatchPvalueVectors<Layout>::calculatePvalues(PvalueVectorsDbRow& pvecRow, 
+    PvalueVectorsDbRow& queryPvecRow, std::vector<PvalueTriplet>& pvalBuffer) {
+  // skip if we are trying to score a spectrum against itself or if the charges
+  // do not match
+  if (queryPvecRow.scannr == pvecRow.scannr || 
+      !isPvecMatch(pvecRow, queryPvecRow)) {
     return;
   }
   
-  unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaks(querySpectrum.precMass);
-  std::vector<unsigned int> peakBins;
-  peakBins.reserve(numScoringPeaks);
-  for (unsigned int j = 0; j < numScoringPeaks; ++j) {
-    if (querySpectrum.fragBins[j] != 0) {
-      peakBins.push_back(querySpectrum.fragBins[j]);
-    } else {
-      break;
+  double targetPval = 0.0, queryPval = 0.0;
+  if (SimilarityPolicy::score(pvecRow, queryPvecRow, getPvalTables(), 
+                              getDotProductPeaks(),
+                              dbPvalThreshold_, targetPval, queryPval)) {
+    pvalBuffer.push_back(PvalueTriplet(pvecRow.scannr, queryPvecRow.scannr, 
+                                       targetPval));
+    pvalBuffer.push_back(PvalueTriplet(queryPvecRow.scannr, pvecRow.scannr, 
+                                       queryPval));
+  }
+}
+
+template <class PvalueVectorsDbRow>
+bool PvalueSimilarity::score(const PvalueVectorsDbRow& pvecRow, 
+    const PvalueVectorsDbRow& queryPvecRow, 
+    const typename PvalueVectorsDbRow::PolyfitValue* pvalTables, 
+    const DotProductPeak*, 
+    double threshold, double& targetPval, double& queryPval) {
+  return canPass(pvecRow, queryPvecRow) && 
+      pvecRow.pvalCalc.computePvalPolyfitPair(
+          pvecRow.pvalCalc, pvecRow.peakBins, pvecRow.numPeakBins, 
+          queryPvecRow.pvalCalc, queryPvecRow.peakBins, queryPvecRow.numPeakBins,
+          targetPval, queryPval, pvecRow.getPvalTable(pvalTables), 
+          queryPvecRow.getPvalTable(pvalTables)) && 
+      queryPval < threshold && targetPval < threshold;
+}
+
+template <class PvalueVectorsDbRow>
+bool DotProductSimilarity::score(const PvalueVectorsDbRow& pvecRow, 
+    const PvalueVectorsDbRow& queryPvecRow, 
+    const typename PvalueVectorsDbRow::PolyfitValue*, 
+    const DotProductPeak* dotProductPeaks, 
+    double threshold, double& targetPval, double& queryPval) {
+  const DotProductPeak* peaks = pvecRow.getDotProductPeaks(dotProductPeaks);
+  const DotProductPeak* queryPeaks = 
+      queryPvecRow.getDotProductPeaks(dotProductPeaks);
+  size_t numPeaks = pvecRow.numDotProductPeaks;
+  size_t numQueryPeaks = queryPvecRow.numDotProductPeaks;
+  
+  size_t candIdx = 0;
+  double dotProduct = 0.0;
+  for (size_t i = 0; i < numPeaks; ++i) {
+    while (candIdx < numQueryPeaks && peaks[i].bin > queryPeaks[candIdx].bin) {
+      ++candIdx;
+    }
+    if (candIdx >= numQueryPeaks) break;
+    if (peaks[i].bin == queryPeaks[candIdx].bin) {
+      dotProduct += peaks[i].intensity*queryPeaks[candIdx].intensity;
+      ++candIdx;
     }
   }
+  double cosDist = -100.0 * dotProduct / 
+      (pvecRow.dotProductNorm * queryPvecRow.dotProductNorm);
+  targetPval = cosDist;
+  queryPval = cosDist;
+  return cosDist < threshold;
+}
+
+// returns false if the charges do not match, otherwise numPeakBins is set 
+// to the number of scoring peak bins of the query spectrum
+template <class Layout>
+bool BasicBatchPvalueVectors<Layout>::getNumQueryPeakBins(
+    const PvalueVectorsDbRow& pvecRow, const BatchSpectrum& querySpectrum,
+    unsigned int& numPeakBins) {
+  if (pvecRow.queryCharge != static_cast<int>(querySpectrum.charge)) {
+    return false;
+  }
   
-  double targetPval = pvecRow.pvalCalc.computePvalPolyfit(peakBins);
+  unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaks(querySpectrum.precMass);
+  numPeakBins = 0u;
+  while (numPeakBins < numScoringPeaks && querySpectrum.fragBins[numPeakBins] != 0) {
+    ++numPeakBins;
+  }
+  return true;
+}
+
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::calculatePvalue(PvalueVectorsDbRow& pvecRow, 
+                                         BatchSpectrum& querySpectrum,
+                                         std::vector<PvalueTriplet>& pvalBuffer) {  
+  unsigned int numPeakBins = 0u;
+  if (!getNumQueryPeakBins(pvecRow, querySpectrum, numPeakBins)) return;
+  
+  double targetPval = pvecRow.pvalCalc.computePvalPolyfitWithCutoff(
+      querySpectrum.fragBins, numPeakBins, 
+      pvecRow.getPvalTable(getPvalTables()));
   if (targetPval < dbPvalThreshold_) {
     pvalBuffer.push_back(PvalueTriplet(pvecRow.scannr, querySpectrum.scannr, 
                                        targetPval));
   }
 }
+
+template <class Layout>
+void BasicBatchPvalueVectors<Layout>::calculatePvalue(PvalueVectorsDbRow& pvecRow, 
+                                         PeakScoreLookup& lookup,
+                                         BatchSpectrum& querySpectrum,
+                                         std::vector<PvalueTriplet>& pvalBuffer) {  
+  unsigned int numPeakBins = 0u;
+  if (!getNumQueryPeakBins(pvecRow, querySpectrum, numPeakBins)) return;
+  
+  double targetPval = pvecRow.pvalCalc.computePvalPolyfitWithCutoff(lookup, 
+      querySpectrum.fragBins, numPeakBins, 
+      pvecRow.getPvalTable(getPvalTables()));
+  if (targetPval < dbPvalThreshold_) {
+    pvalBuffer.push_back(PvalueTriplet(pvecRow.scannr, querySpectrum.scannr, 
+                                       targetPval));
+  }
+}
+
+template class BasicBatchPvalueVectors<PvalueVectorLayout<double, 20u> >;
+template class BasicBatchPvalueVectors<PvalueVectorLayout<double, 30u> >;
+template class BasicBatchPvalueVectors<DoublePrecisionLayout>;
+template class BasicBatchPvalueVectors<PvalueVectorLayout<float, 20u> >;
+template class BasicBatchPvalueVectors<PvalueVectorLayout<float, 30u> >;
+template class BasicBatchPvalueVectors<SinglePrecisionLayout>;
+
+namespace {
+
+// synthetic p-value vectors of groups of similar spectra, the groups share 
+// their precursor windows in pairs so that dissimilar pairs are scored too.
+// The spectra have up to PvalueCalculator::maxScoringPeaks_ peaks.
+void generateUnitTestVectors(
+    std::vector<BasicBatchPvalueVector<DoublePrecisionLayout> >& pvecList) {
+  PvalueCalculator::setSeed(11);
+  unsigned int numBins = 2000u, numGroups = 40u, numGroupSpectra = 8u;
+  std::vector<double> peakDist(numBins);
+  for (unsigned int bin = 0; bin < numBins; ++bin) {
+    peakDist[bin] = 0.001 + 0.05 * PvalueCalculator::lcg_rand_unif();
+  }
+  
+  PvalueCalculator::Scratch scratch;
+  for (unsigned int group = 0; group < numGroups; ++group) {
+    std::vector<short> groupPeakBins;
+    PvalueCalculator::drawUniquePeakBins(60u, numBins - 1, groupPeakBins);
+    double groupMass = 500.0 + 10.0 * (group / 2);
+    for (unsigned int k = 0; k < numGroupSpectra; ++k) {
+      unsigned int numPeaks = PvalueCalculator::kMinScoringPeaks + 
+          PvalueCalculator::lcg_rand() % (PvalueCalculator::maxScoringPeaks_ - 
+                                          PvalueCalculator::kMinScoringPeaks + 1);
+      std::set<short> peakBinSet;
+      while (peakBinSet.size() < numPeaks) {
+        if (PvalueCalculator::lcg_rand() % 10 < 7) {
+          peakBinSet.insert(groupPeakBins[PvalueCalculator::lcg_rand() % 
+                                          groupPeakBins.size()]);
+        } else {
+          peakBinSet.insert(1 + PvalueCalculator::lcg_rand() % (numBins - 1));
+        }
+      }
+      std::vector<short> peakBins(peakBinSet.begin(), peakBinSet.end());
+      
+      BasicPvalueCalculator<DoublePrecisionLayout> pvalCalc;
+      pvalCalc.initFromPeakBins(&peakBins[0], peakBins.size(), &peakDist[0], 
+                                numBins, scratch);
+      pvalCalc.computePvalVectorPolyfit(scratch);
+      
+      BasicBatchPvalueVector<DoublePrecisionLayout> pvec;
+      pvec.precMass = groupMass * 
+          (1.0 + 1e-6 * (PvalueCalculator::lcg_rand() % 10));
+      pvec.retentionTime = pvecList.size();
+      pvec.charge = 2;
+      pvec.queryCharge = 2;
+      pvec.scannr = ScanId(0, pvecList.size());
+      pvalCalc.copyPolyfit(pvec.peakBins, pvec.peakScores, pvec.polyfit);
+      pvecList.push_back(pvec);
+    }
+  }
+}
+
+// copies the p-value vectors into the records of another layout, which 
+// have to hold all their peaks
+template <class Layout>
+void convertUnitTestVectors(
+    const std::vector<BasicBatchPvalueVector<DoublePrecisionLayout> >& pvecList,
+    std::vector<BasicBatchPvalueVector<Layout> >& layoutPvecList) {
+  BOOST_FOREACH (const BasicBatchPvalueVector<DoublePrecisionLayout>& pvec, 
+                 pvecList) {
+    BasicBatchPvalueVector<Layout> layoutPvec;
+    layoutPvec.precMass = pvec.precMass;
+    layoutPvec.retentionTime = pvec.retentionTime;
+    layoutPvec.charge = pvec.charge;
+    layoutPvec.queryCharge = pvec.queryCharge;
+    layoutPvec.scannr = pvec.scannr;
+    std::copy(pvec.peakBins, pvec.peakBins + Layout::kMaxScoringPeaks, 
+              layoutPvec.peakBins);
+    std::copy(pvec.peakScores, pvec.peakScores + Layout::kMaxScoringPeaks, 
+              layoutPvec.peakScores);
+    for (unsigned int i = 0; i < PvalueCalculator::kNumPolyfitCoeffs; ++i) {
+      layoutPvec.polyfit[i] = 
+          static_cast<typename Layout::PolyfitValue>(pvec.polyfit[i]);
+    }
+    layoutPvecList.push_back(layoutPvec);
+  }
+}
+
+// runs the p-value calculation and the clustering of the maracluster batch 
+// mode on the p-value vectors in the given layout, the members of each 
+// cluster are sorted, as their order depends on the order of the merges
+template <class Layout>
+void calculateUnitTestClusters(
+    const std::vector<BasicBatchPvalueVector<Layout> >& pvecList,
+    const std::string& baseFN, std::map<std::pair<ScanId, ScanId>, float>& edges,
+    std::set<std::vector<ScanId> >& clusters) {
+  std::string pvalueVectorsFN = baseFN + ".pvalue_vectors.dat";
+  std::string pvaluesFN = baseFN + ".pvalues.dat";
+  std::string matrixFN = baseFN + ".pvalue_triplets.dat";
+  std::remove(pvaluesFN.c_str());
+  std::remove(matrixFN.c_str());
+  
+  bool append = false;
+  BinaryInterface::write<BasicBatchPvalueVector<Layout> >(pvecList, 
+      pvalueVectorsFN, append);
+  {
+    BasicBatchPvalueVectors<Layout> pvecs(pvaluesFN);
+    pvecs.parsePvalueVectorFile(pvalueVectorsFN);
+    pvecs.batchCalculatePvalues();
+  }
+  
+  std::vector<PvalueTriplet> pvals;
+  BinaryInterface::read<PvalueTriplet>(pvaluesFN, pvals);
+  BOOST_FOREACH (const PvalueTriplet& t, pvals) {
+    edges[std::make_pair(t.scannr1, t.scannr2)] = t.pval;
+  }
+  
+  std::vector<std::string> pvalFNs(1, pvaluesFN);
+  bool tsvInput = false;
+  bool removeUnidirection = true;
+  PvalueFilterAndSort::filterAndSort(pvalFNs, matrixFN, tsvInput, 
+                                     removeUnidirection);
+  SparseClustering matrix;
+  matrix.initMatrix(matrixFN);
+  matrix.doClustering(BatchPvalueVectors::dbPvalThreshold_);
+  
+  typedef std::pair<ScanId, std::vector<ScanId> > ClusterRow;
+  BOOST_FOREACH (ClusterRow row, matrix.getClusters()) {
+    std::sort(row.second.begin(), row.second.end());
+    clusters.insert(row.second);
+  }
+  
+  std::remove(pvalueVectorsFN.c_str());
+  std::remove(pvaluesFN.c_str());
+  std::remove(matrixFN.c_str());
+}
+
+} // namespace
+
+// the single precision layout may only flip edges with p-values right at 
+// the threshold and has to give the same clusters as the double precision 
+// layout
+bool BatchPvalueVectors::precisionUnitTest() {
+  std::vector<BasicBatchPvalueVector<DoublePrecisionLayout> > doubleVectors;
+  std::vector<BasicBatchPvalueVector<SinglePrecisionLayout> > singleVectors;
+  generateUnitTestVectors(doubleVectors);
+  convertUnitTestVectors(doubleVectors, singleVectors);
+  
+  std::map<std::pair<ScanId, ScanId>, float> doubleEdges, singleEdges;
+  std::set<std::vector<ScanId> > doubleClusters, singleClusters;
+  calculateUnitTestClusters(doubleVectors, 
+      "precision_unit_test.double", doubleEdges, doubleClusters);
+  calculateUnitTestClusters(singleVectors, 
+      "precision_unit_test.single", singleEdges, singleClusters);
+  
+  bool success = true;
+  double tolerance = 1e-3;
+  typedef std::pair<std::pair<ScanId, ScanId>, float> Edge;
+  BOOST_FOREACH (const Edge& edge, doubleEdges) {
+    std::map<std::pair<ScanId, ScanId>, float>::const_iterator it = 
+        singleEdges.find(edge.first);
+    double singlePval = (it != singleEdges.end()) ? it->second : 0.0;
+    if (std::abs(singlePval - edge.second) > tolerance && 
+        std::abs(edge.second - dbPvalThreshold_) > tolerance) {
+      std::cerr << "Single precision p-value of " << edge.first.first << " " 
+                << edge.first.second << " was " << singlePval 
+                << " instead of " << edge.second << std::endl;
+      success = false;
+    }
+  }
+  BOOST_FOREACH (const Edge& edge, singleEdges) {
+    if (doubleEdges.find(edge.first) == doubleEdges.end() && 
+        std::abs(edge.second - dbPvalThreshold_) > tolerance) {
+      std::cerr << "Single precision added the edge " << edge.first.first 
+                << " " << edge.first.second << " with p-value " 
+                << edge.second << std::endl;
+      success = false;
+    }
+  }
+  
+  size_t numMultiClusters = 0u;
+  BOOST_FOREACH (const std::vector<ScanId>& cluster, doubleClusters) {
+    if (cluster.size() > 1u) ++numMultiClusters;
+  }
+  if (doubleEdges.empty() || numMultiClusters == 0u) {
+    std::cerr << "The synthetic spectra gave " << doubleEdges.size() 
+              << " edges and " << numMultiClusters << " clusters" << std::endl;
+    success = false;
+  }
+  if (doubleClusters != singleClusters) {
+    std::cerr << "Single precision gave " << singleClusters.size() 
+              << " instead of " << doubleClusters.size() << " clusters" 
+              << std::endl;
+    success = false;
+  }
+  return success;
+}
+
+// with 20 scoring peaks, create() has to select the layout with a capacity 
+// of 20 peaks, which has to give the same p-values and clusters as the 
+// layout with the full capacity
+bool BatchPvalueVectors::peakLayoutUnitTest() {
+  typedef PvalueVectorLayout<double, 20u> SmallLayout;
+  unsigned int maxScoringPeaks = PvalueCalculator::maxScoringPeaks_;
+  PvalueCalculator::maxScoringPeaks_ = SmallLayout::kMaxScoringPeaks;
+  
+  bool success = true;
+  BatchPvalueVectors* pvecs = create("peak_layout_unit_test.pvalues.dat");
+  if (dynamic_cast<BasicBatchPvalueVectors<SmallLayout>*>(pvecs) == NULL) {
+    std::cerr << "Did not select the layout with a capacity of " 
+              << SmallLayout::kMaxScoringPeaks << " peaks" << std::endl;
+    success = false;
+  }
+  delete pvecs;
+  
+  std::vector<BasicBatchPvalueVector<DoublePrecisionLayout> > fullVectors;
+  std::vector<BasicBatchPvalueVector<SmallLayout> > smallVectors;
+  generateUnitTestVectors(fullVectors);
+  convertUnitTestVectors(fullVectors, smallVectors);
+  
+  std::map<std::pair<ScanId, ScanId>, float> fullEdges, smallEdges;
+  std::set<std::vector<ScanId> > fullClusters, smallClusters;
+  calculateUnitTestClusters(fullVectors, "peak_layout_unit_test.full", 
+                            fullEdges, fullClusters);
+  calculateUnitTestClusters(smallVectors, "peak_layout_unit_test.small", 
+                            smallEdges, smallClusters);
+  
+  if (fullEdges.empty() || fullEdges != smallEdges) {
+    std::cerr << "The layout with a capacity of " 
+              << SmallLayout::kMaxScoringPeaks << " peaks gave " 
+              << smallEdges.size() << " instead of " << fullEdges.size() 
+              << " edges" << std::endl;
+    success = false;
+  }
+  if (fullClusters != smallClusters) {
+    std::cerr << "The layout with a capacity of " 
+              << SmallLayout::kMaxScoringPeaks << " peaks gave " 
+              << smallClusters.size() << " instead of " << fullClusters.size() 
+              << " clusters" << std::endl;
+    success = false;
+  }
+  PvalueCalculator::maxScoringPeaks_ = maxScoringPeaks;
+  return success;
+}
@@ -22,6 +22,9 @@
 #include <sstream>
 #include <vector>
 #include <string>
+#include <map>
+#include <set>
+#include <cstdio>
 
 #include <boost/lexical_cast.hpp>
 #include <boost/foreach.hpp>
@@ -38,36 +41,183 @@
 #include "PvalueFilterAndSort.h"
 #include "PeakCounts.h"
 #include "BatchPvalueVector.h"
+#include "BinaryFingerprintMethods.h"
 
-#ifdef FINGERPRINT_FILTER
-  #include "BinaryFingerprintMethods.h"
-#endif
+// peak of a row as used by the dot product, the intensities are relative to
+// the most intense peak of the row
+struct DotProductPeak {
+  unsigned int bin;
+  double intensity;
+  
+  inline bool operator<(const DotProductPeak& other) const {
+    return bin < other.bin || (bin == other.bin && intensity < other.intensity);
+  }
+};
 
-struct PvalueVectorsDbRow {
+// fixed size and trivially copyable, so that the partitions of p-value 
+// vectors are contiguous arrays that can be sorted by plain copies
+template <class Layout>
+struct BasicPvalueVectorsDbRow {
+  typedef typename Layout::PolyfitValue PolyfitValue;
+  
+  BasicPvalueVectorsDbRow() : numPeakBins(0u), pvalTableOffset(0u), 
+      dotProductOffset(0u), numDotProductPeaks(0u), dotProductNorm(0.0) {}
+  
   double precMass;
   int charge;
   ScanId scannr;
-  std::vector<unsigned int> peakBins;
+  short peakBins[Layout::kMaxScoringPeaks];
+  unsigned int numPeakBins;
   double retentionTime;
   int queryCharge;
-  PvalueCalculator pvalCalc;
+  BasicPvalueCalculator<Layout> pvalCalc;
+  // signature of the peak bins, only set for the p-value similarity
+  PeakSignature signature;
+  // start of the p-value table of pvalCalc in the side array of the 
+  // collection, see BasicPvalueCalculator::initPvalueTable
+  size_t pvalTableOffset;
+  // peaks of the row in the dot product peaks of the collection, sorted by 
+  // bin, and the norm of their intensities. Only set for the dot product, 
+  // the intensities are not kept in the row itself.
+  size_t dotProductOffset;
+  unsigned int numDotProductPeaks;
+  double dotProductNorm;
+  
+  inline const PolyfitValue* getPvalTable(const PolyfitValue* pvalTables) const {
+    return pvalTables ? pvalTables + pvalTableOffset : NULL;
+  }
   
-  inline bool operator<(const PvalueVectorsDbRow& other) const {
+  inline const DotProductPeak* getDotProductPeaks(
+      const DotProductPeak* dotProductPeaks) const {
+    return dotProductPeaks ? dotProductPeaks + dotProductOffset : NULL;
+  }
+  
+  inline bool operator<(const BasicPvalueVectorsDbRow& other) const {
     return precMass < other.precMass || (precMass == other.precMass && scannr < other.scannr);
   }
 };
 
+/**
+ * Similarity measures of pairs of p-value vector rows, used as template 
+ * policies by the scoring loops of BatchPvalueVectors. Both loops are 
+ * instantiated in the same binary and the measure is chosen once per window 
+ * of rows, so the pairs themselves are scored without any dispatch.
+ * score() returns true and sets the similarities of the pair in both 
+ * directions if both pass the threshold.
+ */
+struct PvalueSimilarity {
+  static const bool kUsePeakScoreLookup = true;
+  // the rows' peak signatures bound the number of peaks they share, which 
+  // rejects most pairs that cannot reach either row's score cutoff before
+  // their peaks are matched
+  template <class PvalueVectorsDbRow>
+  static inline bool canPass(const PvalueVectorsDbRow& pvecRow, 
+                             const PvalueVectorsDbRow& queryPvecRow) {
+    unsigned int maxSharedPeaks = pvecRow.signature.maxSharedPeaks(
+        queryPvecRow.signature);
+    return maxSharedPeaks >= pvecRow.pvalCalc.getMinMatchedPeaks() &&
+           maxSharedPeaks >= queryPvecRow.pvalCalc.getMinMatchedPeaks();
+  }
+  template <class PvalueVectorsDbRow>
+  static bool score(const PvalueVectorsDbRow& pvecRow, 
+      const PvalueVectorsDbRow& queryPvecRow, 
+      const typename PvalueVectorsDbRow::PolyfitValue* pvalTables, 
+      const DotProductPeak*, 
+      double threshold, double& targetPval, double& queryPval);
+};
+
+// cosine similarity of the peak intensities, scaled to [-100, 0] so that 
+// lower is better as for the p-values. The normalized peaks of the rows 
+// are precomputed when the rows are initialized, see initDotProductPeaks.
+struct DotProductSimilarity {
+  static const bool kUsePeakScoreLookup = false;
+  template <class PvalueVectorsDbRow>
+  static bool score(const PvalueVectorsDbRow& pvecRow, 
+      const PvalueVectorsDbRow& queryPvecRow, 
+      const typename PvalueVectorsDbRow::PolyfitValue*, 
+      const DotProductPeak* dotProductPeaks, 
+      double threshold, double& targetPval, double& queryPval);
+};
+
+/**
+ * Calculates, stores and scores the p-value vectors of a run. The rows and 
+ * files depend on the layout of the p-value vectors, see PvalueVectorLayout,
+ * which is selected once per run by create(). This class holds the settings
+ * and the interface that BatchSpectra and maracluster use, the layouts are
+ * implemented by BasicBatchPvalueVectors.
+ */
 class BatchPvalueVectors {
  public:
   BatchPvalueVectors(const std::string& pvaluesFN) : pvalues_(pvaluesFN) {}
+  virtual ~BatchPvalueVectors() {}
+  
+  // the p-value vectors in the precision of PvalueCalculator::singlePrecision_
+  // and with the smallest peak capacity of 20, 30 or 40 peaks that holds 
+  // PvalueCalculator::maxScoringPeaks_ peaks
+  static BatchPvalueVectors* create(const std::string& pvaluesFN);
   
   static double massRangePPM_;
   static double dbPvalThreshold_;
+  // use the dot product instead of p-values as similarity measure
+  static bool dotProduct_;
+  // only score the spectrum pairs that pass the fingerprint pre-filter
+  static bool fingerprintFilter_;
+  
+  // minimum number of spectra in the precursor window for which a 
+  // PeakScoreLookup of the window's first spectrum is built
+  static const size_t kMinLookupWindowSize;
+  // number of rows that are scored together against blocks of 
+  // kTileBlockRows rows of their windows by batchCalculatePvalues
+  static const size_t kTileRows = 32u;
+  static const size_t kTileBlockRows;
+  
+  virtual void insertMassChargeCandidate(
+      MassChargeCandidate& mcc, BatchSpectrum& spec) = 0;
+      
+  void initPeakDistributionTable(const std::vector<BatchSpectrum>& spectra,
+                                 const PeakCounts& peakCounts);
+  virtual void batchInsert(const PeakCounts& peakCounts,
+                           bool forceInsert) = 0;
+  
+  virtual void sortPvalueVectors() = 0;
+  virtual void writePvalueVectors(const std::string& pvalueVectorsBaseFN) = 0;
+  
+  virtual void clearPvalueVectors() = 0;
+  virtual void parsePvalueVectorFile(const std::string& pvalVecInFileFN) = 0;
+  void parseBatchOverlapFile(const std::string& overlapBatchFileFN,
+      std::vector< std::pair<std::string, std::string> >& overlapFNs);
+  
+  virtual void processOverlapFiles(
+      std::vector< std::pair<std::string, std::string> >& overlapFNs) = 0;
+  
+  virtual void batchCalculatePvalues() = 0;
+  virtual void batchCalculatePvaluesJaccardFilter() = 0;
+  virtual void batchCalculatePvaluesLibrarySearch(
+    std::vector<BatchSpectrum>& querySpectra) = 0;
+  
+  static bool precisionUnitTest();
+  static bool peakLayoutUnitTest();
+ protected:  
+  BatchPvalues pvalues_;
+  PeakDistributionTable peakDistTable_;
+};
+
+template <class Layout>
+class BasicBatchPvalueVectors : public BatchPvalueVectors {
+ public:
+  typedef BasicPvalueVectorsDbRow<Layout> PvalueVectorsDbRow;
+  typedef typename std::vector<PvalueVectorsDbRow>::iterator PvalueVectorsDbRowIterator;
+  typedef BasicBatchPvalueVector<Layout> BatchPvalueVector;
+  typedef BasicPvalueCalculator<Layout> LayoutPvalueCalculator;
+  typedef typename Layout::PolyfitValue PolyfitValue;
+  
+  BasicBatchPvalueVectors(const std::string& pvaluesFN) : 
+      BatchPvalueVectors(pvaluesFN) {}
   
   void insertMassChargeCandidate(
       MassChargeCandidate& mcc, BatchSpectrum& spec);
       
-  void batchInsert(PeakCounts& peakCounts,
+  void batchInsert(const PeakCounts& peakCounts,
                    bool forceInsert);
   
   void sortPvalueVectors();
@@ -75,8 +225,6 @@ class BatchPvalueVectors {
   
   inline void clearPvalueVectors() { pvalVecBatch_.clear(); }
   void parsePvalueVectorFile(const std::string& pvalVecInFileFN);
-  void parseBatchOverlapFile(const std::string& overlapBatchFileFN,
-      std::vector< std::pair<std::string, std::string> >& overlapFNs);
   
   void processOverlapFiles(std::vector< std::pair<std::string, std::string> >& overlapFNs);
   
@@ -94,29 +242,95 @@ class BatchPvalueVectors {
       std::vector<PvalueVectorsDbRow>& pvalVecCollectionHead);
   
   static void readPvalueVectorsFile(const std::string& pvalueVectorsFN,
-      std::vector<PvalueVectorsDbRow>& pvalVecCollection);
+      std::vector<PvalueVectorsDbRow>& pvalVecCollection,
+      std::vector<PolyfitValue>& pvalTables);
  protected:  
-  BatchPvalues pvalues_;
   std::vector<PvalueVectorsDbRow> pvalVecBatch_, pvalVecCollection_;
+  // p-value tables of the rows that are scored, the rows keep their offset
+  // into this array so that they stay trivially copyable
+  std::vector<PolyfitValue> pvalTables_;
+  
+  inline const PolyfitValue* getPvalTables() const {
+    return pvalTables_.empty() ? NULL : &pvalTables_[0];
+  }
+  
+  // peaks of the rows for the dot product, the rows keep their offset into 
+  // this array in the same way as for pvalTables_
+  std::vector<DotProductPeak> dotProductPeaks_;
+  
+  inline const DotProductPeak* getDotProductPeaks() const {
+    return dotProductPeaks_.empty() ? NULL : &dotProductPeaks_[0];
+  }
   
-  void initPvalCalc(PvalueCalculator& pvalCalc, 
+  // rows of a tile of pvalVecCollection_ together with the range of rows 
+  // with the charge and query charge they can be matched with
+  struct ChargeTile {
+    size_t rowBegin, rowEnd;
+    size_t partnerBegin, partnerEnd;
+  };
+  
+  void partitionByCharge(std::vector<ChargeTile>& tiles);
+  
+  void initPvalCalc(LayoutPvalueCalculator& pvalCalc, 
                            PvalueVectorsDbRow& pvecRow, 
-                           PeakCounts& peakCounts, 
-                           const int numQueryPeaks, const bool polyfit);                
+                           const PeakCounts& peakCounts, 
+                           const int numQueryPeaks, const bool polyfit,
+                           PvalueCalculator::Scratch& scratch);                
   
   void initPvecRow(const MassChargeCandidate& mcc, 
                           const BatchSpectrum& spec,
                           PvalueVectorsDbRow& pvecRow);
+  void initDotProductPeaks(const BatchSpectrum& spec, 
+                           unsigned int numScoringPeaks,
+                           PvalueVectorsDbRow& pvecRow);
   
   void calculatePvalueVector(PvalueVectorsDbRow& pvecRow,
-      PeakCounts& peakCounts);
+      const PeakCounts& peakCounts, PvalueCalculator::Scratch& scratch,
+      std::vector<PolyfitValue>& pvalTable);
   
   void insert(PvalueVectorsDbRow& pvecRow, 
               std::vector<BatchPvalueVector>& pvecList);
+  template <class SimilarityPolicy>
+  void calculatePvalues(PvalueVectorsDbRow& pvecRow, 
+                        PvalueVectorsDbRow& queryPvecRow,
+                        std::vector<PvalueTriplet>& pvalBuffer);
   void calculatePvalues(PvalueVectorsDbRow& pvecRow, 
+                        PeakScoreLookup& lookup,
                         PvalueVectorsDbRow& queryPvecRow,
                         std::vector<PvalueTriplet>& pvalBuffer);
+  void calculatePvaluesWindow(PvalueVectorsDbRow& pvecRow, 
+                              PvalueVectorsDbRowIterator windowBegin,
+                              PvalueVectorsDbRowIterator windowEnd,
+                              PeakScoreLookup& lookup,
+                              std::vector<PvalueTriplet>& pvalBuffer);
+  template <class SimilarityPolicy>
+  void calculatePvaluesWindow(PvalueVectorsDbRow& pvecRow, 
+                              PvalueVectorsDbRowIterator windowBegin,
+                              PvalueVectorsDbRowIterator windowEnd,
+                              PeakScoreLookup& lookup,
+                              std::vector<PvalueTriplet>& pvalBuffer);
+  void calculatePvaluesTile(size_t tileBegin, size_t tileEnd, 
+                            const std::vector<size_t>& windowBegins,
+                            const std::vector<size_t>& windowEnds,
+                            std::vector<PeakScoreLookup>& lookups,
+                            std::vector<PvalueTriplet>& pvalBuffer);
+  template <class SimilarityPolicy>
+  void calculatePvaluesTile(size_t tileBegin, size_t tileEnd, 
+                            const std::vector<size_t>& windowBegins,
+                            const std::vector<size_t>& windowEnds,
+                            std::vector<PeakScoreLookup>& lookups,
+                            std::vector<PvalueTriplet>& pvalBuffer);
+  template <class SimilarityPolicy>
+  size_t calculatePvaluesCandidates(const std::vector<PvalueTriplet>& candidates,
+                                    std::vector<PvalueTriplet>& pvalBuffer);
+  static bool getNumQueryPeakBins(const PvalueVectorsDbRow& pvecRow, 
+                                  const BatchSpectrum& querySpectrum,
+                                  unsigned int& numPeakBins);
+  void calculatePvalue(PvalueVectorsDbRow& pvecRow, 
+                       BatchSpectrum& querySpectrum,
+                       std::vector<PvalueTriplet>& pvalBuffer);
   void calculatePvalue(PvalueVectorsDbRow& pvecRow, 
+                       PeakScoreLookup& lookup,
                        BatchSpectrum& querySpectrum,
                        std::vector<PvalueTriplet>& pvalBuffer);
   
@@ -125,6 +339,20 @@ class BatchPvalueVectors {
     return uuidString + "_" + boost::lexical_cast<std::string>(charge);
   }
   
+  inline static bool isSameCharges(const PvalueVectorsDbRow& a, 
+                                   const PvalueVectorsDbRow& b) {
+    return a.charge == b.charge && a.queryCharge == b.queryCharge;
+  }
+  
+  inline static bool lessChargesAndMass(const PvalueVectorsDbRow& a, 
+                                        const PvalueVectorsDbRow& b) {
+    if (!isSameCharges(a, b)) {
+      return a.charge < b.charge || 
+          (a.charge == b.charge && a.queryCharge < b.queryCharge);
+    }
+    return a < b;
+  }
+  
   inline static bool isPvecMatch(const PvalueVectorsDbRow & pvecRow, 
                                  const PvalueVectorsDbRow & queryPvecRow) {
     return (queryPvecRow.charge == pvecRow.queryCharge) && (queryPvecRow.queryCharge == pvecRow.charge);
@@ -21,10 +21,21 @@ void BatchPvalues::batchWrite(std::vector<PvalueTriplet>& pvalBuffer) {
     std::cerr << "Writing " << pvalBuffer.size() << " pvalues." << std::endl;
   }
   
-  if (pvalBuffer.size() > 0)
+  if (pvalBuffer.size() > 0) {
+    // compress outside of the critical section, so threads do not wait 
+    // for each other's compression
+    std::vector<char> compressedPvals;
+    if (PvalueFilterAndSort::compressPvals_) {
+      BinaryInterface::compressBlocks<PvalueTriplet>(pvalBuffer, compressedPvals);
+    }
 #pragma omp critical (batch_write_pval)
-  {  
-    bool append = true;
-    BinaryInterface::write<PvalueTriplet>(pvalBuffer, pvaluesFN_, append);
+    {  
+      bool append = true;
+      if (compressedPvals.size() > 0) {
+        BinaryInterface::write<char>(compressedPvals, pvaluesFN_, append);
+      } else {
+        BinaryInterface::write<PvalueTriplet>(pvalBuffer, pvaluesFN_, append);
+      }
+    }
   }
 }
@@ -24,6 +24,7 @@
 #include "BatchGlobals.h"
 #include "BinaryInterface.h"
 #include "PvalueTriplet.h"
+#include "PvalueFilterAndSort.h"
 
 class BatchPvalues {
  public:
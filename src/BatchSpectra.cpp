@@ -66,7 +66,7 @@ void BatchSpectra::convertToBatchSpectra(std::string& spectrumFN,
         std::vector<unsigned int> peakBins;
         unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaks(mass);
         BinSpectra::binBinaryTruncated(mziPairs, peakBins, 
-          numScoringPeaks, mcc.mass);
+          numScoringPeaks, mcc.mass, BatchPvalueVectors::dotProduct_);
         
         if (peakBins.size() >= PvalueCalculator::getMinScoringPeaks(mass)) {
           BatchSpectrum bs;
@@ -98,7 +98,7 @@ void BatchSpectra::readBatchSpectra(std::string& batchSpectraFN) {
     std::cerr << "Reading in spectra from " << batchSpectraFN << std::endl;
   }
 
-  if ( !boost::filesystem::exists( batchSpectraFN ) ) {
+  if (!BatchGlobals::fileExists(batchSpectraFN)) {
     std::cerr << "Ignoring missing file " << batchSpectraFN << std::endl;
     return;
   } 
@@ -115,12 +115,13 @@ void BatchSpectra::sortSpectraByPrecMass() {
 }
 
 void BatchSpectra::calculatePvalueVectors(SpectrumFileList& fileList, 
-    PeakCounts& peakCounts) {
+    const PeakCounts& peakCounts) {
   if (BatchGlobals::VERB > 2) {
     std::cerr << "Inserting spectra into database" << std::endl;
   }
   
   sortSpectraByPrecMass();
+  pvecs_->initPeakDistributionTable(spectra_, peakCounts);
   
   size_t numSpectra = spectra_.size();
   //size_t numSpectra = 20000;
@@ -136,10 +137,10 @@ void BatchSpectra::calculatePvalueVectors(SpectrumFileList& fileList,
     
     double precMz = SpectrumHandler::calcPrecMz(spectra_[i].precMass, spectra_[i].charge);
     MassChargeCandidate mcc(spectra_[i].charge, precMz, spectra_[i].precMass);
-    pvecs_.insertMassChargeCandidate(mcc, spectra_[i]);
+    pvecs_->insertMassChargeCandidate(mcc, spectra_[i]);
     
     bool forceInsert = false;
-    pvecs_.batchInsert(peakCounts, forceInsert);
+    pvecs_->batchInsert(peakCounts, forceInsert);
     
     if ((i % 50000 == 0 && BatchGlobals::VERB > 2) || BatchGlobals::VERB > 3) {
       std::cerr << "Successfully inserted spectrum " << i + 1 << "/" << 
@@ -149,37 +150,36 @@ void BatchSpectra::calculatePvalueVectors(SpectrumFileList& fileList,
   }
   
   bool forceInsert = true;
-  pvecs_.batchInsert(peakCounts, forceInsert);  
-  pvecs_.sortPvalueVectors();
+  pvecs_->batchInsert(peakCounts, forceInsert);  
+  pvecs_->sortPvalueVectors();
   
   if (BatchGlobals::VERB > 2) {
     std::cerr << "Successfully inserted spectra into database" << std::endl;
   }
 }
 
-void BatchSpectra::calculatePvalueVectors(PeakCounts& peakCounts) {
+void BatchSpectra::calculatePvalueVectors(const PeakCounts& peakCounts) {
   SpectrumFileList fileList;
   calculatePvalueVectors(fileList, peakCounts);
 }
 
 void BatchSpectra::writePvalueVectors(const std::string& pvalueVectorsBaseFN) {  
-  pvecs_.writePvalueVectors(pvalueVectorsBaseFN);
+  pvecs_->writePvalueVectors(pvalueVectorsBaseFN);
 }
 
 void BatchSpectra::calculatePvalues() {
-#ifdef FINGERPRINT_FILTER
-  pvecs_.batchCalculatePvaluesJaccardFilter();
-#else
-  pvecs_.batchCalculatePvalues();
-#endif
+  if (BatchPvalueVectors::fingerprintFilter_) {
+    pvecs_->batchCalculatePvaluesJaccardFilter();
+  } else {
+    pvecs_->batchCalculatePvalues();
+  }
 }
 
 void BatchSpectra::librarySearch(BatchSpectra& querySpectra) {
   querySpectra.sortSpectraByPrecMass();
-  pvecs_.batchCalculatePvaluesLibrarySearch(querySpectra.spectra_);
+  pvecs_->batchCalculatePvaluesLibrarySearch(querySpectra.spectra_);
 }
 
-#ifdef FINGERPRINT_FILTER
 bool BatchSpectra::readFingerprints(std::string& input_file, 
     std::vector<std::vector<unsigned short> >& mol_features, 
     std::vector<ScanId>& mol_identifiers, 
@@ -223,4 +223,3 @@ bool BatchSpectra::readFingerprints(
   std::cerr << "Molecules read: " << mol_count << endl;
   return 1;
 }
-#endif
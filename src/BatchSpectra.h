@@ -23,6 +23,8 @@
 
 #include <boost/filesystem.hpp>
 
+#include <boost/shared_ptr.hpp>
+
 #include "pwiz/data/msdata/MSDataFile.hpp"
 
 #include "BatchGlobals.h"
@@ -37,7 +39,8 @@
 
 class BatchSpectra {
  public:
-  BatchSpectra(const std::string& pvaluesFN) : pvecs_(pvaluesFN) {}
+  BatchSpectra(const std::string& pvaluesFN) : 
+      pvecs_(BatchPvalueVectors::create(pvaluesFN)) {}
   
   // methods to import spectra
   void setBatchSpectra(std::vector<BatchSpectrum>& spectra) {
@@ -50,8 +53,8 @@ class BatchSpectra {
   
   // methods for p-value vectors
   void calculatePvalueVectors(SpectrumFileList& fileList, 
-    PeakCounts& peakCounts);
-  void calculatePvalueVectors(PeakCounts& peakCounts);
+    const PeakCounts& peakCounts);
+  void calculatePvalueVectors(const PeakCounts& peakCounts);
   void writePvalueVectors(const std::string& pvalueVectorsBaseFN);
   
   // method to calculate p-values
@@ -71,7 +74,7 @@ class BatchSpectra {
   inline static bool lessPrecMass(const BatchSpectrum& a, 
     const BatchSpectrum& b) { return (a.precMass < b.precMass) || (a.precMass == b.precMass && a.scannr < b.scannr); }
  protected:
-  BatchPvalueVectors pvecs_;
+  boost::shared_ptr<BatchPvalueVectors> pvecs_;
   std::vector<BatchSpectrum> spectra_;
   
   void sortSpectraByPrecMass();
@@ -27,6 +27,8 @@ using pwiz::msdata::SpectrumPtr;
 using pwiz::msdata::Spectrum;
 using pwiz::msdata::SelectedIon;
 
+double BatchSpectrumFiles::peakCountSampleRate_ = 1.0;
+
 void BatchSpectrumFiles::splitByPrecursorMass(
     SpectrumFileList& fileList, std::vector<std::string>& datFNs,
     const std::string& peakCountFN, const std::string& scanNrsFN) {
@@ -63,7 +65,36 @@ void BatchSpectrumFiles::getPeakCountsAndPrecursorMasses(
     std::cerr << "Accumulating peak counts and precursor masses" << std::endl;
   }
   
-  PeakCounts peakCountsAccumulated;
+  int numThreads = 1;
+#ifdef _OPENMP
+  numThreads = omp_get_max_threads();
+#endif
+  
+  // in sampling mode, the precursor information of all spectra is read from 
+  // the spectrum metadata, but the peaks are only read for a systematic 
+  // sample within each (file, charge, precursor bin) stratum
+  bool sampling = (peakCountSampleRate_ < 1.0);
+  unsigned int sampleInterval = 1u;
+  if (sampling) {
+    sampleInterval = (std::max)(1u, 
+        static_cast<unsigned int>(1.0 / peakCountSampleRate_ + 0.5));
+    if (BatchGlobals::VERB > 1) {
+      std::cerr << "Estimating peak counts from every " << sampleInterval << 
+          "th spectrum per file and precursor bin" << std::endl;
+    }
+  }
+  
+  // each thread accumulates its files into its own peak counts, which are
+  // merged afterwards by a pairwise tree reduction instead of one at a time
+  // in a critical section. When sampling, each thread alternates between two 
+  // half samples, which are compared to assess convergence.
+  int numHalves = sampling ? 2 : 1;
+  std::vector<PeakCounts> peakCountsPerThread(numHalves * numThreads);
+  std::vector<PeakCounts> precursorCountsPerThread(sampling ? numThreads : 0);
+  std::vector<unsigned long long> numSampledPerThread(numThreads, 0uLL);
+  std::vector<unsigned long long> numSpectraPerThread(numThreads, 0uLL);
+  std::vector< std::vector<double> > precMassesPerThread(numThreads);
+  std::vector< std::vector<PeakDistributionKey> > peakDistKeysPerThread(numThreads);
   
   std::vector<std::string> spectrumFNs = fileList.getFilePaths();
 #pragma omp parallel for schedule(dynamic, 1)  
@@ -74,50 +105,146 @@ void BatchSpectrumFiles::getPeakCountsAndPrecursorMasses(
           " (" << (fileIdx+1)*100/spectrumFNs.size() << "%)." << std::endl;
     }
     
+    int threadIdx = 0;
+#ifdef _OPENMP
+    threadIdx = omp_get_thread_num();
+#endif
+    
     SpectrumListPtr specList;    
   #pragma omp critical (create_msdata)
     {  
       MSDataFile msd(spectrumFN);
       specList = msd.run.spectrumListPtr;
     }
-    PeakCounts peakCounts;
-    std::vector<double> precMasses;
+    std::vector<double>& precMasses = precMassesPerThread[threadIdx];
+    std::vector<PeakDistributionKey>& peakDistKeys = peakDistKeysPerThread[threadIdx];
+    unsigned long long& numSampled = numSampledPerThread[threadIdx];
+    
+    std::map<std::pair<unsigned int, unsigned int>, unsigned int> strataCounts;
     
     size_t numSpectra = specList->size();
     //size_t numSpectra = 2;
+    numSpectraPerThread[threadIdx] += numSpectra;
     
     for (size_t i = 0; i < numSpectra; ++i) {
-      SpectrumPtr s = specList->spectrum(i, true);
-      
-      std::vector<MZIntensityPair> mziPairs;
-      SpectrumHandler::getMZIntensityPairs(s, mziPairs); 
+      bool getBinaryData = !sampling;
+      SpectrumPtr s = specList->spectrum(i, getBinaryData);
       
       std::vector<MassChargeCandidate> mccs;
       SpectrumHandler::getMassChargeCandidates(s, mccs); // returns mccs sorted by charge
+      if (mccs.empty()) continue;
+      
+      int half = 0;
+      bool isSampled = true;
+      if (sampling) {
+        const PeakCounts& peakCounts = peakCountsPerThread[numHalves * threadIdx];
+        unsigned int chargeBin = peakCounts.getChargeBin(mccs.front().charge);
+        std::pair<unsigned int, unsigned int> stratum(chargeBin, 
+            peakCounts.getPrecBin(mccs.front().precMz));
+        isSampled = (strataCounts[stratum]++ % sampleInterval == 0u);
+        if (isSampled) {
+          half = numSampled % 2;
+          s = specList->spectrum(i, true);
+        }
+      }
+      PeakCounts& peakCounts = peakCountsPerThread[numHalves * threadIdx + half];
+      if (isSampled) ++numSampled;
+      
+      std::vector<MZIntensityPair> mziPairs;
+      if (isSampled) SpectrumHandler::getMZIntensityPairs(s, mziPairs); 
+      
       unsigned int lastCharge = 0;
       BOOST_FOREACH (MassChargeCandidate& mcc, mccs) {
         precMasses.push_back(mcc.mass);
+        peakDistKeys.push_back(peakCounts.getPeakDistributionKey(
+            SpectrumHandler::calcPrecMz(mcc.mass, mcc.charge), mcc.charge, 
+            PvalueCalculator::getMaxScoringPeaks(mcc.mass)));
+        
         unsigned int charge = (std::min)(mcc.charge, peakCounts.getMaxCharge());
         if (charge != lastCharge) {
           // in the last bin we do not truncate the spectrum
           if (charge == peakCounts.getMaxCharge()) charge = 100u;
-          unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaks(mcc.mass);
-          peakCounts.addSpectrum(mziPairs, mcc.precMz, charge, mcc.mass, numScoringPeaks);
+          if (isSampled) {
+            unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaks(mcc.mass);
+            peakCounts.addSpectrum(mziPairs, mcc.precMz, charge, mcc.mass, numScoringPeaks);
+          }
+          if (sampling) {
+            precursorCountsPerThread[threadIdx].addPrecursor(mcc.precMz, charge);
+          }
           lastCharge = charge;
         }
       }
     }
-  #pragma omp critical (add_to_peakcount)  
-    {
-      peakCountsAccumulated.add(peakCounts);
-      precMassesAccumulated.insert( precMassesAccumulated.end(), precMasses.begin(), precMasses.end() );
+    
+    std::sort(peakDistKeys.begin(), peakDistKeys.end());
+    peakDistKeys.erase(std::unique(peakDistKeys.begin(), peakDistKeys.end()), 
+                       peakDistKeys.end());
+  }
+  
+  PeakCounts peakCountsAccumulated;
+  if (sampling) {
+    std::vector<PeakCounts> firstHalves, secondHalves;
+    for (int threadIdx = 0; threadIdx < numThreads; ++threadIdx) {
+      firstHalves.push_back(peakCountsPerThread[2*threadIdx]);
+      secondHalves.push_back(peakCountsPerThread[2*threadIdx + 1]);
     }
+    peakCountsPerThread.clear();
+    reducePeakCounts(firstHalves);
+    reducePeakCounts(secondHalves);
+    reducePeakCounts(precursorCountsPerThread);
+    
+    // distance between the background distributions of the two half samples,
+    // this should be close to 0 if the sample is large enough
+    double halfSampleDistance = firstHalves.front().getDistance(secondHalves.front());
+    
+    peakCountsAccumulated = firstHalves.front();
+    peakCountsAccumulated.add(secondHalves.front());
+    peakCountsAccumulated.scaleToSpectrumCounts(precursorCountsPerThread.front());
+    
+    if (BatchGlobals::VERB > 1) {
+      unsigned long long numSampled = std::accumulate(
+          numSampledPerThread.begin(), numSampledPerThread.end(), 0uLL);
+      unsigned long long numSpectra = std::accumulate(
+          numSpectraPerThread.begin(), numSpectraPerThread.end(), 0uLL);
+      std::cerr << "Estimated peak counts from " << numSampled << "/" << 
+          numSpectra << " spectra, distance between half samples: " << 
+          halfSampleDistance << std::endl;
+    }
+  } else {
+    reducePeakCounts(peakCountsPerThread);
+    peakCountsAccumulated = peakCountsPerThread.front();
+    peakCountsPerThread.clear();
   }
   writePeakCounts(peakCountsAccumulated, peakCountFN);
   
+  std::vector<PeakDistributionKey> peakDistKeys;
+  BOOST_FOREACH (const std::vector<PeakDistributionKey>& keys, peakDistKeysPerThread) {
+    peakDistKeys.insert(peakDistKeys.end(), keys.begin(), keys.end());
+  }
+  writePeakDistributionTable(peakCountsAccumulated, peakDistKeys, peakCountFN);
+  
+  BOOST_FOREACH (const std::vector<double>& precMasses, precMassesPerThread) {
+    precMassesAccumulated.insert(precMassesAccumulated.end(), 
+                                 precMasses.begin(), precMasses.end());
+  }
   std::sort(precMassesAccumulated.begin(), precMassesAccumulated.end());
 }
 
+// adds all peak counts into the first element. In each round, element i 
+// receives element i + stride, so the number of sequential merges grows 
+// logarithmically with the number of threads
+void BatchSpectrumFiles::reducePeakCounts(
+    std::vector<PeakCounts>& peakCountsPerThread) {
+  int numPeakCounts = peakCountsPerThread.size();
+  for (int stride = 1; stride < numPeakCounts; stride *= 2) {
+  #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < numPeakCounts - stride; i += 2*stride) {
+      peakCountsPerThread[i].add(peakCountsPerThread[i + stride]);
+      peakCountsPerThread[i + stride] = PeakCounts();
+    }
+  }
+}
+
 void BatchSpectrumFiles::writeScannrs(SpectrumFileList& fileList,
                                       const std::string& scanNrsFN) {
   std::vector<std::string> spectrumFNs = fileList.getFilePaths();
@@ -199,7 +326,7 @@ void BatchSpectrumFiles::writeSplittedPrecursorMassFiles(
           std::vector<unsigned int> peakBins;
           unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaks(mass);
           BinSpectra::binBinaryTruncated(mziPairs, peakBins, 
-            numScoringPeaks, mcc.mass);
+            numScoringPeaks, mcc.mass, BatchPvalueVectors::dotProduct_);
           
           if (peakBins.size() >= PvalueCalculator::getMinScoringPeaks(mass)) {
             BatchSpectrum bs;
@@ -340,18 +467,36 @@ int BatchSpectrumFiles::getPrecMassBin(double precMass, std::vector<double>& lim
   return std::min(std::max(bin, 0), static_cast<int>(limits.size()) - 1);
 }
 
+// precomputes the peak distributions for all precursors, so that the pvalue
+// processes can map them instead of computing them from the peak counts. The
+// peak counts have to be written to peakCountFN first, as the table is 
+// tied to that file by its fingerprint.
+void BatchSpectrumFiles::writePeakDistributionTable(
+    const PeakCounts& peakCountsAccumulated, 
+    std::vector<PeakDistributionKey>& peakDistKeys, 
+    const std::string& peakCountFN) {
+  if (BatchGlobals::VERB > 2) {
+    std::cerr << "Writing peak distributions to file" << std::endl;
+  }
+  
+  PeakDistributionTable peakDistTable;
+  peakCountsAccumulated.generatePeakDistributionTable(peakDistKeys, peakDistTable);
+  peakDistTable.setFingerprint(
+      peakCountsAccumulated.getDistributionTableFingerprint(peakCountFN));
+  peakDistTable.writeToFile(PeakDistributionTable::getFilename(peakCountFN));
+  
+  if (BatchGlobals::VERB > 2) {
+    std::cerr << "Finished writing " << peakDistTable.size() << 
+                 " peak distributions to file" << std::endl;
+  }
+}
+
 void BatchSpectrumFiles::writePeakCounts(PeakCounts& peakCountsAccumulated, 
                                          const std::string& peakCountFN) {
   if (BatchGlobals::VERB > 2) {
     std::cerr << "Writing peak counts to file" << std::endl;
   }
-  std::string serializedPeakCounts;
-  PeakCounts::serializePeakCounts(peakCountsAccumulated, serializedPeakCounts);
-  
-  std::ofstream peakCountStream(peakCountFN.c_str());
-  if (peakCountStream.is_open()) {
-    peakCountStream << serializedPeakCounts;
-  }
+  peakCountsAccumulated.writeToFile(peakCountFN);
   
   if (BatchGlobals::VERB > 2) {
     std::cerr << "Finished writing peak counts to file" << std::endl;
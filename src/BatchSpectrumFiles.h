@@ -21,10 +21,15 @@
 #include <map>
 #include <vector>
 #include <string>
+#include <numeric>
 
 #include <boost/foreach.hpp>
 #include <boost/iostreams/device/mapped_file.hpp>
 
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
 #include "pwiz/data/msdata/MSDataFile.hpp"
 #include "pwiz/data/msdata/MSDataMerger.hpp"
 
@@ -65,6 +70,9 @@ class BatchSpectrumFiles {
   
   static bool limitsUnitTest();
   
+  // fraction of spectra used to estimate the peak counts, 1.0 uses all spectra
+  static double peakCountSampleRate_;
+  
  protected:
   std::string precMassFileFolder_;
   
@@ -86,6 +94,10 @@ class BatchSpectrumFiles {
     std::vector< std::vector<BatchSpectrum> >& batchSpectra,
     std::vector<std::string>& datFNs);
   void writePeakCounts(PeakCounts& peakCountsAccumulated, const std::string& peakCountFN);
+  void reducePeakCounts(std::vector<PeakCounts>& peakCountsPerThread);
+  void writePeakDistributionTable(const PeakCounts& peakCountsAccumulated, 
+    std::vector<PeakDistributionKey>& peakDistKeys, 
+    const std::string& peakCountFN);
   
   static std::string getFilename(const std::string& filepath);
   static std::string getDirectory(const std::string& filepath);
@@ -78,48 +78,34 @@ void BinSpectra::binBinary(std::vector<MZIntensityPair>& mziPairsIn, std::vector
   }
 }
 
-#ifdef DOT_PRODUCT
+// keeps the nPeaks most intense peak bins below the precursor mass. With 
+// withIntensities, as needed for the dot product, every bin is followed by 
+// its scaled intensity and the bins stay ordered by decreasing intensity.
 void BinSpectra::binBinaryTruncated(std::vector<MZIntensityPair>& mziPairs, std::vector<unsigned int>& peakBins, 
-                                      const unsigned int nPeaks, double precMass) {
+                                      const unsigned int nPeaks, double precMass, bool withIntensities) {
   std::map<unsigned int, bool> peakFound;
   peakBins.clear();
   std::sort( mziPairs.begin(), mziPairs.end(), SpectrumHandler::greaterIntensity );
   unsigned int peakCnt = 0;
-  double maxIntensity = mziPairs.begin()->intensity;
+  double maxIntensity = mziPairs.empty() ? 0.0 : mziPairs.begin()->intensity;
   BOOST_FOREACH (const MZIntensityPair& mziPair, mziPairs) {
     if (mziPair.mz < precMass) {
       unsigned int bin = getBin(mziPair.mz);
       if (!peakFound[bin]) {
         peakFound[bin] = true;
         peakBins.push_back(bin);
-        peakBins.push_back(static_cast<unsigned int>(std::sqrt(mziPair.intensity/maxIntensity)*1e4));
+        if (withIntensities) {
+          peakBins.push_back(static_cast<unsigned int>(std::sqrt(mziPair.intensity/maxIntensity)*1e4));
+        }
         ++peakCnt;
       }
       if (peakCnt >= nPeaks) break;
     }
   }
-}
-#else
-void BinSpectra::binBinaryTruncated(std::vector<MZIntensityPair>& mziPairs, std::vector<unsigned int>& peakBins, 
-                                      const unsigned int nPeaks, double precMass) {
-  std::map<unsigned int, bool> peakFound;
-  peakBins.clear();
-  std::sort( mziPairs.begin(), mziPairs.end(), SpectrumHandler::greaterIntensity );
-  unsigned int peakCnt = 0;
-  BOOST_FOREACH (const MZIntensityPair& mziPair, mziPairs) {
-    if (mziPair.mz < precMass) {
-      unsigned int bin = getBin(mziPair.mz);
-      if (!peakFound[bin]) {
-        peakFound[bin] = true;
-        peakBins.push_back(bin);
-        ++peakCnt;
-      }
-      if (peakCnt >= nPeaks) break;
-    }
+  if (!withIntensities) {
+    std::sort(peakBins.begin(), peakBins.end());
   }
-  std::sort(peakBins.begin(), peakBins.end());
 }
-#endif
 
 void BinSpectra::binBinaryPeakPicked(std::vector<MZIntensityPair>& mziPairs, std::vector<unsigned int>& peakBins, 
                                       const unsigned int nPeaks, double precMass, bool reportDuplicates) {
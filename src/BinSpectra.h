@@ -20,6 +20,7 @@
 #include <vector>
 #include <iostream>
 #include <cstring>
+#include <cmath>
 #include <boost/foreach.hpp>
 #include "MZIntensityPair.h"
 #include "SpectrumHandler.h"
@@ -44,7 +45,7 @@ class BinSpectra {
     static unsigned int binDense(std::vector<MZIntensityPair>& mziPairsIn, std::vector<BinnedMZIntensityPair>& mziPairsBinned);
     static void binBinary(std::vector<MZIntensityPair>& mziPairsIn, std::vector<unsigned int>& peakBins, double intThresh = 0.0);
     static void binBinaryTruncated(std::vector<MZIntensityPair>& mziPairsIn, std::vector<unsigned int>& peakBins, 
-                                      const unsigned int nPeaks, double precMass);
+                                      const unsigned int nPeaks, double precMass, bool withIntensities = false);
     static void binBinaryPeakPicked(std::vector<MZIntensityPair>& mziPairsIn, std::vector<unsigned int>& peakBins, 
                                       const unsigned int nPeaks, double precMass, bool reportDuplicates = false);
     static void printIntensities(std::vector<BinnedMZIntensityPair>& mziPairsBinned);
@@ -18,18 +18,42 @@
 #define BINARY_INTERFACE_H
 
 #include <vector>
+#include <string>
 #include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <map>
 
+#include <zlib.h>
+
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/iostreams/device/mapped_file.hpp>
 
+#include "PackedFileStore.h"
+#include "MyException.h"
+
 // TODO: add exception handling
+// all binary intermediate files should go through this interface, such that
+// they end up in the PackedFileStore if it was opened
 class BinaryInterface {
  public:
   template <typename Type>
   static void write(const std::vector<Type>& vec, const std::string& outputFN, 
                     bool append) {
     if (vec.size() > 0) {
+      const char* pointer = reinterpret_cast<const char*>(&vec[0]);
+      size_t bytes = vec.size() * sizeof(vec[0]);
+      forgetBlockIndex(outputFN);
+      if (PackedFileStore::isOpen()) {
+        if (!append) PackedFileStore::reset(outputFN);
+        PackedFileStore::append(outputFN, pointer, bytes);
+        return;
+      }
+      
       std::ofstream outfile;
       if (append) {
         outfile.open(outputFN.c_str(), std::ios_base::app | std::ios_base::binary);
@@ -37,15 +61,77 @@ class BinaryInterface {
         outfile.open(outputFN.c_str(), std::ios_base::out | std::ios_base::binary);
       }
       if (outfile.is_open()) {
-        const char* pointer = reinterpret_cast<const char*>(&vec[0]);
-        size_t bytes = vec.size() * sizeof(vec[0]);
         outfile.write(pointer, bytes);
       }
     }
   }
   
+  // writes vec as a sequence of independently zlib compressed blocks. Appending
+  // to an existing uncompressed file keeps that file uncompressed.
+  template <typename Type>
+  static void writeCompressed(const std::vector<Type>& vec, 
+                              const std::string& outputFN, bool append) {
+    if (append && getRawSize(outputFN) > 0 && !isCompressed(outputFN)) {
+      write<Type>(vec, outputFN, append);
+    } else {
+      std::vector<char> compressed;
+      compressBlocks<Type>(vec, compressed);
+      write<char>(compressed, outputFN, append);
+    }
+  }
+  
+  // the blocks can be compressed outside of critical sections and written
+  // later with write<char>
+  template <typename Type>
+  static void compressBlocks(const std::vector<Type>& vec, 
+                             std::vector<char>& compressed) {
+    size_t elementsPerBlock = (std::max)(static_cast<size_t>(1), 
+                                         kCompressedBlockBytes / sizeof(Type));
+    int numBlocks = (vec.size() + elementsPerBlock - 1) / elementsPerBlock;
+    std::vector< std::vector<char> > blocks(numBlocks);
+    
+    bool success = true;
+#pragma omp parallel for schedule(dynamic, 1) reduction(&&:success)
+    for (int b = 0; b < numBlocks; ++b) {
+      size_t firstElement = b * elementsPerBlock;
+      size_t numElements = (std::min)(elementsPerBlock, vec.size() - firstElement);
+      uLong numBytes = numElements * sizeof(Type);
+      uLongf numCompressedBytes = compressBound(numBytes);
+      
+      blocks[b].resize(sizeof(CompressedBlockHeader) + numCompressedBytes);
+      int status = compress2(
+          reinterpret_cast<Bytef*>(&blocks[b][sizeof(CompressedBlockHeader)]), 
+          &numCompressedBytes, 
+          reinterpret_cast<const Bytef*>(&vec[firstElement]), numBytes, 
+          Z_BEST_SPEED);
+      if (status != Z_OK) success = false;
+      
+      CompressedBlockHeader header;
+      header.magic = kCompressedBlockMagic;
+      header.numBytes = numBytes;
+      header.numCompressedBytes = numCompressedBytes;
+      header.reserved = 0;
+      memcpy(&blocks[b][0], &header, sizeof(header));
+      blocks[b].resize(sizeof(CompressedBlockHeader) + numCompressedBytes);
+    }
+    
+    if (!success) {
+      throw MyException("ERROR: zlib compression of binary block failed.");
+    }
+    
+    BOOST_FOREACH (const std::vector<char>& block, blocks) {
+      compressed.insert(compressed.end(), block.begin(), block.end());
+    }
+  }
+  
   template <typename Type>
   static void read(const std::string& inputFN, std::vector<Type>& vec) {
+    if ((PackedFileStore::isOpen() && PackedFileStore::contains(inputFN)) ||
+        (isCompressionEnabled() && isCompressed(inputFN))) {
+      readRange<Type>(inputFN, 0, getSize(inputFN) / sizeof(Type), vec);
+      return;
+    }
+    
     boost::iostreams::mapped_file mmap(inputFN,
               boost::iostreams::mapped_file::readonly);
     
@@ -60,6 +146,275 @@ class BinaryInterface {
       vec.push_back(tmp);
     }
   }
+  
+  // appends at most maxElements elements to vec, starting at element 
+  // startIdx of the file, and returns the number of elements read
+  template <typename Type>
+  static size_t readRange(const std::string& inputFN, long long startIdx,
+                          size_t maxElements, std::vector<Type>& vec) {
+    if (maxElements == 0) return 0;
+    
+    size_t oldSize = vec.size();
+    vec.resize(oldSize + maxElements);
+    char* pointer = reinterpret_cast<char*>(&vec[oldSize]);
+    long long offset = startIdx * static_cast<long long>(sizeof(Type));
+    long long bytes = maxElements * static_cast<long long>(sizeof(Type));
+    
+    long long bytesRead = 0;
+    BlockIndexPtr index;
+    if (isCompressionEnabled()) index = getBlockIndex(inputFN);
+    if (index && index->compressed) {
+      bytesRead = readCompressedBytes(inputFN, *index, offset, bytes, pointer);
+    } else {
+      bytesRead = readBytes(inputFN, offset, bytes, pointer);
+    }
+    
+    size_t numRead = static_cast<size_t>(bytesRead / sizeof(Type));
+    vec.resize(oldSize + numRead);
+    return numRead;
+  }
+  
+  static bool isCompressed(const std::string& fileName) {
+    return isCompressionEnabled() && getBlockIndex(fileName)->compressed;
+  }
+  
+  // files are only checked for compressed blocks if compression was enabled 
+  // (-Z), otherwise all files are read as they are
+  static void setCompressionEnabled(bool enabled) {
+    compressionEnabled() = enabled;
+  }
+  
+  static bool isCompressionEnabled() {
+    return compressionEnabled();
+  }
+  
+  static bool exists(const std::string& fileName) {
+    if (PackedFileStore::isOpen() && PackedFileStore::contains(fileName)) {
+      return true;
+    }
+    std::ifstream infile(fileName.c_str());
+    return infile.good();
+  }
+  
+  // returns the (uncompressed) file size in bytes, or 0 if the file does not 
+  // exist
+  static long long getSize(const std::string& fileName) {
+    if (!isCompressionEnabled()) return getRawSize(fileName);
+    return getBlockIndex(fileName)->numBytes;
+  }
+  
+  static void remove(const std::string& fileName) {
+    forgetBlockIndex(fileName);
+    if (PackedFileStore::isOpen() && PackedFileStore::contains(fileName)) {
+      PackedFileStore::remove(fileName);
+    } else {
+      std::remove(fileName.c_str());
+    }
+  }
+  
+ private:
+  static const unsigned int kCompressedBlockMagic = 0x425a524du; // "MRZB"
+  static const size_t kCompressedBlockBytes = 1 << 20;
+  
+  struct CompressedBlockHeader {
+    unsigned int magic;
+    unsigned int numBytes;
+    unsigned int numCompressedBytes;
+    unsigned int reserved;
+  };
+  
+  struct CompressedBlock {
+    long long fileOffset; // start of the compressed data
+    long long offset; // start of the uncompressed data
+    unsigned int numBytes;
+    unsigned int numCompressedBytes;
+  };
+  
+  // the blocks of a file, such that chunked reads of a compressed file only 
+  // scan its block headers once. The indices are immutable once they are 
+  // cached.
+  struct BlockIndex {
+    bool compressed;
+    long long numBytes; // uncompressed file size
+    std::vector<CompressedBlock> blocks;
+  };
+  typedef boost::shared_ptr<const BlockIndex> BlockIndexPtr;
+  
+  static bool& compressionEnabled() {
+    static bool enabled = false;
+    return enabled;
+  }
+  
+  static std::map<std::string, BlockIndexPtr>& blockIndexCache() {
+    static std::map<std::string, BlockIndexPtr> cache;
+    return cache;
+  }
+  
+  // returns the cached block index of the file. Only a cache miss looks at 
+  // the file itself, write() and remove() drop the cached index, so all 
+  // modifications of the file have to go through this interface.
+  static BlockIndexPtr getBlockIndex(const std::string& fileName) {
+    BlockIndexPtr index;
+#pragma omp critical (binary_block_index)
+    {
+      std::map<std::string, BlockIndexPtr>::const_iterator it = 
+          blockIndexCache().find(fileName);
+      if (it != blockIndexCache().end()) {
+        index = it->second;
+      }
+    }
+    if (!index) {
+      boost::shared_ptr<BlockIndex> newIndex(new BlockIndex());
+      readBlockIndex(fileName, *newIndex, getRawSize(fileName));
+      index = newIndex;
+#pragma omp critical (binary_block_index)
+      {
+        blockIndexCache()[fileName] = index;
+      }
+    }
+    return index;
+  }
+  
+  static void forgetBlockIndex(const std::string& fileName) {
+#pragma omp critical (binary_block_index)
+    {
+      blockIndexCache().erase(fileName);
+    }
+  }
+  
+  static long long getRawSize(const std::string& fileName) {
+    if (PackedFileStore::isOpen() && PackedFileStore::contains(fileName)) {
+      return PackedFileStore::size(fileName);
+    }
+    std::ifstream in(fileName.c_str(), std::ios::ate | std::ios::binary);
+    if (in.is_open()) {
+      return static_cast<long long>(in.tellg());
+    } else {
+      return 0LL;
+    }
+  }
+  
+  static long long readBytes(const std::string& fileName, long long offset,
+                             long long numBytes, char* buffer) {
+    std::ifstream infile;
+    openForReading(fileName, infile);
+    return readBytes(fileName, infile, offset, numBytes, buffer);
+  }
+  
+  // files in the PackedFileStore are read through the store instead of infile
+  static void openForReading(const std::string& fileName, 
+                             std::ifstream& infile) {
+    if (!(PackedFileStore::isOpen() && PackedFileStore::contains(fileName))) {
+      infile.open(fileName.c_str(), std::ios_base::in | std::ios_base::binary);
+    }
+  }
+  
+  static long long readBytes(const std::string& fileName, std::ifstream& infile,
+      long long offset, long long numBytes, char* buffer) {
+    if (PackedFileStore::isOpen() && PackedFileStore::contains(fileName)) {
+      return PackedFileStore::read(fileName, offset, numBytes, buffer);
+    }
+    infile.clear();
+    if (infile.is_open() && infile.seekg(offset)) {
+      infile.read(buffer, numBytes);
+      return infile.gcount();
+    }
+    return 0LL;
+  }
+  
+  // scans the block headers of the first fileSize bytes of the file through
+  // a single stream, files without the block magic are uncompressed
+  static void readBlockIndex(const std::string& fileName, BlockIndex& index,
+                             long long fileSize) {
+    std::ifstream infile;
+    openForReading(fileName, infile);
+    
+    unsigned int magic = 0;
+    long long bytesRead = readBytes(fileName, infile, 0, sizeof(magic), 
+                                    reinterpret_cast<char*>(&magic));
+    index.compressed = (bytesRead == sizeof(magic) && 
+                        magic == kCompressedBlockMagic);
+    index.numBytes = fileSize;
+    if (!index.compressed) return;
+    
+    std::vector<CompressedBlock>& blocks = index.blocks;
+    long long fileOffset = 0, offset = 0;
+    CompressedBlockHeader header;
+    while (fileOffset + static_cast<long long>(sizeof(header)) <= fileSize) {
+      readBytes(fileName, infile, fileOffset, sizeof(header), 
+                reinterpret_cast<char*>(&header));
+      if (header.magic != kCompressedBlockMagic) {
+        std::ostringstream ss;
+        ss << "ERROR: corrupt compressed block in " << fileName 
+           << " at byte " << fileOffset << std::endl;
+        throw MyException(ss);
+      }
+      CompressedBlock block;
+      block.fileOffset = fileOffset + sizeof(header);
+      block.offset = offset;
+      block.numBytes = header.numBytes;
+      block.numCompressedBytes = header.numCompressedBytes;
+      blocks.push_back(block);
+      
+      fileOffset = block.fileOffset + block.numCompressedBytes;
+      offset += block.numBytes;
+    }
+    index.numBytes = offset;
+  }
+  
+  // reads the uncompressed bytes [offset, offset + numBytes) of a compressed 
+  // file, the blocks overlapping with this range are decompressed in parallel
+  static long long readCompressedBytes(const std::string& fileName, 
+      const BlockIndex& index, long long offset, long long numBytes, 
+      char* buffer) {
+    std::vector<CompressedBlock> blocks;
+    BOOST_FOREACH (const CompressedBlock& block, index.blocks) {
+      if (block.offset + block.numBytes > offset && 
+          block.offset < offset + numBytes) {
+        blocks.push_back(block);
+      }
+    }
+    
+    int numBlocks = blocks.size();
+    std::vector< std::vector<char> > compressed(numBlocks);
+    std::ifstream infile;
+    openForReading(fileName, infile);
+    for (int b = 0; b < numBlocks; ++b) {
+      compressed[b].resize(blocks[b].numCompressedBytes);
+      readBytes(fileName, infile, blocks[b].fileOffset, 
+                blocks[b].numCompressedBytes, &compressed[b][0]);
+    }
+    
+    bool success = true;
+    long long bytesRead = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:bytesRead) reduction(&&:success)
+    for (int b = 0; b < numBlocks; ++b) {
+      std::vector<char> uncompressed(blocks[b].numBytes);
+      uLongf numUncompressedBytes = blocks[b].numBytes;
+      int status = uncompress(reinterpret_cast<Bytef*>(&uncompressed[0]), 
+          &numUncompressedBytes, 
+          reinterpret_cast<const Bytef*>(&compressed[b][0]), 
+          blocks[b].numCompressedBytes);
+      if (status != Z_OK || numUncompressedBytes != blocks[b].numBytes) {
+        success = false;
+        continue;
+      }
+      
+      long long first = (std::max)(offset, blocks[b].offset);
+      long long last = (std::min)(offset + numBytes, 
+                                  blocks[b].offset + blocks[b].numBytes);
+      memcpy(buffer + (first - offset), 
+             &uncompressed[first - blocks[b].offset], last - first);
+      bytesRead += last - first;
+    }
+    
+    if (!success) {
+      std::ostringstream ss;
+      ss << "ERROR: could not decompress blocks of " << fileName << std::endl;
+      throw MyException(ss);
+    }
+    return bytesRead;
+  }
 };
 
 #endif
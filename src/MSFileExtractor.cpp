@@ -109,7 +109,7 @@ void MSFileExtractor::extractSpectra() {
 }
 
 void MSFileExtractor::extractToBatchSpectrumList(
-    std::vector<BatchSpectrum>& batchSpectra) {
+    std::vector<BatchSpectrum>& batchSpectra, bool withIntensities) {
   std::cerr << "Extracting spectra!\n";
   
   std::vector< std::vector<ScanId> > scanIdsByFile;
@@ -150,7 +150,8 @@ void MSFileExtractor::extractToBatchSpectrumList(
           
           unsigned int numScoringPeaks = PvalueCalculator::getMaxScoringPeaks(bs.precMass);
           std::vector<unsigned int> peakBins;
-          BinSpectra::binBinaryTruncated(mziPairs, peakBins, numScoringPeaks, bs.precMass);
+          BinSpectra::binBinaryTruncated(mziPairs, peakBins, numScoringPeaks, 
+                                         bs.precMass, withIntensities);
           if (peakBins.size() >= PvalueCalculator::getMinScoringPeaks(bs.precMass)) {
             std::copy(peakBins.begin(), peakBins.end(), bs.fragBins);
             batchSpectra.push_back(bs);
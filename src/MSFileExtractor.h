@@ -41,7 +41,8 @@ class MSFileExtractor : public MSFileHandler {
     const std::string& filePathOrig, const std::string& filePathMerged);
   
   void extractSpectra();  
-  void extractToBatchSpectrumList(std::vector<BatchSpectrum>& batchSpectra);
+  void extractToBatchSpectrumList(std::vector<BatchSpectrum>& batchSpectra,
+                                  bool withIntensities = false);
   
  protected:
   std::string spectrumOutFN_;
@@ -51,23 +51,34 @@ bool MatrixLoader::nextEdge(unsigned int& row, unsigned int& col, double& value)
 */
 
 bool MatrixLoader::initStream(const std::string& matrixFN) {
-  matrixStream_.open(matrixFN.c_str(), std::ios::in | std::ios::binary);
-  if (!matrixStream_.is_open()) {
+  if (!BinaryInterface::exists(matrixFN)) {
     std::cerr << "Could not open matrix file " << matrixFN << std::endl;
     return false;
   } else {
+    matrixFN_ = matrixFN;
     numPvals_ = estimateNumPvals(matrixFN);
+    nextPvalIdx_ = 0;
+    buffer_.clear();
+    bufferIdx_ = 0;
     edgesAvailable_ = true;
     return true;
   }
 }
 
-// reads in a sparse matrix from a tab delimited file, organised as: fileIdx1 <tab> scannr1 <tab> fileIdx2 <tab> scannr2 <tab> pvalue
+// refills the read buffer with the next chunk of p-values from the matrix file
+bool MatrixLoader::fillBuffer() {
+  buffer_.clear();
+  bufferIdx_ = 0;
+  size_t numRead = BinaryInterface::readRange<PvalueTriplet>(matrixFN_,
+                       nextPvalIdx_, kBufferSize, buffer_);
+  nextPvalIdx_ += numRead;
+  return numRead > 0;
+}
+
+// reads in a sparse matrix from a binary file of PvalueTriplets
 bool MatrixLoader::nextEdge(ScanId& row, ScanId& col, double& value) {  
-  PvalueTriplet tmp;
-  char buffer[sizeof(PvalueTriplet)];
-  if (matrixStream_.read(buffer, sizeof(PvalueTriplet))) {
-    memcpy(&tmp, buffer, sizeof(tmp));
+  if (bufferIdx_ < buffer_.size() || fillBuffer()) {
+    const PvalueTriplet& tmp = buffer_[bufferIdx_++];
     row = tmp.scannr1;
     col = tmp.scannr2;
     value = tmp.pval;
@@ -79,15 +90,17 @@ bool MatrixLoader::nextEdge(ScanId& row, ScanId& col, double& value) {
 }
 
 bool MatrixLoader::nextNEdges(unsigned int n, std::vector<PvalueTriplet>& pvec) {  
-  PvalueTriplet tmp;
-  char buffer[sizeof(PvalueTriplet)];
   unsigned int i = 0;
-  while (++i <= n && matrixStream_.read(buffer, sizeof(PvalueTriplet))) {
-    memcpy(&tmp, buffer, sizeof(tmp));
-    pvec.push_back(tmp);
+  while (i < n && (bufferIdx_ < buffer_.size() || fillBuffer())) {
+    size_t numCopy = (std::min)(static_cast<size_t>(n - i), 
+                                buffer_.size() - bufferIdx_);
+    pvec.insert(pvec.end(), buffer_.begin() + bufferIdx_, 
+                buffer_.begin() + bufferIdx_ + numCopy);
+    bufferIdx_ += numCopy;
+    i += numCopy;
   }
   
-  if (i > n) {
+  if (i >= n) {
     return true;
   } else {
     edgesAvailable_ = false;
@@ -135,6 +148,5 @@ long long MatrixLoader::estimateNumPvals(const std::string& pvalFN) {
 }
 
 long long MatrixLoader::getFileSize(const std::string& pvalFN) {
-  std::ifstream in(pvalFN.c_str(), std::ios::ate | std::ios::binary);
-  return static_cast<long long>(in.tellg());
+  return BinaryInterface::getSize(pvalFN);
 }
@@ -26,13 +26,14 @@
 
 #include "SpectrumFileList.h"
 #include "PvalueTriplet.h"
+#include "BinaryInterface.h"
 
 #include <cerrno>
 #include <boost/iostreams/device/mapped_file.hpp>
 
 class MatrixLoader {
  public:
-  MatrixLoader() : edgesAvailable_(false) {}
+  MatrixLoader() : nextPvalIdx_(0), bufferIdx_(0), edgesAvailable_(false) {}
   
   long long numPvals_;
   
@@ -42,8 +43,15 @@ class MatrixLoader {
   
   bool hasEdgesAvailable() { return edgesAvailable_; }
  protected:
+  static const size_t kBufferSize = 100000;
+  
   SpectrumFileList fileList_;
-  std::ifstream matrixStream_;
+  std::string matrixFN_;
+  long long nextPvalIdx_;
+  std::vector<PvalueTriplet> buffer_;
+  size_t bufferIdx_;
+  
+  bool fillBuffer();
   
   static long long estimateNumPvals(const std::string& pvalFN);
   static long long getFileSize(const std::string& pvalFN);
@@ -0,0 +1,306 @@
+/******************************************************************************
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+ ******************************************************************************/
+
+#include "PackedFileStore.h"
+
+bool PackedFileStore::isOpen_ = false;
+std::string PackedFileStore::storeFN_ = "";
+std::fstream PackedFileStore::store_;
+long long PackedFileStore::endOffset_ = 0;
+std::map<std::string, PackedFileStore::ExtentList> PackedFileStore::extentTable_;
+PackedFileStore::MappingPtr PackedFileStore::mapping_;
+
+void PackedFileStore::open(const std::string& storeFN) {
+  if (isOpen_) close();
+
+  // make sure the file exists, fstream with in|out does not create it
+  {
+    std::ofstream touch(storeFN.c_str(),
+                        std::ios_base::app | std::ios_base::binary);
+  }
+
+  store_.open(storeFN.c_str(),
+              std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+  if (!store_.is_open()) {
+    std::ostringstream ss;
+    ss << "ERROR: Could not open intermediate file store " << storeFN
+       << std::endl;
+    throw MyException(ss);
+  }
+
+  storeFN_ = storeFN;
+  isOpen_ = true;
+  scanRecords();
+}
+
+void PackedFileStore::close() {
+  if (isOpen_) {
+    store_.close();
+    mapping_.reset();
+    extentTable_.clear();
+    endOffset_ = 0;
+    isOpen_ = false;
+  }
+}
+
+// rebuilds the extent table from the record headers, a truncated record at
+// the end of the store (e.g. from an interrupted run) is ignored and will be
+// overwritten by the next append
+void PackedFileStore::scanRecords() {
+  extentTable_.clear();
+
+  store_.seekg(0, std::ios_base::end);
+  long long storeSize = static_cast<long long>(store_.tellg());
+
+  long long offset = 0;
+  RecordHeader header;
+  std::vector<char> nameBuffer;
+  while (offset + static_cast<long long>(sizeof(header)) <= storeSize) {
+    store_.seekg(offset);
+    store_.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!store_ || header.magic != kMagic) break;
+
+    long long payloadOffset = offset + sizeof(header) + header.nameLength;
+    if (payloadOffset + header.numBytes > storeSize) break;
+
+    nameBuffer.resize(header.nameLength);
+    if (header.nameLength > 0) {
+      store_.read(&nameBuffer[0], header.nameLength);
+      if (!store_) break;
+    }
+    std::string name(nameBuffer.begin(), nameBuffer.end());
+
+    applyRecord(static_cast<RecordType>(header.type), name,
+                payloadOffset, header.numBytes);
+    offset = payloadOffset + header.numBytes;
+  }
+  store_.clear();
+  endOffset_ = offset;
+
+  if (offset < storeSize) {
+    std::cerr << "WARNING: ignoring " << storeSize - offset << " bytes of "
+              << "incomplete records at the end of " << storeFN_ << std::endl;
+  }
+}
+
+void PackedFileStore::applyRecord(RecordType type, const std::string& name,
+    long long payloadOffset, long long numBytes) {
+  switch (type) {
+    case APPEND: {
+      ExtentList& extentList = extentTable_[name];
+      extentList.extents.push_back(Extent(payloadOffset, numBytes));
+      extentList.numBytes += numBytes;
+      break;
+    }
+    case RESET:
+      extentTable_[name] = ExtentList();
+      break;
+    case REMOVE:
+      extentTable_.erase(name);
+      break;
+  }
+}
+
+void PackedFileStore::writeRecord(RecordType type, const std::string& name,
+    const char* data, long long numBytes) {
+  RecordHeader header;
+  header.magic = kMagic;
+  header.type = type;
+  header.nameLength = name.size();
+  header.reserved = 0;
+  header.numBytes = numBytes;
+
+  store_.seekp(endOffset_);
+  store_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  store_.write(name.data(), name.size());
+  if (numBytes > 0) store_.write(data, numBytes);
+  store_.flush();
+
+  long long payloadOffset = endOffset_ + sizeof(header) + name.size();
+  applyRecord(type, name, payloadOffset, numBytes);
+  endOffset_ = payloadOffset + numBytes;
+}
+
+bool PackedFileStore::contains(const std::string& name) {
+  bool found = false;
+#pragma omp critical (packed_file_store)
+  {
+    found = (extentTable_.find(name) != extentTable_.end());
+  }
+  return found;
+}
+
+long long PackedFileStore::size(const std::string& name) {
+  long long numBytes = 0;
+#pragma omp critical (packed_file_store)
+  {
+    std::map<std::string, ExtentList>::const_iterator it = extentTable_.find(name);
+    if (it != extentTable_.end()) numBytes = it->second.numBytes;
+  }
+  return numBytes;
+}
+
+void PackedFileStore::append(const std::string& name, const char* data,
+    long long numBytes) {
+  bool success = true;
+#pragma omp critical (packed_file_store)
+  {
+    writeRecord(APPEND, name, data, numBytes);
+    success = store_.good();
+  }
+  if (!success) {
+    std::ostringstream ss;
+    ss << "ERROR: Could not write " << name << " to intermediate file store "
+       << storeFN_ << std::endl;
+    throw MyException(ss);
+  }
+}
+
+void PackedFileStore::reset(const std::string& name) {
+#pragma omp critical (packed_file_store)
+  {
+    writeRecord(RESET, name, NULL, 0);
+  }
+}
+
+void PackedFileStore::remove(const std::string& name) {
+#pragma omp critical (packed_file_store)
+  {
+    if (extentTable_.find(name) != extentTable_.end()) {
+      writeRecord(REMOVE, name, NULL, 0);
+    }
+  }
+}
+
+// maps the store again if the current mapping ends before minSize, which 
+// has to be called inside the packed_file_store critical section
+PackedFileStore::MappingPtr PackedFileStore::getMapping(long long minSize) {
+  if (!mapping_ || static_cast<long long>(mapping_->size()) < minSize) {
+    mapping_.reset(new boost::iostreams::mapped_file_source(storeFN_, 
+        static_cast<size_t>(endOffset_)));
+  }
+  return mapping_;
+}
+
+// reads up to numBytes starting at offset of the logical file into buffer and
+// returns the number of bytes read
+long long PackedFileStore::read(const std::string& name, long long offset,
+    long long numBytes, char* buffer) {
+  // the parts of the extents that overlap the requested range
+  std::vector<Extent> chunks;
+  MappingPtr mapping;
+#pragma omp critical (packed_file_store)
+  {
+    std::map<std::string, ExtentList>::const_iterator it = extentTable_.find(name);
+    if (it != extentTable_.end()) {
+      long long extentStart = 0, numBytesFound = 0, mappedEnd = 0;
+      BOOST_FOREACH (const Extent& extent, it->second.extents) {
+        if (numBytesFound >= numBytes) break;
+        long long extentEnd = extentStart + extent.numBytes;
+        if (offset < extentEnd) {
+          long long skip = (std::max)(0LL, offset - extentStart);
+          long long chunk = (std::min)(extent.numBytes - skip,
+                                       numBytes - numBytesFound);
+          if (chunk > 0) {
+            chunks.push_back(Extent(extent.offset + skip, chunk));
+            mappedEnd = (std::max)(mappedEnd, extent.offset + skip + chunk);
+          }
+          numBytesFound += chunk;
+          offset = extentEnd;
+        }
+        extentStart = extentEnd;
+      }
+      if (mappedEnd > 0) mapping = getMapping(mappedEnd);
+    }
+  }
+  
+  long long numBytesRead = 0;
+  BOOST_FOREACH (const Extent& chunk, chunks) {
+    std::copy(mapping->data() + chunk.offset, 
+              mapping->data() + chunk.offset + chunk.numBytes, 
+              buffer + numBytesRead);
+    numBytesRead += chunk.numBytes;
+  }
+  return numBytesRead;
+}
+
+bool PackedFileStore::unitTest() {
+  std::string storeFN = "packed_file_store_unit_test.dat";
+  std::remove(storeFN.c_str());
+
+  bool success = true;
+  open(storeFN);
+
+  std::string a = "abcdef", b = "ghij", c = "xyz";
+  append("a", a.data(), a.size());
+  append("b", b.data(), b.size());
+  append("a", b.data(), b.size());
+  append("c", c.data(), c.size());
+  remove("c");
+
+  // reopening should reproduce the same extent table
+  close();
+  open(storeFN);
+
+  char buffer[16];
+  if (size("a") != 10 || size("b") != 4 || contains("c")) {
+    std::cerr << "Wrong logical file sizes after reopening the store" << std::endl;
+    success = false;
+  }
+
+  long long numBytesRead = read("a", 4, 5, buffer);
+  if (numBytesRead != 5 || std::string(buffer, 5) != "efghi") {
+    std::cerr << "Reading across extents returned "
+              << std::string(buffer, numBytesRead) << ", should be efghi"
+              << std::endl;
+    success = false;
+  }
+
+  reset("a");
+  append("a", c.data(), c.size());
+  numBytesRead = read("a", 0, 16, buffer);
+  if (numBytesRead != 3 || std::string(buffer, 3) != "xyz") {
+    std::cerr << "Reset did not truncate the logical file" << std::endl;
+    success = false;
+  }
+
+  // reads are served outside of the lock while other threads append, the 
+  // appended records are only visible to reads after a new mapping
+  std::string d = "0123456789";
+  int numReadErrors = 0;
+#pragma omp parallel for reduction(+:numReadErrors)
+  for (int i = 0; i < 200; ++i) {
+    if (i % 4 == 0) {
+      std::ostringstream name;
+      name << "d" << i;
+      append(name.str(), d.data(), d.size());
+    }
+    char threadBuffer[16];
+    if (read("b", 1, 16, threadBuffer) != 3 || 
+        std::string(threadBuffer, 3) != "hij") {
+      ++numReadErrors;
+    }
+  }
+  if (numReadErrors > 0 || size("d100") != 10 || 
+      read("d100", 0, 16, buffer) != 10 || std::string(buffer, 10) != d) {
+    std::cerr << "Concurrent reads and appends returned wrong data" << std::endl;
+    success = false;
+  }
+
+  close();
+  std::remove(storeFN.c_str());
+  return success;
+}
@@ -0,0 +1,115 @@
+/******************************************************************************
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+ ******************************************************************************/
+
+#ifndef PACKED_FILE_STORE_H
+#define PACKED_FILE_STORE_H
+
+#include <vector>
+#include <map>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "MyException.h"
+
+/**
+ * Optional append-only container for the binary intermediate files
+ * (.dat partitions, p-value vectors, p-values, hash part files, ...).
+ * Instead of creating thousands of small files, every write is appended as a
+ * record to a single store file. Each record carries the logical file name,
+ * so the extent table mapping logical files to byte ranges in the store can
+ * be rebuilt by scanning the record headers when the store is reopened.
+ *
+ * Removing or overwriting a logical file only appends a marker record, the
+ * space of the old extents is not reclaimed. Appends are serialized, reads 
+ * only look up the extents under the lock and copy the data from a memory 
+ * mapping of the store outside of it, so threads can read in parallel.
+ *
+ * The extent table only lives in the memory of the process that opened the
+ * store, so the store is meant for the intermediates of a single maracluster
+ * process, i.e. the batch mode; do not share a store file between processes.
+ */
+
+class PackedFileStore {
+ public:
+  static void open(const std::string& storeFN);
+  static void close();
+  static bool isOpen() { return isOpen_; }
+
+  static bool contains(const std::string& name);
+  static long long size(const std::string& name);
+
+  static void append(const std::string& name, const char* data,
+                     long long numBytes);
+  static void reset(const std::string& name);
+  static void remove(const std::string& name);
+
+  static long long read(const std::string& name, long long offset,
+                        long long numBytes, char* buffer);
+
+  static bool unitTest();
+ private:
+  enum RecordType { APPEND = 1, RESET = 2, REMOVE = 3 };
+  static const unsigned int kMagic = 0x4b50524du; // "MRPK"
+
+  struct RecordHeader {
+    unsigned int magic;
+    unsigned int type;
+    unsigned int nameLength;
+    unsigned int reserved;
+    long long numBytes;
+  };
+
+  struct Extent {
+    Extent(long long o, long long n) : offset(o), numBytes(n) {}
+    long long offset;
+    long long numBytes;
+  };
+
+  struct ExtentList {
+    ExtentList() : numBytes(0) {}
+    std::vector<Extent> extents;
+    long long numBytes;
+  };
+
+  typedef boost::shared_ptr<boost::iostreams::mapped_file_source> MappingPtr;
+
+  static bool isOpen_;
+  static std::string storeFN_;
+  static std::fstream store_;
+  static long long endOffset_;
+  static std::map<std::string, ExtentList> extentTable_;
+  // read-only mapping of the store, replaced by a larger one when a read
+  // reaches past its end. Readers keep a reference to the mapping they copy
+  // from, so a replaced mapping is only unmapped after their reads.
+  static MappingPtr mapping_;
+
+  static void scanRecords();
+  static void writeRecord(RecordType type, const std::string& name,
+                          const char* data, long long numBytes);
+  static void applyRecord(RecordType type, const std::string& name,
+                          long long payloadOffset, long long numBytes);
+  static MappingPtr getMapping(long long minSize);
+};
+
+#endif // PACKED_FILE_STORE_H
@@ -16,64 +16,154 @@
  
 #include "PeakCounts.h"
 
-const std::map<unsigned int, unsigned int> PeakCountMatrix::emptyRow_ = std::map<unsigned int, unsigned int>();
-
 unsigned int PeakCountMatrix::get(unsigned int row, unsigned int col) const { 
-  if (peakCountMap.find(row) != peakCountMap.end()) {
-    if (peakCountMap.find(row)->second.find(col) != peakCountMap.find(row)->second.end()) {
-      return peakCountMap.find(row)->second.find(col)->second;
+  const unsigned int* rowData = NULL;
+  size_t rowSize = getRow(row, rowData);
+  if (col < rowSize) {
+    return rowData[col];
+  }
+  return 0u;
+}
+
+// sets rowData to the start of the row and returns the number of columns
+size_t PeakCountMatrix::getRow(unsigned int row, 
+    const unsigned int*& rowData) const {
+  rowData = NULL;
+  if (isMapped_) {
+    if (row < numMappedRows_) {
+      rowData = mappedCounts_ + mappedRowOffsets_[row];
+      return static_cast<size_t>(mappedRowOffsets_[row + 1] - mappedRowOffsets_[row]);
     }
+  } else if (row < rows_.size() && rows_[row].size() > 0) {
+    rowData = &rows_[row][0];
+    return rows_[row].size();
   }
   return 0u;
 }
 
-const std::map<unsigned int, unsigned int>& PeakCountMatrix::getRow(unsigned int row) const {
-  if (peakCountMap.find(row) != peakCountMap.end()) {
-    return peakCountMap.find(row)->second;
+unsigned int PeakCountMatrix::getRowSum(unsigned int row) const {
+  if (isMapped_) {
+    return (row < numMappedRows_) ? mappedRowSums_[row] : 0u;
   } else {
-    return emptyRow_;
+    return (row < rowSums_.size()) ? rowSums_[row] : 0u;
   }
 }
+
+// returns the indices of the rows that have at least one entry
 void PeakCountMatrix::getRowIndices(std::vector<unsigned int>& rowIndices) const {
   rowIndices.clear();
-  BOOST_FOREACH(PeakCountMatrixRow row, peakCountMap) {
-    rowIndices.push_back(row.first);
+  const unsigned int* rowData = NULL;
+  unsigned int numRows = getNumRows();
+  for (unsigned int row = 0; row < numRows; ++row) {
+    if (getRow(row, rowData) > 0) rowIndices.push_back(row);
   }
 }
 
+unsigned int PeakCountMatrix::size() const {
+  std::vector<unsigned int> rowIndices;
+  getRowIndices(rowIndices);
+  return rowIndices.size();
+}
+
 unsigned int PeakCountMatrix::getRowPeakCount(unsigned int row, unsigned int maxBin) const {
-  unsigned int rowPeakCount = 0;
-  if (peakCountMap.find(row) != peakCountMap.end()) {
-    BOOST_FOREACH(ColumnValuePair cvPair, peakCountMap.find(row)->second) {
-      if (cvPair.first < maxBin) {
-        rowPeakCount += cvPair.second;
-      } else {
-        break;
-      }
-    }
+  const unsigned int* rowData = NULL;
+  size_t rowSize = getRow(row, rowData);
+  if (rowSize == 0) {
+    return 0u;
+  } else if (maxBin >= rowSize) {
+    return getRowSum(row);
+  } else {
+    return std::accumulate(rowData, rowData + maxBin, 0u);
   }
-  return rowPeakCount;
 }
 
-void PeakCountMatrix::add(PeakCountMatrix& other) {
-  BOOST_FOREACH(PeakCountMatrixRow row, other.getMatrix()) {
-    unsigned int rowIdx = row.first;
-    BOOST_FOREACH(ColumnValuePair cvPair, row.second) {
-      add(rowIdx, cvPair.first, cvPair.second);
+void PeakCountMatrix::attach(unsigned int numRows, 
+    const unsigned long long* rowOffsets, const unsigned int* rowSums, 
+    const unsigned int* counts) {
+  rows_.clear();
+  rowSums_.clear();
+  isMapped_ = true;
+  numMappedRows_ = numRows;
+  mappedRowOffsets_ = rowOffsets;
+  mappedRowSums_ = rowSums;
+  mappedCounts_ = counts;
+}
+
+// copies the mapped rows into the dense rows, so that they can be modified
+void PeakCountMatrix::detach() {
+  unsigned int numRows = numMappedRows_;
+  isMapped_ = false;
+  rows_.resize(numRows);
+  rowSums_.assign(mappedRowSums_, mappedRowSums_ + numRows);
+  for (unsigned int row = 0; row < numRows; ++row) {
+    rows_[row].assign(mappedCounts_ + mappedRowOffsets_[row], 
+                      mappedCounts_ + mappedRowOffsets_[row + 1]);
+  }
+  numMappedRows_ = 0u;
+  mappedRowOffsets_ = NULL;
+  mappedRowSums_ = NULL;
+  mappedCounts_ = NULL;
+}
+
+void PeakCountMatrix::add(const PeakCountMatrix& other) {
+  if (isMapped_) detach();
+  unsigned int numRows = other.getNumRows();
+  for (unsigned int row = 0; row < numRows; ++row) {
+    const unsigned int* otherRow = NULL;
+    size_t otherRowSize = other.getRow(row, otherRow);
+    if (otherRowSize == 0) continue;
+    
+    PeakCountRow& peakCountRow = getOrCreateRow(row, otherRowSize - 1);
+    for (unsigned int col = 0; col < otherRowSize; ++col) {
+      peakCountRow[col] += otherRow[col];
     }
+    rowSums_[row] += other.getRowSum(row);
   }
 }
 
-void PeakCountMatrix::subtract(PeakCountMatrix& other) {
-  BOOST_FOREACH(PeakCountMatrixRow row, other.getMatrix()) {
-    unsigned int rowIdx = row.first;
-    BOOST_FOREACH(ColumnValuePair cvPair, row.second) {
-      subtract(rowIdx, cvPair.first, cvPair.second);
+void PeakCountMatrix::subtract(const PeakCountMatrix& other) {
+  unsigned int numRows = other.getNumRows();
+  for (unsigned int row = 0; row < numRows; ++row) {
+    const unsigned int* otherRow = NULL;
+    size_t otherRowSize = other.getRow(row, otherRow);
+    for (unsigned int col = 0; col < otherRowSize; ++col) {
+      if (otherRow[col] > 0u) subtract(row, col, otherRow[col]);
     }
   }
 }
 
+// multiplies all counts in the row by factor, rounded to the nearest integer
+void PeakCountMatrix::scaleRow(unsigned int row, double factor) {
+  if (isMapped_) detach();
+  if (row >= rows_.size()) return;
+  
+  unsigned int rowSum = 0u;
+  BOOST_FOREACH (unsigned int& value, rows_[row]) {
+    value = static_cast<unsigned int>(value * factor + 0.5);
+    rowSum += value;
+  }
+  rowSums_[row] = rowSum;
+}
+
 unsigned int SpectrumCountVector::get(unsigned int row) const { 
+  if (isMapped_) {
+    // binary search over the (row, value) pairs
+    unsigned int lo = 0u, hi = numMappedRows_;
+    while (lo < hi) {
+      unsigned int mid = lo + (hi - lo) / 2;
+      if (mappedPairs_[2*mid] < row) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo < numMappedRows_ && mappedPairs_[2*lo] == row) {
+      return mappedPairs_[2*lo + 1];
+    } else {
+      return 0u;
+    }
+  }
+  
   if (specCountMap.find(row) != specCountMap.end())
     return specCountMap.find(row)->second;
   else 
@@ -82,11 +172,34 @@ unsigned int SpectrumCountVector::get(unsigned int row) const {
 
 void SpectrumCountVector::getRowIndices(std::vector<unsigned int>& rowIndices) const {
   rowIndices.clear();
-  BOOST_FOREACH(SpecCountMapRow row, specCountMap) {
-    rowIndices.push_back(row.first);
+  if (isMapped_) {
+    for (unsigned int i = 0; i < numMappedRows_; ++i) {
+      rowIndices.push_back(mappedPairs_[2*i]);
+    }
+  } else {
+    BOOST_FOREACH(SpecCountMapRow row, specCountMap) {
+      rowIndices.push_back(row.first);
+    }
   }
 }
 
+void SpectrumCountVector::attach(unsigned int numRows, 
+    const unsigned int* pairs) {
+  specCountMap.clear();
+  isMapped_ = true;
+  numMappedRows_ = numRows;
+  mappedPairs_ = pairs;
+}
+
+void SpectrumCountVector::detach() {
+  isMapped_ = false;
+  for (unsigned int i = 0; i < numMappedRows_; ++i) {
+    specCountMap[mappedPairs_[2*i]] = mappedPairs_[2*i + 1];
+  }
+  numMappedRows_ = 0u;
+  mappedPairs_ = NULL;
+}
+
 void SpectrumCountVector::add(SpectrumCountVector& other) {
   std::vector<unsigned int> rowIndices;
   other.getRowIndices(rowIndices);
@@ -160,6 +273,52 @@ void PeakCounts::addSpectrum(std::vector<BinnedMZIntensityPair>& mziPairs, const
   nTotalPeaks += nSpectrumPeaks;
 }
 
+// rescales peak counts that were accumulated from a sample of the spectra.
+// precursorCounts contains the spectrum counts of all spectra, every row is 
+// scaled by the ratio of all spectra to sampled spectra in its precursor bin,
+// so that each bin has the same weight relative to the prior as in a full pass.
+// If the peaks are relative to the precursor m/z, the peaks of all precursor
+// bins are counted in row 0, which is scaled by the ratio of the totals.
+void PeakCounts::scaleToSpectrumCounts(const PeakCounts& precursorCounts) {
+  if (!equalParams(precursorCounts)) {
+    std::cerr << "WARNING (PeakCounts::scaleToSpectrumCounts(precursorCounts)): PeakCount parameters do not match, scaling cancelled." << std::endl << std::endl;
+    return;
+  }
+  
+  unsigned long long numSampled = 0uLL, numScaled = 0uLL;
+  for (unsigned int chargeBin = 0; chargeBin < maxCharge; ++chargeBin) {
+    std::vector<unsigned int> rowIndices;
+    specCountVectors[chargeBin].getRowIndices(rowIndices);
+    unsigned long long chargeSampled = 0uLL, chargeScaled = 0uLL;
+    BOOST_FOREACH (unsigned int row, rowIndices) {
+      unsigned int sampledCount = specCountVectors[chargeBin].get(row);
+      unsigned int fullCount = precursorCounts.specCountVectors[chargeBin].get(row);
+      chargeSampled += sampledCount;
+      if (sampledCount > 0u && fullCount > sampledCount) {
+        if (!relativeToPrecMz) {
+          peakCountMatrices[chargeBin].scaleRow(row, 
+              static_cast<double>(fullCount) / sampledCount);
+        }
+        specCountVectors[chargeBin].add(row, fullCount - sampledCount);
+        chargeScaled += fullCount;
+      } else {
+        chargeScaled += sampledCount;
+      }
+    }
+    if (relativeToPrecMz && chargeSampled > 0uLL && chargeScaled > chargeSampled) {
+      peakCountMatrices[chargeBin].scaleRow(0, 
+          static_cast<double>(chargeScaled) / chargeSampled);
+    }
+    numSampled += chargeSampled;
+    numScaled += chargeScaled;
+  }
+  
+  if (numSampled > 0uLL) {
+    nTotalPeaks = static_cast<unsigned int>(
+        static_cast<double>(nTotalPeaks) * numScaled / numSampled + 0.5);
+  }
+}
+
 void PeakCounts::add(PeakCounts& otherPeakCounts) {
   if (equalParams(otherPeakCounts)) {
     nTotalPeaks += otherPeakCounts.getNumTotalPeaks();
@@ -205,19 +364,74 @@ double PeakCounts::getDistance(const PeakCounts& otherPeakCounts) const {
   return distance;
 }
 
-// TODO: generate unit test for this
 void PeakCounts::generatePeakDistribution(double precMz, unsigned int charge,
-    PeakDistribution& distribution, unsigned int numQueryPeaks) {
-  unsigned int precMzBin = getPrecBin(precMz);
-  unsigned int chargeBin = getChargeBin(charge);
+    PeakDistribution& distribution, unsigned int numQueryPeaks) const {
+  generatePeakDistribution(getPeakDistributionKey(precMz, charge, numQueryPeaks), 
+                           distribution);
+}
+
+// computes the distributions for all keys in parallel, duplicate keys and 
+// keys that are covered by the persisted table are removed from the input
+void PeakCounts::generatePeakDistributionTable(
+    std::vector<PeakDistributionKey>& keys, PeakDistributionTable& table) const {
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
   
-  if (peakDistCache_[chargeBin].find(precMzBin) != peakDistCache_[chargeBin].end()) {
-    distribution = peakDistCache_[chargeBin][precMzBin];
-    // TODO: find a better way to do caching. Here I needed to do an extra check, 
-    // since the copying of the distribution is sometimes not completely done 
-    // when pvalCalc already tries to access it.
-    if (distribution.getDistribution().size() != 0) return;
+  std::vector<PeakDistributionKey> missingKeys;
+  BOOST_FOREACH (const PeakDistributionKey& key, keys) {
+    const double* peakDist = NULL;
+    if (findPersistedPeakDistribution(key, peakDist) == 0u) {
+      missingKeys.push_back(key);
+    }
   }
+  keys.swap(missingKeys);
+  
+  std::vector<PeakDistribution> distributions(keys.size());
+#pragma omp parallel for schedule(dynamic, 10)
+  for (int i = 0; i < static_cast<int>(keys.size()); ++i) {
+    generatePeakDistribution(keys[i], distributions[i]);
+  }
+  table.assign(keys, distributions, smoothingMode_);
+}
+
+// the persisted table can only be used if it was generated with the same 
+// smoothing mode
+size_t PeakCounts::findPersistedPeakDistribution(const PeakDistributionKey& key, 
+    const double*& peakDist) const {
+  peakDist = NULL;
+  if (persistedDistTable_.size() == 0u || 
+      persistedDistTable_.getSmoothingMode() != smoothingMode_) {
+    return 0u;
+  }
+  return persistedDistTable_.find(key, peakDist);
+}
+
+// sets peakDist to the distribution from the table or the persisted table, or 
+// computes it in fallbackDistribution if the key is missing from both. 
+// Returns the number of bins.
+size_t PeakCounts::getPeakDistribution(
+    const PeakDistributionTable& table, const PeakDistributionKey& key, 
+    PeakDistribution& fallbackDistribution, const double*& peakDist) const {
+  size_t numBins = table.find(key, peakDist);
+  if (peakDist == NULL) {
+    numBins = findPersistedPeakDistribution(key, peakDist);
+  }
+  if (peakDist == NULL) {
+    generatePeakDistribution(key, fallbackDistribution);
+    const std::vector<double>& distribution = fallbackDistribution.getDistribution();
+    numBins = distribution.size();
+    peakDist = (numBins > 0) ? &distribution[0] : NULL;
+  }
+  return numBins;
+}
+
+// TODO: generate unit test for this
+void PeakCounts::generatePeakDistribution(const PeakDistributionKey& key,
+    PeakDistribution& distribution) const {
+  unsigned int precMzBin = key.precMzBin;
+  unsigned int charge = key.charge;
+  unsigned int numQueryPeaks = key.numQueryPeaks;
+  unsigned int chargeBin = getChargeBin(charge);
   
   unsigned int precWindow, priorCount, windowRange;
   if (smoothingMode_ == 1) {
@@ -245,13 +459,11 @@ void PeakCounts::generatePeakDistribution(double precMz, unsigned int charge,
     if (rowPeakCount > 0u) {
       double multFactor = static_cast<double>(numQueryPeaks * specCount) / rowPeakCount; // correction for spectra not containing maxScoringPeaks
       //std::cerr << multFactor << std::endl;
-      BOOST_FOREACH (PeakCountMatrix::ColumnValuePair colValPair, peakCountMatrices.at(chargeBin).getRow(precBin)) {
-        unsigned int col = colValPair.first;
-        unsigned int value = colValPair.second;
-        
-        if (col < maxPeakBin) {
-          peakCountSum.at(col) += value * multFactor;
-        }
+      const unsigned int* peakCountRow = NULL;
+      size_t rowSize = peakCountMatrices.at(chargeBin).getRow(precBin, peakCountRow);
+      size_t maxCol = (std::min)(rowSize, static_cast<size_t>(maxPeakBin));
+      for (size_t col = 0; col < maxCol; ++col) {
+        peakCountSum[col] += peakCountRow[col] * multFactor;
       }
     }
   }
@@ -276,13 +488,7 @@ void PeakCounts::generatePeakDistribution(double precMz, unsigned int charge,
       runningAvg -= peakCountSum.at(bin - windowRange)/windowBinSize;
     }
   }
-  
-  if (peakDistCache_[chargeBin].find(precMzBin) == peakDistCache_[chargeBin].end()) {
-  #pragma omp critical (save_peak_dist)
-    {
-      peakDistCache_[chargeBin][precMzBin] = distribution;
-    }
-  }
+
 }
 
 // TODO: generate unit test for this
@@ -299,12 +505,17 @@ void PeakCounts::generateRelativePeakDistribution(unsigned int charge, PeakDistr
   
   std::vector<unsigned int> peakCountSum(maxPeakBin, priorCount);
   
-  BOOST_FOREACH (PeakCountMatrix::PeakCountMatrixRow matrixRow, peakCountMatrices.at(chargeBin).getMatrixConst()) {
-    double precMz = getPrecMz(matrixRow.first);
-    BOOST_FOREACH (PeakCountMatrix::ColumnValuePair colValPair, matrixRow.second) {
-      unsigned int fracPeakBin = getRelPeakBin(colValPair.first, precMz, fracPeakBinWidth);
-      unsigned int value = colValPair.second;
+  std::vector<unsigned int> rowIndices;
+  peakCountMatrices.at(chargeBin).getRowIndices(rowIndices);
+  BOOST_FOREACH (unsigned int rowIdx, rowIndices) {
+    double precMz = getPrecMz(rowIdx);
+    const unsigned int* peakCountRow = NULL;
+    size_t rowSize = peakCountMatrices.at(chargeBin).getRow(rowIdx, peakCountRow);
+    for (unsigned int col = 0; col < rowSize; ++col) {
+      unsigned int value = peakCountRow[col];
+      if (value == 0u) continue;
       
+      unsigned int fracPeakBin = getRelPeakBin(col, precMz, fracPeakBinWidth);
       if (fracPeakBin < maxPeakBin) {
         peakCountSum[fracPeakBin] += value;
       }
@@ -333,13 +544,263 @@ void PeakCounts::generateRelativePeakDistribution(unsigned int charge, PeakDistr
   distribution.rescale(1.0/normSum);
 }
 
+// reads either the flat binary format written by writeToFile, which is used 
+// in place through a memory mapping, or the boost serialization format. The
+// peak distribution table written by the index step is mapped as well if it
+// exists and its fingerprint shows that it was computed from these peak 
+// counts.
 void PeakCounts::readFromFile(const std::string& peakCountFN) {
-  std::ifstream peakCountStream(peakCountFN.c_str());
-  std::string serializedPeakCounts(
-      (std::istreambuf_iterator<char>(peakCountStream)),
-      std::istreambuf_iterator<char>());
+  if (isFlatFile(peakCountFN)) {
+    readFromFlatFile(peakCountFN);
+  } else {
+    std::ifstream peakCountStream(peakCountFN.c_str());
+    std::string serializedPeakCounts(
+        (std::istreambuf_iterator<char>(peakCountStream)),
+        std::istreambuf_iterator<char>());
+    
+    deserializePeakCounts(serializedPeakCounts, *this);
+  }
   
-  deserializePeakCounts(serializedPeakCounts, *this);
+  std::string peakDistTableFN = PeakDistributionTable::getFilename(peakCountFN);
+  std::ifstream peakDistTableStream(peakDistTableFN.c_str());
+  if (peakDistTableStream.good()) {
+    persistedDistTable_.readFromFile(peakDistTableFN, 
+        getDistributionTableFingerprint(peakCountFN));
+  } else {
+    persistedDistTable_.clear();
+  }
+}
+
+// the size and adler32 checksum of the peak count file together with the 
+// binning of these peak counts
+PeakDistributionFingerprint PeakCounts::getDistributionTableFingerprint(
+    const std::string& peakCountFN) const {
+  PeakDistributionFingerprint fingerprint;
+  fingerprint.precBinWidth = precBinWidth;
+  fingerprint.precBinShift = precBinShift;
+  fingerprint.peakBinWidth = peakBinWidth;
+  fingerprint.peakBinShift = peakBinShift;
+  fingerprint.maxCharge = maxCharge;
+  
+  boost::iostreams::mapped_file_source peakCountFile(peakCountFN);
+  fingerprint.peakCountFileSize = peakCountFile.size();
+  uLong checksum = adler32(0L, Z_NULL, 0);
+  const Bytef* data = reinterpret_cast<const Bytef*>(peakCountFile.data());
+  size_t numBytesLeft = peakCountFile.size();
+  while (numBytesLeft > 0) {
+    uInt numBytes = static_cast<uInt>((std::min)(numBytesLeft, 
+                                                 static_cast<size_t>(1u << 30)));
+    checksum = adler32(checksum, data, numBytes);
+    data += numBytes;
+    numBytesLeft -= numBytes;
+  }
+  fingerprint.peakCountChecksum = checksum;
+  return fingerprint;
+}
+
+bool PeakCounts::isFlatFile(const std::string& peakCountFN) {
+  std::ifstream peakCountStream(peakCountFN.c_str(), std::ios::binary);
+  unsigned int magic = 0u;
+  peakCountStream.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+  return peakCountStream.good() && magic == kFlatFileMagic;
+}
+
+namespace {
+  void writeFlatPadding(std::ostream& os, size_t numBytes) {
+    static const char zeros[8] = { 0 };
+    if (numBytes % 8 != 0) os.write(zeros, 8 - numBytes % 8);
+  }
+  
+  size_t getFlatPaddedSize(size_t numBytes) {
+    return (numBytes + 7) / 8 * 8;
+  }
+  
+  // advances p past a section of numElements elements, padded to a multiple
+  // of 8 bytes, returns false if the section does not end before l
+  bool skipFlatSection(const char*& p, const char* l, 
+                       unsigned long long numElements, size_t elementSize) {
+    size_t numBytesLeft = l - p;
+    if (numElements > numBytesLeft / elementSize) return false;
+    size_t numBytes = getFlatPaddedSize(numElements * elementSize);
+    if (numBytes > numBytesLeft) return false;
+    p += numBytes;
+    return true;
+  }
+  
+  void throwCorruptFlatFile(const std::string& peakCountFN, 
+                            const std::string& reason) {
+    std::ostringstream ss;
+    ss << "ERROR: Peak count file " << peakCountFN << " " << reason << std::endl;
+    throw MyException(ss);
+  }
+}
+
+/**
+ * Flat file layout, all sections start at a multiple of 8 bytes:
+ *   FlatFileHeader
+ *   for each charge bin:
+ *     FlatFileChargeHeader
+ *     unsigned long long rowOffsets[numRows + 1]
+ *     unsigned int rowSums[numRows]
+ *     unsigned int counts[numCounts] (dense rows, concatenated)
+ *     unsigned int specCounts[2*numSpecCountRows] ((row, value) pairs)
+ */
+void PeakCounts::writeToFile(const std::string& peakCountFN) const {
+  std::ofstream peakCountStream(peakCountFN.c_str(), 
+      std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!peakCountStream.is_open()) {
+    std::ostringstream ss;
+    ss << "ERROR: Could not write peak counts to " << peakCountFN << std::endl;
+    throw MyException(ss);
+  }
+  
+  FlatFileHeader header;
+  header.magic = kFlatFileMagic;
+  header.version = kFlatFileVersion;
+  header.maxCharge = maxCharge;
+  header.nTotalPeaks = nTotalPeaks;
+  header.truncatePeaks = truncatePeaks ? 1u : 0u;
+  header.relativeToPrecMz = relativeToPrecMz ? 1u : 0u;
+  header.precBinWidth = precBinWidth;
+  header.precBinShift = precBinShift;
+  header.peakBinWidth = peakBinWidth;
+  header.peakBinShift = peakBinShift;
+  peakCountStream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  
+  for (unsigned int chargeBin = 0; chargeBin < maxCharge; ++chargeBin) {
+    const PeakCountMatrix& peakCountMatrix = peakCountMatrices[chargeBin];
+    unsigned int numRows = peakCountMatrix.getNumRows();
+    
+    std::vector<unsigned long long> rowOffsets(numRows + 1, 0uLL);
+    std::vector<unsigned int> rowSums(numRows);
+    const unsigned int* rowData = NULL;
+    for (unsigned int row = 0; row < numRows; ++row) {
+      rowOffsets[row + 1] = rowOffsets[row] + peakCountMatrix.getRow(row, rowData);
+      rowSums[row] = peakCountMatrix.getRowSum(row);
+    }
+    
+    std::vector<unsigned int> specCountRows, specCounts;
+    specCountVectors[chargeBin].getRowIndices(specCountRows);
+    BOOST_FOREACH (unsigned int row, specCountRows) {
+      specCounts.push_back(row);
+      specCounts.push_back(specCountVectors[chargeBin].get(row));
+    }
+    
+    FlatFileChargeHeader chargeHeader;
+    chargeHeader.numRows = numRows;
+    chargeHeader.numCounts = rowOffsets.back();
+    chargeHeader.numSpecCountRows = specCountRows.size();
+    chargeHeader.reserved = 0uLL;
+    peakCountStream.write(reinterpret_cast<const char*>(&chargeHeader), 
+                          sizeof(chargeHeader));
+    
+    peakCountStream.write(reinterpret_cast<const char*>(&rowOffsets[0]), 
+                          rowOffsets.size() * sizeof(unsigned long long));
+    if (numRows > 0) {
+      peakCountStream.write(reinterpret_cast<const char*>(&rowSums[0]), 
+                            numRows * sizeof(unsigned int));
+      writeFlatPadding(peakCountStream, numRows * sizeof(unsigned int));
+    }
+    for (unsigned int row = 0; row < numRows; ++row) {
+      size_t rowSize = peakCountMatrix.getRow(row, rowData);
+      if (rowSize > 0) {
+        peakCountStream.write(reinterpret_cast<const char*>(rowData), 
+                              rowSize * sizeof(unsigned int));
+      }
+    }
+    writeFlatPadding(peakCountStream, 
+                     chargeHeader.numCounts * sizeof(unsigned int));
+    if (specCounts.size() > 0) {
+      peakCountStream.write(reinterpret_cast<const char*>(&specCounts[0]), 
+                            specCounts.size() * sizeof(unsigned int));
+    }
+  }
+  
+  if (!peakCountStream.good()) {
+    std::ostringstream ss;
+    ss << "ERROR: Could not write peak counts to " << peakCountFN << std::endl;
+    throw MyException(ss);
+  }
+}
+
+void PeakCounts::readFromFlatFile(const std::string& peakCountFN) {
+  mappedFile_.reset(new boost::iostreams::mapped_file_source(peakCountFN));
+  if (mappedFile_->size() < sizeof(FlatFileHeader)) {
+    mappedFile_.reset();
+    std::ostringstream ss;
+    ss << "ERROR: Peak count file " << peakCountFN << " is truncated" << std::endl;
+    throw MyException(ss);
+  }
+  const char* f = mappedFile_->data();
+  const char* l = f + mappedFile_->size();
+  
+  const FlatFileHeader* header = reinterpret_cast<const FlatFileHeader*>(f);
+  if (header->version != kFlatFileVersion) {
+    std::ostringstream ss;
+    ss << "ERROR: Unknown version " << header->version 
+       << " of peak count file " << peakCountFN << std::endl;
+    throw MyException(ss);
+  }
+  
+  maxCharge = header->maxCharge;
+  nTotalPeaks = header->nTotalPeaks;
+  truncatePeaks = (header->truncatePeaks != 0u);
+  relativeToPrecMz = (header->relativeToPrecMz != 0u);
+  precBinWidth = header->precBinWidth;
+  precBinShift = header->precBinShift;
+  peakBinWidth = header->peakBinWidth;
+  peakBinShift = header->peakBinShift;
+  
+  peakCountMatrices.clear();
+  specCountVectors.clear();
+  peakCountMatrices.resize(maxCharge);
+  specCountVectors.resize(maxCharge);
+  
+  // every charge bin has to be present, a file that ends at the boundary 
+  // between two charge bins is truncated as well
+  const char* p = f + sizeof(FlatFileHeader);
+  for (unsigned int chargeBin = 0; chargeBin < maxCharge; ++chargeBin) {
+    const FlatFileChargeHeader* chargeHeader = 
+        reinterpret_cast<const FlatFileChargeHeader*>(p);
+    if (!skipFlatSection(p, l, 1u, sizeof(FlatFileChargeHeader))) {
+      throwCorruptFlatFile(peakCountFN, "is truncated");
+    }
+    
+    unsigned long long numRows = chargeHeader->numRows;
+    unsigned long long numCounts = chargeHeader->numCounts;
+    const unsigned long long* rowOffsets = 
+        reinterpret_cast<const unsigned long long*>(p);
+    bool complete = numRows < UINT_MAX &&
+        skipFlatSection(p, l, numRows + 1u, sizeof(unsigned long long));
+    const unsigned int* rowSums = reinterpret_cast<const unsigned int*>(p);
+    complete = complete && 
+        skipFlatSection(p, l, numRows, sizeof(unsigned int));
+    const unsigned int* counts = reinterpret_cast<const unsigned int*>(p);
+    complete = complete && 
+        skipFlatSection(p, l, numCounts, sizeof(unsigned int));
+    const unsigned int* specCounts = reinterpret_cast<const unsigned int*>(p);
+    complete = complete && skipFlatSection(p, l, 
+        chargeHeader->numSpecCountRows, 2 * sizeof(unsigned int));
+    if (!complete) {
+      throwCorruptFlatFile(peakCountFN, "is truncated");
+    }
+    
+    // the rows are read without bounds checks, so their offsets have to 
+    // stay within the counts of this charge bin
+    for (unsigned long long row = 0; row < numRows; ++row) {
+      if (rowOffsets[row + 1] < rowOffsets[row]) {
+        throwCorruptFlatFile(peakCountFN, "has decreasing row offsets");
+      }
+    }
+    if (rowOffsets[numRows] != numCounts) {
+      throwCorruptFlatFile(peakCountFN, 
+          "has row offsets that do not match its number of counts");
+    }
+    
+    peakCountMatrices[chargeBin].attach(static_cast<unsigned int>(numRows), 
+        rowOffsets, rowSums, counts);
+    specCountVectors[chargeBin].attach(chargeHeader->numSpecCountRows, specCounts);
+  }
 }
 
 void PeakCounts::serialize(std::string& peakCountsSerialized) {
@@ -526,6 +987,173 @@ bool PeakCounts::peakCountsSerializationUnitTest() {
   return true;
 }
 
+bool PeakCounts::peakCountsFlatFileUnitTest() {
+  PeakCounts pk1, pk2, pk3;
+  std::string peakCountFN = "peak_counts_flat_file_unit_test.dat";
+  
+  std::vector<MZIntensityPair> mziPairs1, mziPairs2;
+  
+  mziPairs1.push_back(MZIntensityPair(50,1));
+  mziPairs1.push_back(MZIntensityPair(100,2));
+  
+  mziPairs2.push_back(MZIntensityPair(50,1));
+  mziPairs2.push_back(MZIntensityPair(75,3));
+  
+  pk1.addSpectrum(mziPairs1, 150, 2u, 300, 100u);
+  pk1.addSpectrum(mziPairs2, 150, 2u, 300, 100u);
+  pk1.addSpectrum(mziPairs2, 250, 3u, 750, 100u);
+  
+  pk1.writeToFile(peakCountFN);
+  pk2.readFromFile(peakCountFN);
+  
+  bool success = true;
+  for (unsigned int charge = 1u; charge <= pk1.getMaxCharge(); ++charge) {
+    PeakDistribution distribution1, distribution2;
+    pk1.generatePeakDistribution(150, charge, distribution1, 40u);
+    pk2.generatePeakDistribution(150, charge, distribution2, 40u);
+    if (distribution1.getDistribution() != distribution2.getDistribution()) {
+      std::cerr << "Flat file returned a different peak distribution for charge " 
+                << charge << std::endl;
+      success = false;
+    }
+  }
+  
+  if (pk2.getNumTotalPeaks() != pk1.getNumTotalPeaks() || 
+      pk2.getSpecCountVector(2u).get(150) != 2 ||
+      pk2.getPeakCountMatrix(2u).get(150,100) != 1 || 
+      pk2.getPeakCountMatrix(2u).get(150,50) != 2) {
+    std::cerr << "Flat file returned false peak counts" << std::endl;
+    success = false;
+  }
+  
+  // modifying the mapped peak counts should copy them into memory
+  pk2.add(pk1);
+  if (pk2.getSpecCountVector(2u).get(150) != 4 ||
+      pk2.getPeakCountMatrix(2u).get(150,50) != 4 || 
+      pk2.getPeakCountMatrix(3u).get(250,75) != 2) {
+    std::cerr << "Addition to flat file peak counts returned false peak counts" << std::endl;
+    success = false;
+  }
+  
+  // the boost serialization format should still be readable
+  std::string pk1serialized;
+  serializePeakCounts(pk1, pk1serialized);
+  {
+    std::ofstream peakCountStream(peakCountFN.c_str(), std::ios::binary);
+    peakCountStream << pk1serialized;
+  }
+  pk3.readFromFile(peakCountFN);
+  if (pk3.getPeakCountMatrix(2u).get(150,50) != 2) {
+    std::cerr << "Reading serialized peak counts returned false peak counts" << std::endl;
+    success = false;
+  }
+  
+  // a flat file that ends at the boundary between two charge bins or whose 
+  // row offsets do not match its counts should be rejected
+  pk1.writeToFile(peakCountFN);
+  std::string flatFile;
+  {
+    std::ifstream peakCountStream(peakCountFN.c_str(), std::ios::binary);
+    std::ostringstream os;
+    os << peakCountStream.rdbuf();
+    flatFile = os.str();
+  }
+  FlatFileChargeHeader chargeHeader;
+  memcpy(&chargeHeader, &flatFile[sizeof(FlatFileHeader)], sizeof(chargeHeader));
+  size_t rowOffsetsPos = sizeof(FlatFileHeader) + sizeof(FlatFileChargeHeader);
+  size_t chargeBinEnd = rowOffsetsPos + 
+      (chargeHeader.numRows + 1) * sizeof(unsigned long long) + 
+      getFlatPaddedSize(chargeHeader.numRows * sizeof(unsigned int)) + 
+      getFlatPaddedSize(chargeHeader.numCounts * sizeof(unsigned int)) + 
+      chargeHeader.numSpecCountRows * 2 * sizeof(unsigned int);
+  
+  std::vector<std::string> corruptFlatFiles;
+  corruptFlatFiles.push_back(flatFile.substr(0, chargeBinEnd));
+  corruptFlatFiles.push_back(flatFile);
+  unsigned long long lastRowOffset = chargeHeader.numCounts + 1;
+  memcpy(&corruptFlatFiles.back()[rowOffsetsPos + 
+             chargeHeader.numRows * sizeof(unsigned long long)], 
+         &lastRowOffset, sizeof(lastRowOffset));
+  BOOST_FOREACH (const std::string& corruptFlatFile, corruptFlatFiles) {
+    {
+      std::ofstream peakCountStream(peakCountFN.c_str(), std::ios::binary);
+      peakCountStream << corruptFlatFile;
+    }
+    try {
+      PeakCounts pk4;
+      pk4.readFromFile(peakCountFN);
+      std::cerr << "Reading a corrupt flat file did not fail" << std::endl;
+      success = false;
+    } catch (MyException&) {}
+  }
+  
+  // a flat file that ends within its header should be rejected
+  {
+    std::ofstream peakCountStream(peakCountFN.c_str(), std::ios::binary);
+    unsigned int magic = kFlatFileMagic;
+    peakCountStream.write(reinterpret_cast<const char*>(&magic), sizeof(magic));
+  }
+  try {
+    PeakCounts pk4;
+    pk4.readFromFile(peakCountFN);
+    std::cerr << "Reading a truncated flat file did not fail" << std::endl;
+    success = false;
+  } catch (MyException&) {}
+  
+  std::remove(peakCountFN.c_str());
+  return success;
+}
+
+bool PeakCounts::peakDistributionLookupUnitTest() {
+  PeakCounts pk;
+  
+  std::vector<MZIntensityPair> mziPairs;
+  mziPairs.push_back(MZIntensityPair(50,1));
+  mziPairs.push_back(MZIntensityPair(100,2));
+  pk.addSpectrum(mziPairs, 150, 2u, 300, 100u);
+  pk.addSpectrum(mziPairs, 250, 3u, 750, 100u);
+  
+  std::vector<PeakDistributionKey> keys;
+  keys.push_back(pk.getPeakDistributionKey(150, 2u, 40u));
+  keys.push_back(pk.getPeakDistributionKey(250, 3u, 40u));
+  PeakDistributionTable table;
+  pk.generatePeakDistributionTable(keys, table);
+  
+  bool success = true;
+  
+  // distributions in the table should be handed out in place, without 
+  // filling the fallback distribution
+  PeakDistribution fallbackDistribution;
+  const double *peakDist = NULL, *peakDistAgain = NULL;
+  PeakDistributionKey key = pk.getPeakDistributionKey(150, 2u, 40u);
+  size_t numBins = pk.getPeakDistribution(table, key, fallbackDistribution, peakDist);
+  pk.getPeakDistribution(table, key, fallbackDistribution, peakDistAgain);
+  if (peakDist == NULL || peakDist != peakDistAgain || 
+      !fallbackDistribution.getDistribution().empty()) {
+    std::cerr << "Peak distribution from the table was copied" << std::endl;
+    success = false;
+  }
+  
+  PeakDistribution expected;
+  pk.generatePeakDistribution(150, 2u, expected, 40u);
+  if (peakDist == NULL || numBins != expected.getDistribution().size() ||
+      !std::equal(peakDist, peakDist + numBins, 
+                  expected.getDistribution().begin())) {
+    std::cerr << "Peak distribution from the table is wrong" << std::endl;
+    success = false;
+  }
+  
+  // keys missing from the table are computed into the fallback distribution
+  key = pk.getPeakDistributionKey(150, 3u, 40u);
+  numBins = pk.getPeakDistribution(table, key, fallbackDistribution, peakDist);
+  if (numBins == 0u || peakDist != &fallbackDistribution.getDistribution()[0]) {
+    std::cerr << "Missing peak distribution did not use the fallback" << std::endl;
+    success = false;
+  }
+  
+  return success;
+}
+
 bool PeakCountMatrix::peakMatrixUnitTest() {
   PeakCountMatrix m, n, p;
   
@@ -541,8 +1169,10 @@ bool PeakCountMatrix::peakMatrixUnitTest() {
   
   p.subtract(m);
   m.add(n);
+  n.scaleRow(3, 2.5);
   
-  if (m.get(3,4) == 5 && n.get(3,4) == 3 && p.get(3,4) == 2 && p.get(4,2) == 0) {
+  if (m.get(3,4) == 5 && n.get(3,4) == 8 && n.getRowPeakCount(3, 10) == 8 && 
+      p.get(3,4) == 2 && p.get(4,2) == 0) {
     return true;
   } else {
     std::cerr << m.get(3,4) << std::endl;
@@ -22,11 +22,17 @@
 #include <map>
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 
 #include <utility>
 #include <algorithm>
 #include <numeric>
 #include <cmath>
+#include <climits>
+#include <cstring>
+
+#include <zlib.h>
 
 #include <boost/lexical_cast.hpp>
 #include <boost/foreach.hpp>
@@ -35,6 +41,8 @@
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/serialization/split_member.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 
 #include "pwiz/data/msdata/MSData.hpp"
 
@@ -42,6 +50,8 @@
 #include "BinSpectra.h"
 #include "PvalueCalculator.h"
 #include "PeakDistribution.h"
+#include "PeakDistributionTable.h"
+#include "MyException.h"
 
 /**
  * Creates a histogram of spectrum peaks split out by precursor
@@ -50,67 +60,109 @@
 class PeakCountMatrix {
     
   public:
-    typedef std::map<unsigned int, std::map<unsigned int, unsigned int> > PeakCountMatrixMap;
-    typedef std::pair<unsigned int, std::map<unsigned int, unsigned int> > PeakCountMatrixRow;
-    typedef std::pair<unsigned int, unsigned int> ColumnValuePair;
+    // dense row of peak counts, indexed by fragment bin. Rows only grow up to 
+    // the highest fragment bin that was added, higher bins have count 0.
+    typedef std::vector<unsigned int> PeakCountRow;
     
-    PeakCountMatrix() { }
+    PeakCountMatrix() : isMapped_(false), numMappedRows_(0u), 
+        mappedRowOffsets_(NULL), mappedRowSums_(NULL), mappedCounts_(NULL) { }
     
-    void add(PeakCountMatrix& other);
-    void subtract(PeakCountMatrix& other);
-    inline void add(unsigned int row, unsigned int col, unsigned int value) { peakCountMap[row][col] += value; }
+    void add(const PeakCountMatrix& other);
+    void subtract(const PeakCountMatrix& other);
+    inline void add(unsigned int row, unsigned int col, unsigned int value) { 
+      if (isMapped_) detach();
+      getOrCreateRow(row, col)[col] += value;
+      rowSums_[row] += value;
+    }
     inline void subtract(unsigned int row, unsigned int col, unsigned int value) {
-      peakCountMap[row][col] -= (std::min)(value, peakCountMap[row][col]);
+      if (isMapped_) detach();
+      if (row < rows_.size() && col < rows_[row].size()) {
+        unsigned int subtracted = (std::min)(value, rows_[row][col]);
+        rows_[row][col] -= subtracted;
+        rowSums_[row] -= subtracted;
+      }
     }
     
+    void scaleRow(unsigned int row, double factor);
+    
+    // uses the rows of a flat peak count file in place, the memory has to 
+    // outlive this matrix. The rows are copied on the first modification.
+    void attach(unsigned int numRows, const unsigned long long* rowOffsets,
+                const unsigned int* rowSums, const unsigned int* counts);
+    
     // in parallel regions only use these const getters
     unsigned int get(unsigned int row, unsigned int col) const;
-    const std::map<unsigned int, unsigned int>& getRow(unsigned int row) const;
+    size_t getRow(unsigned int row, const unsigned int*& rowData) const;
+    unsigned int getRowSum(unsigned int row) const;
     void getRowIndices(std::vector<unsigned int>& rowIndices) const;
     unsigned int getRowPeakCount(unsigned int row, unsigned int maxBin) const;
     
-    PeakCountMatrixMap& getMatrix() { return peakCountMap; }
-    const PeakCountMatrixMap& getMatrixConst() const { return peakCountMap; }
-    
-    unsigned int size() const { return peakCountMap.size(); }
+    unsigned int getNumRows() const { 
+      return isMapped_ ? numMappedRows_ : static_cast<unsigned int>(rows_.size()); 
+    }
+    unsigned int size() const;
     static bool peakMatrixUnitTest();
   private:
-    PeakCountMatrixMap peakCountMap;
-    static const std::map<unsigned int, unsigned int> emptyRow_;
+    // indexed by precursor bin
+    std::vector<PeakCountRow> rows_;
+    std::vector<unsigned int> rowSums_;
+    
+    // rows in compressed sparse row layout from a memory mapped file
+    bool isMapped_;
+    unsigned int numMappedRows_;
+    const unsigned long long* mappedRowOffsets_;
+    const unsigned int* mappedRowSums_;
+    const unsigned int* mappedCounts_;
     
-    // splitting the serialization member function, because "ar & peakCountMap" 
-    // caused a segfault (probably due to some pointer issues with a 2D map)
+    void detach();
+    
+    inline PeakCountRow& getOrCreateRow(unsigned int row, unsigned int col) {
+      if (row >= rows_.size()) {
+        rows_.resize(row + 1);
+        rowSums_.resize(row + 1, 0u);
+      }
+      if (col >= rows_[row].size()) rows_[row].resize(col + 1, 0u);
+      return rows_[row];
+    }
+    
+    // the serialized format stores (col, value) pairs for each non-empty row, 
+    // which is compatible with the old map-based matrix
     friend class boost::serialization::access;
     template<class Archive>
     void save(Archive & ar, const unsigned int version) const {
       unsigned int numRows, numCols, col, value;
       std::vector<unsigned int> rowIndices;
       getRowIndices(rowIndices);
-      numRows = peakCountMap.size();
+      numRows = rowIndices.size();
       ar & numRows;
       BOOST_FOREACH(unsigned int row, rowIndices) {
-        numCols = peakCountMap.find(row)->second.size();
+        const unsigned int* rowData = NULL;
+        size_t rowSize = getRow(row, rowData);
+        numCols = rowSize - std::count(rowData, rowData + rowSize, 0u);
         ar & row;
         ar & numCols;
-        BOOST_FOREACH(ColumnValuePair colVal, peakCountMap.find(row)->second) {
-          col = colVal.first;
-          value = colVal.second;
-          ar & col;
-          ar & value;
+        for (col = 0; col < rowSize; ++col) {
+          value = rowData[col];
+          if (value > 0u) {
+            ar & col;
+            ar & value;
+          }
         }
       }
     }
     
     template<class Archive>
     void load(Archive & ar, const unsigned int version) {
-      unsigned int numRows, numCols, row, col;
+      unsigned int numRows, numCols, row, col, value;
+      *this = PeakCountMatrix();
       ar & numRows;
       for (unsigned int i = 0; i < numRows; ++i) {
         ar & row;
         ar & numCols;
         for (unsigned int j = 0; j < numCols; ++j) {
           ar & col;
-          ar & peakCountMap[row][col];
+          ar & value;
+          add(row, col, value);
         } 
       }
     }
@@ -122,22 +174,40 @@ class SpectrumCountVector {
   typedef std::pair<unsigned int, unsigned int> SpecCountMapRow;
   
   public:
-    SpectrumCountVector() {}
+    SpectrumCountVector() : isMapped_(false), numMappedRows_(0u), 
+        mappedPairs_(NULL) {}
     
     void add(SpectrumCountVector& other);
     void subtract(SpectrumCountVector& other);
-    inline void add(unsigned int row, unsigned int value) { specCountMap[row] += value; }
+    inline void add(unsigned int row, unsigned int value) { 
+      if (isMapped_) detach();
+      specCountMap[row] += value; 
+    }
     inline void subtract(unsigned int row, unsigned int value) { 
+      if (isMapped_) detach();
       specCountMap[row] -= (std::min)(value, specCountMap[row]);
     }
+    
+    // uses (row, value) pairs sorted by row in place, see 
+    // PeakCountMatrix::attach
+    void attach(unsigned int numRows, const unsigned int* pairs);
+    
     unsigned int get(unsigned int row) const;
     void getRowIndices(std::vector<unsigned int>& rowIndices) const;
     
-    unsigned int size() const { return specCountMap.size(); }
+    unsigned int size() const { 
+      return isMapped_ ? numMappedRows_ : specCountMap.size(); 
+    }
     static bool specVectorUnitTest();
   private:
     std::map<unsigned int, unsigned int> specCountMap;
     
+    bool isMapped_;
+    unsigned int numMappedRows_;
+    const unsigned int* mappedPairs_;
+    
+    void detach();
+    
     // splitting the serialization member function, because "ar & specCountMap" 
     // only deserialized the first entry, while ignoring the rest
     friend class boost::serialization::access;
@@ -146,10 +216,10 @@ class SpectrumCountVector {
       unsigned int numRows, value;
       std::vector<unsigned int> rowIndices;
       getRowIndices(rowIndices);
-      numRows = specCountMap.size();
+      numRows = rowIndices.size();
       ar & numRows;
       BOOST_FOREACH(unsigned int row, rowIndices) {
-        value = specCountMap.find(row)->second;
+        value = get(row);
         ar & row;
         ar & value;
       }
@@ -158,6 +228,7 @@ class SpectrumCountVector {
     template<class Archive>
     void load(Archive & ar, const unsigned int version) {
       unsigned int numRows, row;
+      *this = SpectrumCountVector();
       ar & numRows;
       for (unsigned int i = 0; i < numRows; ++i) {
         ar & row;
@@ -178,10 +249,10 @@ class PeakCounts {
         intThresh(0.0), truncatePeaks(true) {
       peakCountMatrices.resize(maxCharge);
       specCountVectors.resize(maxCharge);
-      peakDistCache_.resize(maxCharge);
     }
     
     void setSmoothingMode(int mode) { smoothingMode_ = mode; }
+    inline int getSmoothingMode() const { return smoothingMode_; }
 		void setRelativeToPrecMz(double fracPeakBinWidth);
 		inline void setPrecBinWidth(double d) { precBinWidth = d; }
 		inline void setPrecBinShift(double d) { precBinShift = d; }
@@ -196,9 +267,11 @@ class PeakCounts {
 		inline bool isRelativeToPrecMz() const { return relativeToPrecMz; }
 		
 		inline unsigned int getChargeBin(const unsigned int charge) const { return (std::min)(charge - 1, maxCharge - 1); }
+		inline unsigned int getPrecBin(double precMz) const { return BinSpectra::getBin(precMz, precBinWidth, precBinShift); }
 		
 		inline PeakCountMatrix& getPeakCountMatrix(const unsigned int charge) { return peakCountMatrices.at(getChargeBin(charge)); }
 		inline SpectrumCountVector& getSpecCountVector(const unsigned int charge) { return specCountVectors.at(getChargeBin(charge)); }
+		inline const SpectrumCountVector& getSpecCountVector(const unsigned int charge) const { return specCountVectors.at(getChargeBin(charge)); }
 		inline unsigned int getNumTotalPeaks() { return nTotalPeaks; }
 		
 		void addSpectrum(std::vector<MZIntensityPair>& mziPairs, 
@@ -207,6 +280,10 @@ class PeakCounts {
 		void addSpectrum(std::vector<BinnedMZIntensityPair>& mziPairs, 
 		    const double precMz, const unsigned int charge, 
 		    const unsigned int numQueryPeaks);
+		inline void addPrecursor(const double precMz, const unsigned int charge) {
+		  specCountVectors.at(getChargeBin(charge)).add(getPrecBin(precMz), 1);
+		}
+		void scaleToSpectrumCounts(const PeakCounts& precursorCounts);
 		
 		void add(PeakCounts& otherPeakCounts);
 		void subtract(PeakCounts& otherPeakCounts);
@@ -214,26 +291,41 @@ class PeakCounts {
 		
 		void generateSinglePeakDistribution(double precMz, unsigned int charge, PeakDistribution& distribution);
 		void generatePeakDistribution(double precMz, unsigned int charge, PeakDistribution& distribution,
-		                               unsigned int numQueryPeaks);
+		                               unsigned int numQueryPeaks) const;
+		void generatePeakDistribution(const PeakDistributionKey& key, 
+		                               PeakDistribution& distribution) const;
+		
+		PeakDistributionKey getPeakDistributionKey(double precMz, 
+		    unsigned int charge, unsigned int numQueryPeaks) const {
+		  return PeakDistributionKey(charge, getPrecBin(precMz), numQueryPeaks);
+		}
+		void generatePeakDistributionTable(std::vector<PeakDistributionKey>& keys,
+		                                   PeakDistributionTable& table) const;
+		size_t getPeakDistribution(
+		    const PeakDistributionTable& table, const PeakDistributionKey& key, 
+		    PeakDistribution& fallbackDistribution, const double*& peakDist) const;
 		void generateRelativePeakDistribution(const unsigned int charge, PeakDistribution& distribution) const;
 		
 		void print(const std::string& resultBaseFN);
 		void print(std::ostream& os, const unsigned int charge = 2u);
 		
 		void readFromFile(const std::string& peakCountFN);
+		void writeToFile(const std::string& peakCountFN) const;
+		PeakDistributionFingerprint getDistributionTableFingerprint(
+		    const std::string& peakCountFN) const;
 		void serialize(std::string& peakCountsSerialized);
     void deserialize(std::string& peakCountsSerialized);
 		
 		static void serializePeakCounts(PeakCounts& peakCounts, std::string& peakCountsSerialized);
     static void deserializePeakCounts(std::string& peakCountsSerialized, PeakCounts& peakCounts);
     static bool peakCountsSerializationUnitTest();
+    static bool peakCountsFlatFileUnitTest();
+    static bool peakDistributionLookupUnitTest();
 		
   private:
     std::vector<PeakCountMatrix> peakCountMatrices;
     std::vector<SpectrumCountVector> specCountVectors;
     
-    std::vector< std::map<unsigned int, PeakDistribution> > peakDistCache_;
-    
     int smoothingMode_;
     
     double precBinWidth, precBinShift;
@@ -246,7 +338,40 @@ class PeakCounts {
     double intThresh;
     bool truncatePeaks;
     
-    inline unsigned int getPrecBin(double precMz) const { return BinSpectra::getBin(precMz, precBinWidth, precBinShift); }
+    // keeps the flat peak count file mapped while the matrices refer to it
+    boost::shared_ptr<boost::iostreams::mapped_file_source> mappedFile_;
+    
+    // distributions written by the index step, see readFromFile
+    PeakDistributionTable persistedDistTable_;
+    
+    size_t findPersistedPeakDistribution(const PeakDistributionKey& key, 
+                                         const double*& peakDist) const;
+    
+    static const unsigned int kFlatFileMagic = 0x4350524du; // "MRPC"
+    static const unsigned int kFlatFileVersion = 1u;
+    
+    // all fields of the flat file are aligned to 8 bytes
+    struct FlatFileHeader {
+      unsigned int magic;
+      unsigned int version;
+      unsigned int maxCharge;
+      unsigned int nTotalPeaks;
+      unsigned int truncatePeaks;
+      unsigned int relativeToPrecMz;
+      double precBinWidth, precBinShift;
+      double peakBinWidth, peakBinShift;
+    };
+    
+    struct FlatFileChargeHeader {
+      unsigned long long numRows;
+      unsigned long long numCounts;
+      unsigned long long numSpecCountRows;
+      unsigned long long reserved;
+    };
+    
+    static bool isFlatFile(const std::string& peakCountFN);
+    void readFromFlatFile(const std::string& peakCountFN);
+    
     inline unsigned int getPeakBin(double peakMz) const { return BinSpectra::getBin(peakMz, peakBinWidth, peakBinShift); }
     inline double getPrecMz(unsigned int precBin) const { return BinSpectra::getMZ(precBin, precBinWidth, precBinShift); }
     inline unsigned int getRelPeakBin(double peakMz, double precMz, double fracPeakBinWidth) const { 
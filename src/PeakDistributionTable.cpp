@@ -0,0 +1,267 @@
+/******************************************************************************
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+ ******************************************************************************/
+
+#include "PeakDistributionTable.h"
+
+namespace {
+  size_t getPaddedSize(size_t numBytes) {
+    return (numBytes + 7) / 8 * 8;
+  }
+}
+
+// keys have to be sorted and unique
+void PeakDistributionTable::assign(
+    const std::vector<PeakDistributionKey>& keys,
+    const std::vector<PeakDistribution>& distributions, int smoothingMode) {
+  clear();
+  smoothingMode_ = smoothingMode;
+  numEntries_ = keys.size();
+  keys_ = keys;
+
+  offsets_.resize(numEntries_ + 1, 0uLL);
+  for (size_t i = 0; i < numEntries_; ++i) {
+    offsets_[i + 1] = offsets_[i] + distributions[i].getDistribution().size();
+  }
+  probs_.reserve(offsets_.back());
+  for (size_t i = 0; i < numEntries_; ++i) {
+    const std::vector<double>& peakDist = distributions[i].getDistribution();
+    probs_.insert(probs_.end(), peakDist.begin(), peakDist.end());
+  }
+}
+
+void PeakDistributionTable::clear() {
+  smoothingMode_ = 0;
+  numEntries_ = 0u;
+  fingerprint_ = PeakDistributionFingerprint();
+  keys_.clear();
+  offsets_.clear();
+  probs_.clear();
+  mappedFile_.reset();
+  mappedKeys_ = NULL;
+  mappedOffsets_ = NULL;
+  mappedProbs_ = NULL;
+}
+
+// returns the number of bins of the distribution and sets peakDist to its
+// first bin, or returns 0 if the key is not in the table
+size_t PeakDistributionTable::find(const PeakDistributionKey& key,
+    const double*& peakDist) const {
+  peakDist = NULL;
+  if (numEntries_ == 0u) return 0u;
+
+  const PeakDistributionKey* keys = getKeys();
+  const PeakDistributionKey* it = std::lower_bound(keys, keys + numEntries_, key);
+  if (it != keys + numEntries_ && *it == key) {
+    const unsigned long long* offsets = getOffsets();
+    size_t idx = it - keys;
+    peakDist = getProbs() + offsets[idx];
+    return static_cast<size_t>(offsets[idx + 1] - offsets[idx]);
+  } else {
+    return 0u;
+  }
+}
+
+// e.g. out/maracluster.peak_counts.dat -> out/maracluster.peak_counts.distributions.dat
+std::string PeakDistributionTable::getFilename(const std::string& peakCountFN) {
+  std::string extension = ".dat";
+  std::string baseFN = peakCountFN;
+  if (baseFN.size() >= extension.size() &&
+      baseFN.compare(baseFN.size() - extension.size(), extension.size(), extension) == 0) {
+    baseFN.erase(baseFN.size() - extension.size());
+  }
+  return baseFN + ".distributions.dat";
+}
+
+/**
+ * File layout:
+ *   FileHeader
+ *   PeakDistributionKey keys[numEntries] (padded to 8 bytes)
+ *   unsigned long long offsets[numEntries + 1]
+ *   double probs[offsets[numEntries]]
+ */
+void PeakDistributionTable::writeToFile(const std::string& tableFN) const {
+  std::ofstream tableStream(tableFN.c_str(),
+      std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!tableStream.is_open()) {
+    std::ostringstream ss;
+    ss << "ERROR: Could not write peak distributions to " << tableFN << std::endl;
+    throw MyException(ss);
+  }
+
+  FileHeader header;
+  header.magic = kMagic;
+  header.version = kVersion;
+  header.smoothingMode = smoothingMode_;
+  header.reserved = 0u;
+  header.numEntries = numEntries_;
+  header.fingerprint = fingerprint_;
+  tableStream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  size_t keysSize = numEntries_ * sizeof(PeakDistributionKey);
+  if (numEntries_ > 0) {
+    tableStream.write(reinterpret_cast<const char*>(getKeys()), keysSize);
+  }
+  std::vector<char> padding(getPaddedSize(keysSize) - keysSize, 0);
+  if (padding.size() > 0) tableStream.write(&padding[0], padding.size());
+
+  std::vector<unsigned long long> offsets(getOffsets(),
+      getOffsets() + (numEntries_ > 0 ? numEntries_ + 1 : 0));
+  if (offsets.empty()) offsets.push_back(0uLL);
+  tableStream.write(reinterpret_cast<const char*>(&offsets[0]),
+                    offsets.size() * sizeof(unsigned long long));
+
+  if (offsets.back() > 0uLL) {
+    tableStream.write(reinterpret_cast<const char*>(getProbs()),
+                      offsets.back() * sizeof(double));
+  }
+
+  if (!tableStream.good()) {
+    std::ostringstream ss;
+    ss << "ERROR: Could not write peak distributions to " << tableFN << std::endl;
+    throw MyException(ss);
+  }
+}
+
+// maps the table file and uses it in place, returns false if the file does
+// not exist, is not a peak distribution table or was computed from other 
+// peak counts than those of the given fingerprint
+bool PeakDistributionTable::readFromFile(const std::string& tableFN, 
+    const PeakDistributionFingerprint& fingerprint) {
+  clear();
+
+  {
+    std::ifstream tableStream(tableFN.c_str(), std::ios::binary);
+    unsigned int magicAndVersion[2] = { 0u, 0u };
+    tableStream.read(reinterpret_cast<char*>(magicAndVersion), 
+                     sizeof(magicAndVersion));
+    if (!tableStream.good() || magicAndVersion[0] != kMagic) return false;
+    if (magicAndVersion[1] != kVersion) {
+      std::cerr << "WARNING: ignoring peak distribution table " << tableFN
+                << " with unknown version " << magicAndVersion[1] << std::endl;
+      return false;
+    }
+    FileHeader header;
+    tableStream.seekg(0);
+    tableStream.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!tableStream.good()) {
+      std::cerr << "WARNING: ignoring truncated peak distribution table "
+                << tableFN << std::endl;
+      return false;
+    }
+    if (header.fingerprint != fingerprint) {
+      std::cerr << "WARNING: ignoring peak distribution table " << tableFN
+                << ", it was computed from different peak counts or binning"
+                << std::endl;
+      return false;
+    }
+  }
+
+  boost::shared_ptr<boost::iostreams::mapped_file_source> mappedFile(
+      new boost::iostreams::mapped_file_source(tableFN));
+  const char* f = mappedFile->data();
+  const char* l = f + mappedFile->size();
+
+  const FileHeader* header = reinterpret_cast<const FileHeader*>(f);
+  size_t numEntries = header->numEntries;
+
+  const char* p = f + sizeof(FileHeader);
+  const PeakDistributionKey* keys = reinterpret_cast<const PeakDistributionKey*>(p);
+  p += getPaddedSize(numEntries * sizeof(PeakDistributionKey));
+  const unsigned long long* offsets = reinterpret_cast<const unsigned long long*>(p);
+  p += (numEntries + 1) * sizeof(unsigned long long);
+  const double* probs = reinterpret_cast<const double*>(p);
+  if (p > l || p + offsets[numEntries] * sizeof(double) > l) {
+    std::cerr << "WARNING: ignoring truncated peak distribution table "
+              << tableFN << std::endl;
+    return false;
+  }
+
+  smoothingMode_ = header->smoothingMode;
+  numEntries_ = numEntries;
+  fingerprint_ = header->fingerprint;
+  mappedFile_ = mappedFile;
+  mappedKeys_ = keys;
+  mappedOffsets_ = offsets;
+  mappedProbs_ = probs;
+  return true;
+}
+
+bool PeakDistributionTable::unitTest() {
+  std::string tableFN = "peak_distribution_table_unit_test.dat";
+
+  std::vector<PeakDistributionKey> keys;
+  std::vector<PeakDistribution> distributions(3);
+  keys.push_back(PeakDistributionKey(2u, 150u, 40u));
+  keys.push_back(PeakDistributionKey(2u, 151u, 40u));
+  keys.push_back(PeakDistributionKey(3u, 150u, 40u));
+  for (unsigned int i = 0; i < distributions.size(); ++i) {
+    distributions[i].init(10u + i);
+    for (unsigned int bin = 0; bin < 10u + i; ++bin) {
+      distributions[i].insert(bin, 0.01 * (bin + i));
+    }
+  }
+
+  PeakDistributionFingerprint fingerprint;
+  fingerprint.peakCountFileSize = 1234uLL;
+  fingerprint.peakCountChecksum = 5678uLL;
+  fingerprint.precBinWidth = fingerprint.peakBinWidth = 1.000508;
+  fingerprint.precBinShift = fingerprint.peakBinShift = 0.32;
+  fingerprint.maxCharge = 3u;
+
+  PeakDistributionTable table, mappedTable;
+  table.assign(keys, distributions, 1);
+  table.setFingerprint(fingerprint);
+  table.writeToFile(tableFN);
+
+  bool success = true;
+  if (!mappedTable.readFromFile(tableFN, fingerprint) || 
+      mappedTable.size() != 3u || mappedTable.getSmoothingMode() != 1) {
+    std::cerr << "Could not read back the peak distribution table" << std::endl;
+    success = false;
+  }
+
+  // a table of other peak counts should be refused
+  PeakDistributionFingerprint otherFingerprint = fingerprint;
+  otherFingerprint.peakCountChecksum += 1uLL;
+  PeakDistributionTable refusedTable;
+  if (refusedTable.readFromFile(tableFN, otherFingerprint) || 
+      refusedTable.size() != 0u) {
+    std::cerr << "Read a peak distribution table with a different fingerprint" 
+              << std::endl;
+    success = false;
+  }
+
+  for (unsigned int i = 0; i < keys.size() && success; ++i) {
+    const double* peakDist = NULL;
+    size_t numBins = mappedTable.find(keys[i], peakDist);
+    std::vector<double> readDist(peakDist, peakDist + numBins);
+    if (readDist != distributions[i].getDistribution()) {
+      std::cerr << "Mapped peak distribution " << i << " differs" << std::endl;
+      success = false;
+    }
+  }
+
+  const double* peakDist = NULL;
+  if (mappedTable.find(PeakDistributionKey(2u, 152u, 40u), peakDist) != 0u ||
+      peakDist != NULL) {
+    std::cerr << "Found a peak distribution for a missing key" << std::endl;
+    success = false;
+  }
+
+  mappedTable.clear();
+  std::remove(tableFN.c_str());
+  return success;
+}
@@ -0,0 +1,158 @@
+/******************************************************************************
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+ ******************************************************************************/
+
+#ifndef PEAK_DISTRIBUTION_TABLE_H
+#define PEAK_DISTRIBUTION_TABLE_H
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "PeakDistribution.h"
+#include "MyException.h"
+
+struct PeakDistributionKey {
+  PeakDistributionKey() : charge(0u), precMzBin(0u), numQueryPeaks(0u) {}
+  PeakDistributionKey(unsigned int _charge, unsigned int _precMzBin,
+                      unsigned int _numQueryPeaks) : charge(_charge),
+    precMzBin(_precMzBin), numQueryPeaks(_numQueryPeaks) {}
+
+  unsigned int charge;
+  unsigned int precMzBin;
+  unsigned int numQueryPeaks;
+
+  inline bool operator<(const PeakDistributionKey& other) const {
+    return charge < other.charge || (charge == other.charge &&
+        (precMzBin < other.precMzBin || (precMzBin == other.precMzBin &&
+            numQueryPeaks < other.numQueryPeaks)));
+  }
+  inline bool operator==(const PeakDistributionKey& other) const {
+    return charge == other.charge && precMzBin == other.precMzBin &&
+           numQueryPeaks == other.numQueryPeaks;
+  }
+};
+
+// identifies the peak counts a persisted table was computed from, see
+// PeakCounts::getDistributionTableFingerprint
+struct PeakDistributionFingerprint {
+  PeakDistributionFingerprint() : peakCountFileSize(0uLL), 
+      peakCountChecksum(0uLL), precBinWidth(0.0), precBinShift(0.0), 
+      peakBinWidth(0.0), peakBinShift(0.0), maxCharge(0u), reserved(0u) {}
+  
+  unsigned long long peakCountFileSize;
+  unsigned long long peakCountChecksum;
+  double precBinWidth, precBinShift;
+  double peakBinWidth, peakBinShift;
+  unsigned int maxCharge;
+  unsigned int reserved;
+  
+  inline bool operator==(const PeakDistributionFingerprint& other) const {
+    return peakCountFileSize == other.peakCountFileSize && 
+           peakCountChecksum == other.peakCountChecksum &&
+           precBinWidth == other.precBinWidth && 
+           precBinShift == other.precBinShift &&
+           peakBinWidth == other.peakBinWidth && 
+           peakBinShift == other.peakBinShift &&
+           maxCharge == other.maxCharge;
+  }
+  inline bool operator!=(const PeakDistributionFingerprint& other) const {
+    return !(*this == other);
+  }
+};
+
+/**
+ * Peak distributions for a fixed set of (charge, precursor bin) pairs. The
+ * table is filled once by PeakCounts::generatePeakDistributionTable and is
+ * read-only afterwards, so it can be shared between threads without locking.
+ *
+ * The index step writes the table for all spectra next to the peak counts
+ * file. The pvalue processes map this file and use the distributions in
+ * place, so that they share a single copy in the page cache. The header
+ * holds the fingerprint of the peak counts, a table whose fingerprint does
+ * not match the peak counts of the reading process is not used.
+ */
+class PeakDistributionTable {
+ public:
+  PeakDistributionTable() : smoothingMode_(0), numEntries_(0u),
+      mappedKeys_(NULL), mappedOffsets_(NULL), mappedProbs_(NULL) {}
+
+  void assign(const std::vector<PeakDistributionKey>& keys,
+              const std::vector<PeakDistribution>& distributions,
+              int smoothingMode);
+  void clear();
+
+  size_t find(const PeakDistributionKey& key, const double*& peakDist) const;
+
+  inline size_t size() const { return numEntries_; }
+  inline int getSmoothingMode() const { return smoothingMode_; }
+  inline void setFingerprint(const PeakDistributionFingerprint& fingerprint) {
+    fingerprint_ = fingerprint;
+  }
+
+  void writeToFile(const std::string& tableFN) const;
+  bool readFromFile(const std::string& tableFN, 
+                    const PeakDistributionFingerprint& fingerprint);
+
+  static std::string getFilename(const std::string& peakCountFN);
+  static bool unitTest();
+ private:
+  static const unsigned int kMagic = 0x5444524du; // "MRDT"
+  static const unsigned int kVersion = 2u;
+
+  // all sections of the file are aligned to 8 bytes
+  struct FileHeader {
+    unsigned int magic;
+    unsigned int version;
+    int smoothingMode;
+    unsigned int reserved;
+    unsigned long long numEntries;
+    PeakDistributionFingerprint fingerprint;
+  };
+
+  int smoothingMode_;
+  size_t numEntries_;
+  PeakDistributionFingerprint fingerprint_;
+
+  // sorted keys, the distribution of keys_[i] is stored in
+  // probs_[offsets_[i]] to probs_[offsets_[i+1]-1]
+  std::vector<PeakDistributionKey> keys_;
+  std::vector<unsigned long long> offsets_;
+  std::vector<double> probs_;
+
+  boost::shared_ptr<boost::iostreams::mapped_file_source> mappedFile_;
+  const PeakDistributionKey* mappedKeys_;
+  const unsigned long long* mappedOffsets_;
+  const double* mappedProbs_;
+
+  inline const PeakDistributionKey* getKeys() const {
+    return mappedFile_ ? mappedKeys_ : (keys_.empty() ? NULL : &keys_[0]);
+  }
+  inline const unsigned long long* getOffsets() const {
+    return mappedFile_ ? mappedOffsets_ : (offsets_.empty() ? NULL : &offsets_[0]);
+  }
+  inline const double* getProbs() const {
+    return mappedFile_ ? mappedProbs_ : (probs_.empty() ? NULL : &probs_[0]);
+  }
+};
+
+#endif // PEAK_DISTRIBUTION_TABLE_H
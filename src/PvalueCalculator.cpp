@@ -30,33 +30,56 @@ const double PvalueCalculator::kMinProb = 1e-10;
 const double PvalueCalculator::kMaxProb = 0.4;
 const unsigned int PvalueCalculator::kMinScoringPeaks = 15u;
 const bool PvalueCalculator::kVariableScoringPeaks = false;
+unsigned int PvalueCalculator::maxScoringPeaks_ = PvalueCalculator::kMaxScoringPeaks;
+bool PvalueCalculator::approxPvalVectors_ = false;
+bool PvalueCalculator::singlePrecision_ = false;
+const unsigned int PvalueCalculator::kNumApproxScores = 24u;
 
 unsigned long PvalueCalculator::seed_ = 1;
 
-void PvalueCalculator::init(const std::vector<unsigned int>& peakBins, const std::vector<double>& peakProbs) {
-  peakBins_ = peakBins;
-  peakProbs_ = peakProbs;
+const std::vector<PvalueCalculator::PolyfitFactorization> 
+    PvalueCalculator::polyfitFactorizations_ = 
+        PvalueCalculator::initPolyfitFactorizations(
+            PvalueCalculator::kMaxScoringPeaks * PvalueCalculator::probDiscretizationLevels_ + 1u);
+
+template <class Layout>
+void BasicPvalueCalculator<Layout>::init(const short* peakBins, unsigned int numPeaks) {
+  numPeaks_ = (std::min)(numPeaks, kMaxScoringPeaks);
+  std::copy(peakBins, peakBins + numPeaks_, peakBins_);
 }
 
-void PvalueCalculator::initPolyfit(const std::vector<unsigned int>& peakBins, const std::vector<unsigned int>& peakScores, const std::vector<double>& polyfit) {
-  peakBins_ = peakBins;
-  peakScores_ = peakScores;
-  maxScore_ = std::accumulate(peakScores_.begin(), peakScores_.end(), 0u);
-  polyfit_ = polyfit;
+template <class Layout>
+void BasicPvalueCalculator<Layout>::initPolyfit(const short* peakBins, 
+    const short* peakScores, const PolyfitValue* polyfit) {
+  numPeaks_ = 0u;
+  maxScore_ = 0u;
+  minMatchedScore_ = 0u;
+  minMatchedPeaks_ = 0u;
+  while (numPeaks_ < kMaxScoringPeaks && peakBins[numPeaks_] != 0) {
+    peakBins_[numPeaks_] = peakBins[numPeaks_];
+    peakScores_[numPeaks_] = peakScores[numPeaks_];
+    maxScore_ += peakScores[numPeaks_];
+    ++numPeaks_;
+  }
+  std::copy(polyfit, polyfit + kNumPolyfitCoeffs, polyfit_);
 }
 
-void PvalueCalculator::initFromPeakBins(
-    const std::vector<unsigned int>& originalPeakBins, 
-    const std::vector<double>& peakDist) {
-  peakProbs_.clear();
-  peakBins_.clear();
+template <class Layout>
+void BasicPvalueCalculator<Layout>::initFromPeakBins(const short* originalPeakBins, 
+    unsigned int numOriginalPeaks, const double* peakDist, size_t numBins, 
+    Scratch& scratch) {
+  // peakDist is shared between all calculators, only the probabilities of
+  // this spectrum's peaks are copied
+  scratch.peakProbs.clear();
+  numPeaks_ = 0u;
   
-  BOOST_FOREACH (const unsigned int mzBin, originalPeakBins) {
-    if (mzBin >= peakDist.size()) break;
-    double peakProb = peakDist.at(mzBin);
+  for (unsigned int i = 0; i < numOriginalPeaks && numPeaks_ < kMaxScoringPeaks; ++i) {
+    const unsigned int mzBin = originalPeakBins[i];
+    if (mzBin >= numBins) break;
+    double peakProb = peakDist[mzBin];
     if (peakProb > kMinProb && peakProb < kMaxProb) {
-      peakProbs_.push_back(peakProb);
-      peakBins_.push_back(mzBin);
+      scratch.peakProbs.push_back(peakProb);
+      peakBins_[numPeaks_++] = originalPeakBins[i];
       //std::cerr << mzBin << " " << peakProb << std::endl;
     } else if (peakProb <= kMinProb) {
       //std::cerr << "Warning: peak probability below minimum" << std::endl;
@@ -65,61 +88,40 @@ void PvalueCalculator::initFromPeakBins(
     }
   }
   
-  if (peakDist.size() == 0) {
+  if (numBins == 0) {
     std::cerr << "Warning: empty peak distribution!" << std::endl;
   }
 }
 
-void PvalueCalculator::binaryMatchPeakBins(const std::vector<unsigned int>& queryPeakBins, std::vector<bool>& d) {
-  int candIdx = 0;
-  
-  for (int i = 0; i < peakBins_.size(); ++i) {
-    if (candIdx >= queryPeakBins.size()) break;
-    while (peakBins_[i] > queryPeakBins[candIdx]) {
-      if (++candIdx >= queryPeakBins.size()) break;
-    }
-    if (candIdx >= queryPeakBins.size()) break;
-    if (peakBins_[i] == queryPeakBins[candIdx]) {
-      d[i] = true;
-      ++candIdx;
-    } else {
-      d[i] = false;
-    }
+// calculate the logits x_i = log((1-p_i)/p_i) and discretize them to 
+// integer scores l_i = round(x_i/k), such that the largest score is 
+// probDiscretizationLevels_
+template <class Layout>
+double BasicPvalueCalculator<Layout>::discretizePeakScores(const Scratch& scratch, 
+    double& sumLogP) {
+  if (scratch.peakProbs.size() > kMaxScoringPeaks) {
+    throw std::runtime_error("Found more peak probabilities than scoring peaks in pvalue calculation.");
   }
-}
-
-/**
-Input: 
-p - list of the probabilities of all the peptides of this protein
-d - list including 1 for peptides matched to MS1-features, 0 otherwise
-smooth_pvalue - True if the pvalues should be smoothed 
-steps_per_position - discretization step
-
-Output: estimated p value
-*/
-void PvalueCalculator::computePvalVector() {
-  
-	//std::cerr << "Computing pvalue vector" << std::endl;
-  // calculate the vector x and the sum of log(pi)
-  std::vector<double> x;
-  double sumLogP = 0.0;
-  BOOST_FOREACH(double pi, peakProbs_) {
+  double x[kMaxScoringPeaks];
+  unsigned int numProbs = scratch.peakProbs.size();
+  sumLogP = 0.0;
+  for (unsigned int j = 0; j < numProbs; ++j) {
+    double pi = scratch.peakProbs[j];
     if (pi >= 0.5) {
       throw std::runtime_error("Found a probability >= 0.5, this will result in an error in pvalue calculation.");
     }
-    x.push_back( log( (1.0 - pi)/pi ) );
+    x[j] = log( (1.0 - pi)/pi );
     sumLogP += log(pi);
   }
   
   // discretize each xi to get li and compute the sum of all li 
-  peakScores_.clear();
   unsigned int sumL = 0u;
   double k = 0.0;
-  if (x.size() > 0) {
-    k = *std::max_element(x.begin(), x.end()) / probDiscretizationLevels_;
-    BOOST_FOREACH(double xi, x) {
-      unsigned int li = static_cast<unsigned int>(round(xi/k));
-      peakScores_.push_back(li);
+  if (numProbs > 0) {
+    k = *std::max_element(x, x + numProbs) / probDiscretizationLevels_;
+    for (unsigned int j = 0; j < numProbs; ++j) {
+      unsigned int li = static_cast<unsigned int>(round(x[j]/k));
+      peakScores_[j] = li;
       if (li == 0) {
         std::cerr << "Warning: zero-scoring peak" << std::endl;
       }
@@ -129,38 +131,57 @@ void PvalueCalculator::computePvalVector() {
     //std::cout << sumL << " " << l.size() << std::endl;
   }
   maxScore_ = sumL;
+  return k;
+}
+
+/**
+Input: 
+p - list of the probabilities of all the peptides of this protein
+d - list including 1 for peptides matched to MS1-features, 0 otherwise
+smooth_pvalue - True if the pvalues should be smoothed 
+steps_per_position - discretization step
+
+Output: estimated p value
+*/
+template <class Layout>
+void BasicPvalueCalculator<Layout>::computePvalVector(Scratch& scratch) {
+  
+	//std::cerr << "Computing pvalue vector" << std::endl;
+  double sumLogP = 0.0;
+  double k = discretizePeakScores(scratch, sumLogP);
+  unsigned int numProbs = scratch.peakProbs.size();
+  unsigned int sumL = maxScore_;
   
-  // dynamic programming, the easy way
-  std::vector<double> f(sumL + 1);
+  // dynamic programming, the inner loops over the score levels are 
+  // vectorized by PvalueKernels
+  std::vector<double>& f = scratch.scoreDist;
+  f.assign(sumL + 1, 0.0);
   f[0] = 1.0;
   double c = 0.0;
   unsigned int partSumL = 0u;
-  std::vector<unsigned int> ls(peakScores_);
-  std::sort(ls.begin(), ls.end());
-  for (unsigned int j = 0; j < ls.size(); ++j) {
+  unsigned int ls[kMaxScoringPeaks];
+  std::copy(peakScores_, peakScores_ + numProbs, ls);
+  std::sort(ls, ls + numProbs);
+  for (unsigned int j = 0; j < numProbs; ++j) {
     if (j % 30 == 29) {
-      double fm = *std::max_element(f.begin(), f.begin() + partSumL + 1);
+      double fm = PvalueKernels::normalize(&f[0], partSumL + 1);
       c += log(fm);
-      for (unsigned int i = 0; i <= partSumL; ++i) {
-        f[i] /= fm;
-      }
     }
     if (ls[j] > 0) {
       partSumL += ls[j];
-      for (unsigned int i = partSumL; i >= ls[j]; --i) {
-        f[i] += f[i-ls[j]];
-      }
+      PvalueKernels::addShifted(&f[0], ls[j], partSumL);
     }
   }
   
   // calculate the final p-value vector
-  sumProb_.resize(sumL + 1);
-  sumProb_[0] = exp(log(f[0]) + sumLogP + c);
+  std::vector<double>& sumProb = scratch.sumProb;
+  sumProb.resize(sumL + 1);
+  sumProb[0] = exp(log(f[0]) + sumLogP + c);
   for (unsigned int i = 1; i < sumL + 1; ++i) {
     if (f[i] == 0) {
-      sumProb_[i] = sumProb_[i-1];
+      sumProb[i] = sumProb[i-1];
     } else {
-      sumProb_[i] = sumProb_[i-1] + exp (i * k + log(f[i]) + sumLogP + c);
+      sumProb[i] = sumProb[i-1] + exp (i * k + log(f[i]) + sumLogP + c);
     }
   }
   //std::cerr << "Computed pvalue vector" << std::endl;
@@ -175,89 +196,307 @@ smooth_pvalue - True if the pvalues should be smoothed
 
 Output: estimated p value
 */
-double PvalueCalculator::computePval(const std::vector<unsigned int>& queryPeakBins, bool smoothing) {
-  std::vector<bool> d(peakBins_.size());
-  binaryMatchPeakBins(queryPeakBins, d);
+template <class Layout>
+double BasicPvalueCalculator<Layout>::computePval(const short* queryPeakBins, 
+    unsigned int numQueryPeaks, const Scratch& scratch, bool smoothing) {
+  // express P(D|R = 0) in terms of li (D = obs config), i.e. the sum of the
+  // scores of the unmatched peaks
+  unsigned int sumThresh = maxScore_ - PvalueKernels::matchedScore(
+      peakBins_, peakScores_, numPeaks_, queryPeakBins, numQueryPeaks);
   
-  // express P(D|R = 0) in terms of li (D = obs config)
-  double sumThresh = 0.0;
-  double sumMax = 0.0;
-  unsigned int numMatches = 0;
-  double sumScores = 0.0;
-  for (unsigned int i = 0; i < d.size(); ++i) {
-    if (!d[i]) {
-      sumThresh += peakScores_[i];
+  if (smoothing) {
+    double lastScoreContrib;
+    if (sumThresh > 0) {
+      lastScoreContrib = scratch.sumProb[sumThresh] - scratch.sumProb[sumThresh-1];
     } else {
-      sumScores += peakScores_[i];
-      ++numMatches;
+      lastScoreContrib = scratch.sumProb[sumThresh];
+    }
+    return (std::min)(1.0,scratch.sumProb[sumThresh] - lcg_rand_unif()*lastScoreContrib);
+  } else {
+    return (std::min)(1.0,scratch.sumProb[sumThresh]);
+  }
+}
+
+// X^T X has the entries sum_score (score/maxScore)^(j+k), which are computed 
+// from the power sums P_m = sum_score score^m
+void PvalueCalculator::factorizeNormalEquations(
+    const double powerSums[2*kPolyfitDegree + 1], unsigned int maxScore, 
+    PolyfitFactorization& factorization) {
+  double xtx[kNumPolyfitCoeffs][kNumPolyfitCoeffs];
+  for (unsigned int j = 0; j < kNumPolyfitCoeffs; ++j) {
+    for (unsigned int k = 0; k <= j; ++k) {
+      xtx[j][k] = powerSums[j + k] / std::pow(static_cast<double>(maxScore), 
+                                              static_cast<int>(j + k));
     }
-    sumMax += peakScores_[i];
   }
-  //std::cout << sumScores/(std::max)(1u,numMatches) << '\t';
   
-  //std::cout << numMatches << '\t' << queryPeakBins.size() << "\t" << peakBins_.size() << "\t";
+  factorization.isValid = true;
+  for (unsigned int j = 0; j < kNumPolyfitCoeffs; ++j) {
+    for (unsigned int i = j; i < kNumPolyfitCoeffs; ++i) {
+      double sum = xtx[i][j];
+      for (unsigned int k = 0; k < j; ++k) {
+        sum -= factorization.L[i][k] * factorization.L[j][k];
+      }
+      if (i == j) {
+        // X^T X is singular if there are fewer scores than coefficients, 
+        // the pivot then only consists of rounding errors
+        if (sum <= kMinRelativePivot * xtx[j][j]) {
+          factorization.isValid = false;
+          return;
+        }
+        factorization.L[j][j] = std::sqrt(sum);
+      } else {
+        factorization.L[i][j] = sum / factorization.L[j][j];
+      }
+    }
+  }
+}
+
+const double PvalueCalculator::kMinRelativePivot = 1e-12;
+
+std::vector<PvalueCalculator::PolyfitFactorization> 
+    PvalueCalculator::initPolyfitFactorizations(unsigned int maxCachedScore) {
+  std::vector<PolyfitFactorization> factorizations(maxCachedScore + 1);
+  double powerSums[2*kPolyfitDegree + 1] = { 0.0 };
+  factorizations[0].isValid = false;
+  for (unsigned int maxScore = 1; maxScore <= maxCachedScore; ++maxScore) {
+    double value = 1.0, score = maxScore - 1;
+    for (unsigned int m = 0; m < 2*kPolyfitDegree + 1; ++m) {
+      powerSums[m] += value;
+      value *= score;
+    }
+    factorizeNormalEquations(powerSums, maxScore, factorizations[maxScore]);
+  }
+  return factorizations;
+}
+
+// returns the cached factorization, or computes it in factorization if 
+// maxScore is larger than the cached ones
+const PvalueCalculator::PolyfitFactorization& 
+    PvalueCalculator::getPolyfitFactorization(unsigned int maxScore, 
+                                              PolyfitFactorization& factorization) {
+  if (maxScore < polyfitFactorizations_.size()) {
+    return polyfitFactorizations_[maxScore];
+  }
   
-  if (smoothing) {
-    double lastScoreContrib;
-    if (sumThresh > 0) {
-      lastScoreContrib = sumProb_[sumThresh] - sumProb_[sumThresh-1];
-    } else {
-      lastScoreContrib = sumProb_[sumThresh];
+  double powerSums[2*kPolyfitDegree + 1] = { 0.0 };
+  for (unsigned int score = 0; score < maxScore; ++score) {
+    double value = 1.0;
+    for (unsigned int m = 0; m < 2*kPolyfitDegree + 1; ++m) {
+      powerSums[m] += value;
+      value *= score;
+    }
+  }
+  factorizeNormalEquations(powerSums, maxScore, factorization);
+  return factorization;
+}
+
+// least squares fit of a polynomial of degree kPolyfitDegree to the log10 
+// p-value vector by solving the normal equations (X^T X) c = X^T y with the 
+// precomputed Cholesky factorization of X^T X
+template <class Layout>
+void BasicPvalueCalculator<Layout>::computePvalVectorPolyfit(Scratch& scratch) {
+  if (approxPvalVectors_) {
+    computePvalVectorApproxPolyfit(scratch);
+    return;
+  }
+  
+  computePvalVector(scratch);
+  
+  const std::vector<double>& sumProb = scratch.sumProb;
+  unsigned int maxScore = sumProb.size();
+  
+  double xty[kNumPolyfitCoeffs] = { 0.0 };
+  for (unsigned int score = 0; score < maxScore; ++score) {
+    double y = log10(sumProb[score]);
+    double value = 1.0;
+    double relScore = static_cast<double>(score)/maxScore;
+    for (unsigned int col = 0; col < kNumPolyfitCoeffs; ++col) {
+      xty[col] += value * y;
+      value *= relScore;
     }
-    return (std::min)(1.0,sumProb_[sumThresh] - lcg_rand_unif()*lastScoreContrib);
+  }
+  
+  PolyfitFactorization uncachedFactorization;
+  const PolyfitFactorization& factorization = 
+      getPolyfitFactorization(maxScore, uncachedFactorization);
+  solvePolyfit(xty, factorization, maxScore);
+  
+  // TODO: check the residuals?
+}
+
+template <class Layout>
+void BasicPvalueCalculator<Layout>::solvePolyfit(const double xty[kNumPolyfitCoeffs], 
+    const PolyfitFactorization& factorization, unsigned int numScores) {
+  // solved in double precision and only rounded when stored
+  double coeffs[kNumPolyfitCoeffs] = { 0.0 };
+  minMatchedScore_ = 0u;
+  minMatchedPeaks_ = 0u;
+  
+  if (factorization.isValid) {
+    // forward substitution L z = X^T y, followed by back substitution L^T c = z
+    double z[kNumPolyfitCoeffs];
+    for (unsigned int i = 0; i < kNumPolyfitCoeffs; ++i) {
+      double sum = xty[i];
+      for (unsigned int k = 0; k < i; ++k) sum -= factorization.L[i][k] * z[k];
+      z[i] = sum / factorization.L[i][i];
+    }
+    for (int i = kNumPolyfitCoeffs - 1; i >= 0; --i) {
+      double sum = z[i];
+      for (unsigned int k = i + 1; k < kNumPolyfitCoeffs; ++k) {
+        sum -= factorization.L[k][i] * coeffs[k];
+      }
+      coeffs[i] = sum / factorization.L[i][i];
+    }
+  } else if (numScores > 0) {
+    // too few scores for the polynomial, fall back to a constant fit
+    coeffs[0] = xty[0] / numScores;
+  }
+  std::copy(coeffs, coeffs + kNumPolyfitCoeffs, polyfit_);
+}
+
+// The dynamic programming of computePvalVector sums the weights exp(k*l(S))
+// over all subsets S of unmatched peaks, where l(S) is the sum of their 
+// scores l_i, i.e. sumProb[s] is prod_i p_i times the weight of the subsets
+// with l(S) <= s. Instead of the full distribution, this evaluates the 
+// Lugannani-Rice saddle point approximation of these weights at 
+// kNumApproxScores evenly spaced scores and fits the polynomial to those. 
+// Scores below the smallest peak score and the maximum score are exact.
+template <class Layout>
+void BasicPvalueCalculator<Layout>::computePvalVectorApproxPolyfit(Scratch& scratch) {
+  double sumLogP = 0.0;
+  double k = discretizePeakScores(scratch, sumLogP);
+  unsigned int numProbs = scratch.peakProbs.size();
+  unsigned int sumL = maxScore_;
+  
+  // zero-scoring peaks are skipped by the dynamic programming as well
+  unsigned int scores[kMaxScoringPeaks];
+  unsigned int numScores = 0u;
+  for (unsigned int j = 0; j < numProbs; ++j) {
+    if (peakScores_[j] > 0) scores[numScores++] = peakScores_[j];
+  }
+  std::sort(scores, scores + numScores);
+  unsigned int minPeakScore = (numScores > 0) ? scores[0] : sumL;
+  
+  double dK, d2K, d3K;
+  double logTotalWeight = logisticCumulants(scores, numScores, k, dK, d2K, d3K);
+  
+  unsigned int maxScore = sumL + 1u;
+  double xty[kNumPolyfitCoeffs] = { 0.0 };
+  double powerSums[2*kPolyfitDegree + 1] = { 0.0 };
+  unsigned int numFitScores = 0u, lastScore = 0u;
+  double t = 0.0;
+  for (unsigned int i = 0; i < kNumApproxScores; ++i) {
+    unsigned int score = (i * sumL) / (kNumApproxScores - 1u);
+    if (i > 0 && score == lastScore) continue;
+    lastScore = score;
+    ++numFitScores;
+    
+    double logPval = sumLogP;
+    if (score == sumL) {
+      logPval += logTotalWeight;
+    } else if (score >= minPeakScore) {
+      // continuity correction for the integer scores
+      logPval += saddlepointLogCdf(scores, numScores, k, logTotalWeight, 
+                                   score + 0.5, t);
+    } // else only the empty subset scores below the smallest peak score
+    
+    double y = logPval / log(10.0);
+    double value = 1.0;
+    for (unsigned int m = 0; m < 2*kPolyfitDegree + 1; ++m) {
+      powerSums[m] += value;
+      value *= score;
+    }
+    value = 1.0;
+    double relScore = static_cast<double>(score)/maxScore;
+    for (unsigned int col = 0; col < kNumPolyfitCoeffs; ++col) {
+      xty[col] += value * y;
+      value *= relScore;
+    }
+  }
+  
+  PolyfitFactorization factorization;
+  factorizeNormalEquations(powerSums, maxScore, factorization);
+  solvePolyfit(xty, factorization, numFitScores);
+}
+
+// K(tau) = sum_i log(1 + exp(tau*l_i)) and its first three derivatives for
+// integer scores l_i in ascending order. The terms exp(-|tau|*l_i) are 
+// computed as powers of a single exponential, which cannot overflow.
+double PvalueCalculator::logisticCumulants(const unsigned int* scores, 
+    unsigned int numScores, double tau, double& dK, double& d2K, double& d3K) {
+  double q = exp(-std::abs(tau)), power = 1.0, prod = 1.0, sumScores = 0.0;
+  unsigned int exponent = 0u;
+  dK = 0.0;
+  d2K = 0.0;
+  d3K = 0.0;
+  for (unsigned int i = 0; i < numScores; ++i) {
+    for (; exponent < scores[i]; ++exponent) power *= q;
+    double r = (tau >= 0.0) ? 1.0 / (1.0 + power) : power / (1.0 + power);
+    double l = scores[i];
+    dK += l * r;
+    d2K += l * l * r * (1.0 - r);
+    d3K += l * l * l * r * (1.0 - r) * (1.0 - 2.0 * r);
+    prod *= 1.0 + power;
+    sumScores += l;
+  }
+  return ((tau > 0.0) ? tau * sumScores : 0.0) + log(prod);
+}
+
+// the weights exp(k*l(S)) have the cumulant generating function 
+// K(k + t) - K(k), with K from logisticCumulants. The saddle point t with 
+// K'(k + t) = s is found by Newton's method, safeguarded by bisection, 
+// starting from the saddle point of the previous score.
+double PvalueCalculator::saddlepointLogCdf(const unsigned int* scores, 
+    unsigned int numScores, double k, double logTotalWeight, double s, 
+    double& t) {
+  double lo = -std::numeric_limits<double>::infinity();
+  double hi = std::numeric_limits<double>::infinity();
+  double step = 1.0 / scores[numScores - 1];
+  double K, dK, d2K, d3K;
+  for (unsigned int iter = 0; ; ++iter) {
+    K = logisticCumulants(scores, numScores, k + t, dK, d2K, d3K);
+    dK -= s;
+    if (std::abs(dK) < 1e-9 * s || iter == 100u) break;
+    if (dK > 0.0) hi = t;
+    else lo = t;
+    
+    double tNext = t - dK / d2K;
+    if (!(tNext > lo && tNext < hi)) {
+      if (lo > -std::numeric_limits<double>::infinity() && 
+          hi < std::numeric_limits<double>::infinity()) {
+        tNext = 0.5 * (lo + hi);
+      } else {
+        tNext = (dK > 0.0) ? t - step : t + step;
+        step *= 2.0;
+      }
+    }
+    t = tNext;
+  }
+  K -= logTotalWeight;
+  
+  double w = std::sqrt((std::max)(0.0, 2.0 * (t * s - K)));
+  if (t < 0.0) w = -w;
+  double u = 2.0 * sinh(0.5 * t) * std::sqrt(d2K);
+  // close to the mean, log(u/w)/w suffers from cancellation and is replaced
+  // by its limit, minus a sixth of the skewness
+  if (std::abs(w) < 1e-2 || u / w <= 0.0) {
+    return logTotalWeight + logNormalCdf(w - d3K / (6.0 * d2K * std::sqrt(d2K)));
+  }
+  // Barndorff-Nielsen's form of the Lugannani-Rice formula, which avoids the 
+  // cancellation of its two terms in the far tail
+  return logTotalWeight + logNormalCdf(w + log(u / w) / w);
+}
+
+double PvalueCalculator::logNormalCdf(double x) {
+  if (x > -20.0) {
+    return log(0.5 * erfc(-x / std::sqrt(2.0)));
   } else {
-    return (std::min)(1.0,sumProb_[sumThresh]);
-  }
-}
-
-// Based on: http://vilipetek.com/2013/10/07/polynomial-fitting-in-c-using-boost/ (25-07-2014)
-void PvalueCalculator::computePvalVectorPolyfit() {
-  using namespace boost::numeric::ublas;
-  
-  computePvalVector();
-  
-	unsigned int maxScore = sumProb_.size();
-	matrix<double> oXMatrix( maxScore, kPolyfitDegree + 1 );
-	matrix<double> oYMatrix( maxScore, 1 );
-	
-	// copy score vector
-	for ( size_t i = 0; i < maxScore; i++) {
-		oYMatrix(i, 0) = log10(sumProb_[i]);
-		//std::cerr << sumProb_[i] << " " << log10(sumProb_[i]) << std::endl;
-	}
-	sumProb_.clear();
-
-	// create the X (Vandermonde) matrix
-	for ( size_t score = 0; score < maxScore; ++score) {
-		double value = 1.0;
-		double relScore = static_cast<double>(score)/maxScore;
-		for ( int col = 0; col < kPolyfitDegree + 1; ++col) {
-			oXMatrix(score, col) = value;
-			value *= relScore;
-		}
-	}
-
-	// transpose X matrix
-	matrix<double> oXtMatrix( trans(oXMatrix) );
-	// multiply transposed X matrix with X matrix
-	matrix<double> oXtXMatrix( prec_prod(oXtMatrix, oXMatrix) );
-	// multiply transposed X matrix with Y matrix
-	matrix<double> oXtYMatrix( prec_prod(oXtMatrix, oYMatrix) );
-
-	// lu decomposition
-	permutation_matrix<int> pert(oXtXMatrix.size1());
-	const std::size_t singular = lu_factorize(oXtXMatrix, pert);
-	// must be singular
-	BOOST_ASSERT( singular == 0 );
-
-	// backsubstitution
-	lu_substitute(oXtXMatrix, pert, oXtYMatrix);
-
-	// copy the result to coeff
-	polyfit_.resize(kPolyfitDegree + 1);
-	std::copy( oXtYMatrix.data().begin(), oXtYMatrix.data().end(), polyfit_.begin() );
-	
-	// TODO: check the residuals?
+    // asymptotic expansion of the Mills ratio
+    double x2 = x * x;
+    return -0.5 * x2 - log(-x) - 0.5 * log(2.0 * M_PI) + 
+           log(1.0 - 1.0 / x2 + 3.0 / (x2 * x2) - 15.0 / (x2 * x2 * x2));
+  }
 }
 
 /**
@@ -269,96 +508,267 @@ smooth_pvalue - True if the pvalues should be smoothed
 
 Output: estimated p value
 */
-double PvalueCalculator::computePvalPolyfit(const std::vector<unsigned int>& queryPeakBins) {
-  std::vector<bool> d(peakBins_.size());
-  binaryMatchPeakBins(queryPeakBins, d);
-                            
+template <class Layout>
+double BasicPvalueCalculator<Layout>::computePvalPolyfit(const short* queryPeakBins, 
+    unsigned int numQueryPeaks) const {
   // express P(D|R = 0) in terms of li (D = obs config)
+  return computePvalPolyfitFromMatchedScore(PvalueKernels::matchedScore(
+      peakBins_, peakScores_, numPeaks_, queryPeakBins, numQueryPeaks));
+}
+
+// the slope of the polynomial on [0,1] is bounded by sum_i i*|c_i|, so 
+// around a score whose p-value is above the threshold, all scores within
+// (p-value - threshold) / slope relative score distance can be skipped. The
+// margin is reduced by twice the bound on the rounding errors of the 
+// relative score and of Horner's method, as both the evaluated and the 
+// skipped p-values are rounded.
+template <class Layout>
+void BasicPvalueCalculator<Layout>::initScoreCutoff(double pvalThreshold) {
+  if (maxScore_ == 0u) {
+    minMatchedScore_ = 1u;
+    initMinMatchedPeaks();
+    return;
+  }
+  
+  double maxSlope = 0.0, sumAbsCoeffs = std::abs(polyfit_[0]);
+  for (unsigned int i = 1; i < kNumPolyfitCoeffs; ++i) {
+    maxSlope += i * std::abs(polyfit_[i]);
+    sumAbsCoeffs += std::abs(polyfit_[i]);
+  }
+  double roundingError = std::numeric_limits<PolyfitValue>::epsilon() * 
+      (2.0 * kNumPolyfitCoeffs * sumAbsCoeffs + maxSlope);
+  
   unsigned int score = 0u;
-  for (unsigned int i = 0; i < d.size(); ++i) {
-    if (!d[i]) {
-      score += peakScores_[i];
-    }/* else {
-      std::cerr << "[" << peakBins_[i] << " " << peakScores_[i] << "], ";
-    }*/
+  while (score <= maxScore_) {
+    double pval = computePvalPolyfitFromMatchedScore(score);
+    if (pval < pvalThreshold) break;
+    double margin = (std::max)(0.0, pval - pvalThreshold - 2.0 * roundingError);
+    if (maxSlope == 0.0) {
+      score = maxScore_ + 1u;
+      break;
+    }
+    
+    // safety factor for the rounding errors in the relative scores
+    double maxSkip = margin / maxSlope * maxScore_ * (1.0 - 1e-9);
+    if (maxSkip >= maxScore_) {
+      score = maxScore_ + 1u;
+    } else {
+      score += static_cast<unsigned int>(maxSkip) + 1u;
+    }
+  }
+  minMatchedScore_ = (std::min)(score, maxScore_ + 1u);
+  initMinMatchedPeaks();
+}
+
+// the matched score of k peaks is at most the sum of the k highest peak 
+// scores
+template <class Layout>
+void BasicPvalueCalculator<Layout>::initMinMatchedPeaks() {
+  short sortedScores[kMaxScoringPeaks];
+  std::copy(peakScores_, peakScores_ + numPeaks_, sortedScores);
+  std::sort(sortedScores, sortedScores + numPeaks_, std::greater<short>());
+  unsigned int score = 0u;
+  minMatchedPeaks_ = 0u;
+  while (minMatchedPeaks_ < numPeaks_ && score < minMatchedScore_) {
+    score += sortedScores[minMatchedPeaks_++];
+  }
+  if (score < minMatchedScore_) minMatchedPeaks_ = numPeaks_ + 1u;
+}
+
+// the table holds the p-values in the precision of PolyfitValue, so that 
+// they are identical to evaluating the polynomial. They are only rounded 
+// when they are stored in a PvalueTriplet.
+template <class Layout>
+void BasicPvalueCalculator<Layout>::initPvalueTable(PolyfitValue* pvalTable) const {
+  unsigned int numScores = getPvalueTableSize();
+  for (unsigned int i = 0; i < numScores; ++i) {
+    pvalTable[i] = static_cast<PolyfitValue>(
+        computePvalPolyfitFromMatchedScore(minMatchedScore_ + i));
   }
+}
+
+template <class Layout>
+double BasicPvalueCalculator<Layout>::computePvalPolyfitWithCutoff(
+    const short* queryPeakBins, unsigned int numQueryPeaks, 
+    const PolyfitValue* pvalTable) const {
+  if (minMatchedScore_ > maxScore_) return 0.0;
   
-  double relScore = static_cast<double>(score)/maxScore_;
+  unsigned int matchedScore = PvalueKernels::matchedScore(peakBins_, 
+      peakScores_, numPeaks_, queryPeakBins, numQueryPeaks, 
+      maxScore_ - minMatchedScore_);
+  if (matchedScore < minMatchedScore_) return 0.0;
+  return computePvalFromMatchedScore(matchedScore, pvalTable);
+}
+
+template <class Layout>
+double BasicPvalueCalculator<Layout>::computePvalPolyfitWithCutoff(
+    const PeakScoreLookup& queryLookup, const PolyfitValue* pvalTable) const {
+  if (minMatchedScore_ > maxScore_) return 0.0;
   
-  //std::cerr << score << "/" << maxScore_ << " " << polyval(relScore) << std::endl;
+  unsigned int matchedScore = queryLookup.matchedScoreOf(peakBins_, 
+      peakScores_, numPeaks_, maxScore_ - minMatchedScore_);
+  if (matchedScore < minMatchedScore_) return 0.0;
+  return computePvalFromMatchedScore(matchedScore, pvalTable);
+}
+
+template <class Layout>
+double BasicPvalueCalculator<Layout>::computePvalPolyfitWithCutoff(
+    const PeakScoreLookup& lookup, const short* queryPeakBins, 
+    unsigned int numQueryPeaks, const PolyfitValue* pvalTable) const {
+  if (minMatchedScore_ > maxScore_) return 0.0;
   
-  return polyval(relScore);
+  unsigned int matchedScore = lookup.scoreOf(queryPeakBins, numQueryPeaks);
+  if (matchedScore < minMatchedScore_) return 0.0;
+  return computePvalFromMatchedScore(matchedScore, pvalTable);
 }
 
-double PvalueCalculator::polyval(double x) {
-  if (polyfit_.size() > 0) {
-    // Horner's method
-    double y = polyfit_.back();
-    for (int i = polyfit_.size() - 2; i >= 0; --i) {
-      y = polyfit_[i] + y*x;
+// if the scoring peaks are the complete peak lists, as for all p-value 
+// vectors that were read back from file, both directions come from a single
+// pass over the two lists. Otherwise the directions are matched separately.
+template <class Layout>
+bool BasicPvalueCalculator<Layout>::computePvalPolyfitPair(
+    const BasicPvalueCalculator& targetCalc, const short* targetPeakBins, 
+    unsigned int numTargetPeaks, 
+    const BasicPvalueCalculator& queryCalc, const short* queryPeakBins, 
+    unsigned int numQueryPeaks, double& targetPval, double& queryPval,
+    const PolyfitValue* targetPvalTable, const PolyfitValue* queryPvalTable) {
+  const BasicPvalueCalculator& t = targetCalc;
+  const BasicPvalueCalculator& q = queryCalc;
+  if (t.minMatchedScore_ > t.maxScore_ || q.minMatchedScore_ > q.maxScore_) {
+    return false;
+  }
+  unsigned int maxUnmatchedTarget = t.maxScore_ - t.minMatchedScore_;
+  unsigned int maxUnmatchedQuery = q.maxScore_ - q.minMatchedScore_;
+  
+  unsigned int targetScore = 0u, queryScore = 0u;
+  if (numTargetPeaks == t.numPeaks_ && numQueryPeaks == q.numPeaks_) {
+    if (!PvalueKernels::matchedScorePair(t.peakBins_, t.peakScores_, 
+            t.numPeaks_, q.peakBins_, q.peakScores_, q.numPeaks_, 
+            maxUnmatchedTarget, maxUnmatchedQuery, targetScore, queryScore)) {
+      return false;
     }
-    return (std::min)(0.0,y);
   } else {
-    return 0.0;
+    queryScore = PvalueKernels::matchedScore(q.peakBins_, q.peakScores_, 
+        q.numPeaks_, targetPeakBins, numTargetPeaks, maxUnmatchedQuery);
+    if (queryScore < q.minMatchedScore_) return false;
+    targetScore = PvalueKernels::matchedScore(t.peakBins_, t.peakScores_, 
+        t.numPeaks_, queryPeakBins, numQueryPeaks, maxUnmatchedTarget);
+  }
+  if (targetScore < t.minMatchedScore_ || queryScore < q.minMatchedScore_) {
+    return false;
   }
+  
+  targetPval = t.computePvalFromMatchedScore(targetScore, targetPvalTable);
+  queryPval = q.computePvalFromMatchedScore(queryScore, queryPvalTable);
+  return true;
 }
 
-void PvalueCalculator::copyPolyfit(short* peakBins, short* peakScores, double* polyfit) {
-  peakBins_.resize(kMaxScoringPeaks, 0u);
-  peakScores_.resize(kMaxScoringPeaks, 0u);
-  std::copy(peakBins_.begin(), peakBins_.begin() + kMaxScoringPeaks, peakBins);
-  std::copy(peakScores_.begin(), peakScores_.begin() + kMaxScoringPeaks, peakScores);
-  std::copy(polyfit_.begin(), polyfit_.begin() + kPolyfitDegree + 1, polyfit);
+template <class Layout>
+void BasicPvalueCalculator<Layout>::initPeakScoreLookup(const short* queryPeakBins, 
+    unsigned int numQueryPeaks, PeakScoreLookup& lookup) const {
+  lookup.table.clear();
+  if (numQueryPeaks == 0 && numPeaks_ == 0) return;
+  
+  short minBin = (numQueryPeaks > 0) ? queryPeakBins[0] : peakBins_[0];
+  short maxBin = (numQueryPeaks > 0) ? queryPeakBins[numQueryPeaks - 1] : peakBins_[numPeaks_ - 1];
+  if (numPeaks_ > 0) {
+    minBin = (std::min)(minBin, peakBins_[0]);
+    maxBin = (std::max)(maxBin, peakBins_[numPeaks_ - 1]);
+  }
+  
+  lookup.minBin = minBin;
+  lookup.table.resize(maxBin - minBin + 1, -1);
+  for (unsigned int i = 0; i < numQueryPeaks; ++i) {
+    lookup.table[queryPeakBins[i] - minBin] = 0;
+  }
+  for (unsigned int i = 0; i < numPeaks_; ++i) {
+    lookup.table[peakBins_[i] - minBin] = peakScores_[i];
+  }
+}
+
+template <class Layout>
+double BasicPvalueCalculator<Layout>::computePvalPolyfit(
+    const PeakScoreLookup& queryLookup) const {
+  return computePvalPolyfitFromMatchedScore(
+      queryLookup.matchedScoreOf(peakBins_, peakScores_, numPeaks_));
+}
+
+template <class Layout>
+double BasicPvalueCalculator<Layout>::computePvalPolyfit(const PeakScoreLookup& lookup, 
+    const short* queryPeakBins, unsigned int numQueryPeaks) const {
+  return computePvalPolyfitFromMatchedScore(
+      lookup.scoreOf(queryPeakBins, numQueryPeaks));
+}
+
+// fills the fixed size arrays of BatchPvalueVector, unused peaks are 
+// marked by a zero bin
+template <class Layout>
+void BasicPvalueCalculator<Layout>::copyPolyfit(short* peakBins, short* peakScores, 
+                                   PolyfitValue* polyfit) const {
+  std::copy(peakBins_, peakBins_ + numPeaks_, peakBins);
+  std::copy(peakScores_, peakScores_ + numPeaks_, peakScores);
+  std::fill(peakBins + numPeaks_, peakBins + kMaxScoringPeaks, 0);
+  std::fill(peakScores + numPeaks_, peakScores + kMaxScoringPeaks, 0);
+  std::copy(polyfit_, polyfit_ + kNumPolyfitCoeffs, polyfit);
 }
 
-void PvalueCalculator::serialize(std::string& polyfitString, std::string& peakScorePairsString) {
-  if (polyfit_.size() == 0 || peakBins_.size() == 0 || peakScores_.size() == 0) {
-    std::cerr << "Warning: empty vectors in pvalue calculation serialization. " 
-              << polyfit_.size() << " " << peakBins_.size() << " " << peakScores_.size() << std::endl;
+template <class Layout>
+void BasicPvalueCalculator<Layout>::serialize(std::string& polyfitString, 
+                                 std::string& peakScorePairsString) const {
+  if (numPeaks_ == 0) {
+    std::cerr << "Warning: empty vectors in pvalue calculation serialization." << std::endl;
   }
   polyfitString = "";
-  BOOST_FOREACH (double coeff, polyfit_) {
-    polyfitString += boost::lexical_cast<std::string>(coeff) + " ";
+  for (unsigned int j = 0; j < kNumPolyfitCoeffs; ++j) {
+    polyfitString += boost::lexical_cast<std::string>(polyfit_[j]) + " ";
   }
   polyfitString.substr(0, polyfitString.size() - 1); // remove last space
   
   peakScorePairsString = "";
-  if (peakScores_.size() != peakBins_.size()) 
-    std::cerr << "Error: peak location and peak score vectors are not of same length" << std::endl;
-  
-  for (unsigned int j = 0; j < peakScores_.size(); ++j) {
+  for (unsigned int j = 0; j < numPeaks_; ++j) {
     peakScorePairsString += boost::lexical_cast<std::string>(peakBins_[j]) + " " 
                           + boost::lexical_cast<std::string>(peakScores_[j]) + " ";
   }
   peakScorePairsString.substr(0, peakScorePairsString.size() - 1); // remove last space
 }
 
-void PvalueCalculator::deserialize(std::string& polyfitString, std::string& peakScorePairsString) {
-  polyfit_.clear();
+template <class Layout>
+void BasicPvalueCalculator<Layout>::deserialize(std::string& polyfitString, std::string& peakScorePairsString) {
+  std::fill(polyfit_, polyfit_ + kNumPolyfitCoeffs, PolyfitValue(0));
   std::istringstream iss(polyfitString);
   double coeff;
-  while (iss >> coeff) {
-    polyfit_.push_back(coeff);
+  unsigned int numCoeffs = 0u;
+  while (numCoeffs < kNumPolyfitCoeffs && iss >> coeff) {
+    polyfit_[numCoeffs++] = coeff;
   }
   
-  peakBins_.clear();
-  peakScores_.clear();
+  numPeaks_ = 0u;
   maxScore_ = 0u;
+  minMatchedScore_ = 0u;
+  minMatchedPeaks_ = 0u;
   
   std::istringstream iss2(peakScorePairsString);
   unsigned int peakBin, score;
-  while (iss2 >> peakBin >> score) {
-    peakBins_.push_back(peakBin);
-    peakScores_.push_back(score);
+  while (numPeaks_ < kMaxScoringPeaks && iss2 >> peakBin >> score) {
+    peakBins_[numPeaks_] = peakBin;
+    peakScores_[numPeaks_] = score;
     maxScore_ += score;
+    ++numPeaks_;
   }
   
-  if (polyfit_.size() == 0 || peakBins_.size() == 0 || peakScores_.size() == 0) {
+  if (numCoeffs == 0 || numPeaks_ == 0) {
     std::cerr << "Warning: empty vectors in pvalue calculation deserialization. " 
-              << polyfit_.size() << " " << peakBins_.size() << " " << peakScores_.size() << std::endl;
+              << numCoeffs << " " << numPeaks_ << std::endl;
   }
 }
 
+template class BasicPvalueCalculator<PvalueVectorLayout<double, 20u> >;
+template class BasicPvalueCalculator<PvalueVectorLayout<double, 30u> >;
+template class BasicPvalueCalculator<DoublePrecisionLayout>;
+template class BasicPvalueCalculator<PvalueVectorLayout<float, 20u> >;
+template class BasicPvalueCalculator<PvalueVectorLayout<float, 30u> >;
+template class BasicPvalueCalculator<SinglePrecisionLayout>;
+
 // Park–Miller random number generator
 // from wikipedia
 unsigned long PvalueCalculator::lcg_rand() {
@@ -371,12 +781,33 @@ double PvalueCalculator::lcg_rand_unif() {
   return (double)(lcg_rand() % 100000) / 100000;
 }
 
+// fills peakBins with numPeaks unique peak bins drawn uniformly from 
+// 1, ..., numBins, sorted as the peak bins of a spectrum
+void PvalueCalculator::drawUniquePeakBins(unsigned int numPeaks, 
+    unsigned int numBins, std::vector<short>& peakBins) {
+  std::vector<bool> hasPeak(numBins + 1, false);
+  peakBins.clear();
+  while (peakBins.size() < numPeaks) {
+    unsigned int bin = 1 + lcg_rand() % numBins;
+    if (!hasPeak[bin]) {
+      hasPeak[bin] = true;
+      peakBins.push_back(bin);
+    }
+  }
+  std::sort(peakBins.begin(), peakBins.end());
+}
+
+
+// the unit tests run in the default layout, polyvalPrecisionUnitTest compares
+// it to the single precision one
+typedef BasicPvalueCalculator<DoublePrecisionLayout> TestPvalueCalculator;
 
 bool PvalueCalculator::pvalUnitTest() {
-  PvalueCalculator pvalCalc;
+  TestPvalueCalculator pvalCalc;
+  Scratch scratch;
   
   std::vector<double> p;
-  std::vector<unsigned int> d1, d2;
+  std::vector<short> d1, d2;
   
   p.push_back(0.2);
   p.push_back(0.3);
@@ -393,12 +824,12 @@ bool PvalueCalculator::pvalUnitTest() {
   d2.push_back(8);
   d2.push_back(9);
   
-  pvalCalc.peakProbs_ = p;
-  pvalCalc.peakBins_ = d1;
+  scratch.peakProbs = p;
+  pvalCalc.init(&d1[0], d1.size());
   
-  pvalCalc.computePvalVector();
+  pvalCalc.computePvalVector(scratch);
   
-  double pval = pvalCalc.computePval(d2);
+  double pval = pvalCalc.computePval(&d2[0], d2.size(), scratch);
   
   if (isEqual(pval, 0.135674)) {
     return true;
@@ -411,14 +842,15 @@ bool PvalueCalculator::pvalUnitTest() {
 
 bool PvalueCalculator::pvalUniformUnitTest() {
   setSeed(100);
-  PvalueCalculator pvalCalc;
+  TestPvalueCalculator pvalCalc;
+  Scratch scratch;
   
-  unsigned int numSpectra = 200000u, numBins = 1000u, numPeaks = 100u;
+  unsigned int numSpectra = 200000u, numBins = 400u, numPeaks = kMaxScoringPeaks;
   double prob = 1-pow(1-1.0/numBins,numPeaks);
 
   std::vector<double> p(numPeaks, prob);
 
-  std::vector<unsigned int> d1, d2;
+  std::vector<short> d1, d2;
   
   std::map<unsigned int, bool> hasPeak;
   for (unsigned int i = 0; i < numPeaks; ++i) {
@@ -434,10 +866,10 @@ bool PvalueCalculator::pvalUniformUnitTest() {
   }
   std::sort(d1.begin(), d1.end());
   
-  pvalCalc.peakProbs_ = p;
-  pvalCalc.peakBins_ = d1;
+  scratch.peakProbs = p;
+  pvalCalc.init(&d1[0], d1.size());
   
-  pvalCalc.computePvalVector();
+  pvalCalc.computePvalVector(scratch);
   
   for (unsigned int j = 0; j < numSpectra; ++j) {
     d2.clear();
@@ -456,7 +888,8 @@ bool PvalueCalculator::pvalUniformUnitTest() {
     }
     std::cout << hits << '\t';
     std::sort(d2.begin(), d2.end());
-    std::cout << pvalCalc.computePval(d2, true) << std::endl;
+    std::cout << pvalCalc.computePval(d2.empty() ? NULL : &d2[0], d2.size(), 
+                                      scratch, true) << std::endl;
   }
   
   return true;
@@ -464,124 +897,481 @@ bool PvalueCalculator::pvalUniformUnitTest() {
 
 bool PvalueCalculator::binaryPeakMatchUnitTest() {
   setSeed(100);
-  PvalueCalculator pvalCalc;
   
   unsigned int numBins = 1000u, numPeaks = 100u;
-  double prob = 1-pow(1-1.0/numBins,numPeaks);
 
-  std::vector<double> p(numPeaks, prob);
+  std::vector<short> d1, d2;
+  drawUniquePeakBins(numPeaks, numBins, d1);
+  drawUniquePeakBins(numPeaks, numBins, d2);
+  
+  std::vector<short> intersection;
+  std::set_intersection(d1.begin(), d1.end(), d2.begin(), d2.end(), 
+                        std::back_inserter(intersection));
+  
+  // with unit scores the matched score is the number of matched peaks
+  std::vector<short> unitScores(numPeaks, 1);
+  unsigned int acc = PvalueKernels::matchedScore(&d1[0], &unitScores[0], 
+      d1.size(), &d2[0], d2.size());
+  
+  if (acc == intersection.size()) {
+    return true;
+  } else {
+    std::cout << "Matched peaks was " << acc << ", should be " 
+              << intersection.size() << "." << std::endl;
+    return false;
+  }
+}
 
-  std::vector<unsigned int> d1, d2;
+// scores random spectra against each other with the separate merges, the 
+// peak score lookup and the fused merge of both directions, which have to 
+// give the same p-values
+bool PvalueCalculator::peakScoreLookupUnitTest() {
+  setSeed(5);
   
-  std::map<unsigned int, bool> hasPeak;
-  for (unsigned int i = 0; i < numPeaks; ++i) {
-    bool peakAdded = false;
-    while (!peakAdded) {  
-      //unsigned int bin = rand() % numBins; // causes biases at 0 (higher density) and 1 (lower density)
-      unsigned int bin = lcg_rand() % numBins;
-      if (!hasPeak[bin]) {
-        d1.push_back(bin);
-        peakAdded = true;
-      }
+  unsigned int numBins = 300u, numSpectra = 20u;
+  std::vector<TestPvalueCalculator> pvalCalcs(numSpectra);
+  std::vector<std::vector<short> > queryPeakBins(numSpectra);
+  for (unsigned int k = 0; k < numSpectra; ++k) {
+    TestPvalueCalculator& pvalCalc = pvalCalcs[k];
+    drawUniquePeakBins(10 + k, numBins, queryPeakBins[k]);
+    
+    // every other query peak is a scoring peak
+    for (unsigned int i = 0; i < queryPeakBins[k].size(); i += 2) {
+      pvalCalc.peakBins_[pvalCalc.numPeaks_] = queryPeakBins[k][i];
+      pvalCalc.peakScores_[pvalCalc.numPeaks_] = 1 + lcg_rand() % 100;
+      pvalCalc.maxScore_ += pvalCalc.peakScores_[pvalCalc.numPeaks_];
+      ++pvalCalc.numPeaks_;
     }
+    pvalCalc.polyfit_[0] = -10.0 - k;
+    pvalCalc.polyfit_[1] = 10.0;
   }
-  std::sort(d1.begin(), d1.end());
   
-  for (unsigned int i = 0; i < numPeaks; ++i) {
-    bool peakAdded = false;
-    while (!peakAdded) {  
-      //unsigned int bin = rand() % numBins; // causes biases at 0 (higher density) and 1 (lower density)
-      unsigned int bin = lcg_rand() % numBins;
-      if (!hasPeak[bin]) {
-        d2.push_back(bin);
-        peakAdded = true;
+  PeakScoreLookup lookup;
+  for (unsigned int k = 0; k < numSpectra; ++k) {
+    pvalCalcs[k].initPeakScoreLookup(&queryPeakBins[k][0], 
+                                     queryPeakBins[k].size(), lookup);
+    for (unsigned int l = 0; l < numSpectra; ++l) {
+      double targetPval = pvalCalcs[k].computePvalPolyfit(
+          &queryPeakBins[l][0], queryPeakBins[l].size());
+      double targetPvalLookup = pvalCalcs[k].computePvalPolyfit(lookup, 
+          &queryPeakBins[l][0], queryPeakBins[l].size());
+      double queryPval = pvalCalcs[l].computePvalPolyfit(
+          &queryPeakBins[k][0], queryPeakBins[k].size());
+      double queryPvalLookup = pvalCalcs[l].computePvalPolyfit(lookup);
+      if (targetPval != targetPvalLookup || queryPval != queryPvalLookup) {
+        std::cout << "Peak score lookup gave " << targetPvalLookup << " and " 
+                  << queryPvalLookup << " instead of " << targetPval << " and "
+                  << queryPval << std::endl;
+        return false;
+      }
+      
+      double targetPvalPair = 0.0, queryPvalPair = 0.0;
+      if (!TestPvalueCalculator::computePvalPolyfitPair(pvalCalcs[k], &queryPeakBins[k][0], 
+              queryPeakBins[k].size(), pvalCalcs[l], &queryPeakBins[l][0], 
+              queryPeakBins[l].size(), targetPvalPair, queryPvalPair) ||
+          targetPval != targetPvalPair || queryPval != queryPvalPair) {
+        std::cout << "Fused peak matching gave " << targetPvalPair << " and " 
+                  << queryPvalPair << " instead of " << targetPval << " and "
+                  << queryPval << std::endl;
+        return false;
       }
     }
   }
-  std::sort(d2.begin(), d2.end());
   
-  pvalCalc.peakProbs_ = p;
-  pvalCalc.peakBins_ = d1;
-  
-  /*
-  for (unsigned int j = 0; j < 1e7; ++j) {
-    std::vector<bool> b(d1.size());
-    pvalCalc.binaryMatchPeakBins2(d2, b);
+  // with score cutoffs, the p-value tables have to give the p-values of the
+  // polynomials in both directions for all pairs below the threshold, and no
+  // other pair may pass
+  double pvalThreshold = -15.0;
+  typedef TestPvalueCalculator::PolyfitValue PolyfitValue;
+  std::vector<std::vector<PolyfitValue> > pvalTables(numSpectra);
+  std::vector<const PolyfitValue*> pvalTablePtrs(numSpectra, NULL);
+  for (unsigned int k = 0; k < numSpectra; ++k) {
+    pvalCalcs[k].initScoreCutoff(pvalThreshold);
+    pvalTables[k].resize(pvalCalcs[k].getPvalueTableSize());
+    if (!pvalTables[k].empty()) {
+      pvalCalcs[k].initPvalueTable(&pvalTables[k][0]);
+      pvalTablePtrs[k] = &pvalTables[k][0];
+    }
   }
-  */
-  
-  unsigned int acc = 0;
-  
-  std::vector<bool> b(d1.size());
-  pvalCalc.binaryMatchPeakBins(d2, b);
+  unsigned int numPassed = 0u;
+  for (unsigned int k = 0; k < numSpectra; ++k) {
+    pvalCalcs[k].initPeakScoreLookup(&queryPeakBins[k][0], 
+                                     queryPeakBins[k].size(), lookup);
+    for (unsigned int l = 0; l < numSpectra; ++l) {
+      double targetPval = pvalCalcs[k].computePvalPolyfit(
+          &queryPeakBins[l][0], queryPeakBins[l].size());
+      double queryPval = pvalCalcs[l].computePvalPolyfit(
+          &queryPeakBins[k][0], queryPeakBins[k].size());
+      bool isPass = (targetPval < pvalThreshold && queryPval < pvalThreshold);
+      if (isPass) ++numPassed;
+      
+      double targetPvalTable = pvalCalcs[k].computePvalPolyfitWithCutoff(
+          &queryPeakBins[l][0], queryPeakBins[l].size(), pvalTablePtrs[k]);
+      double targetPvalLookup = pvalCalcs[k].computePvalPolyfitWithCutoff(
+          lookup, &queryPeakBins[l][0], queryPeakBins[l].size(), 
+          pvalTablePtrs[k]);
+      double queryPvalLookup = pvalCalcs[l].computePvalPolyfitWithCutoff(
+          lookup, pvalTablePtrs[l]);
+      double targetPvalPair = 0.0, queryPvalPair = 0.0;
+      bool isPair = TestPvalueCalculator::computePvalPolyfitPair(pvalCalcs[k], &queryPeakBins[k][0], 
+          queryPeakBins[k].size(), pvalCalcs[l], &queryPeakBins[l][0], 
+          queryPeakBins[l].size(), targetPvalPair, queryPvalPair, 
+          pvalTablePtrs[k], pvalTablePtrs[l]);
+      
+      bool isExpected;
+      if (isPass) {
+        isExpected = targetPvalTable == targetPval && 
+            targetPvalLookup == targetPval && 
+            queryPvalLookup == queryPval && isPair && 
+            targetPvalPair == targetPval && queryPvalPair == queryPval;
+      } else {
+        isExpected = !(targetPvalTable < pvalThreshold && 
+                       queryPvalLookup < pvalThreshold) &&
+            !(targetPvalLookup < pvalThreshold && 
+              queryPvalLookup < pvalThreshold) &&
+            !(isPair && targetPvalPair < pvalThreshold && 
+              queryPvalPair < pvalThreshold);
+      }
+      if (!isExpected) {
+        std::cout << "P-value tables gave " << targetPvalLookup << " and " 
+                  << queryPvalLookup << " instead of " << targetPval << " and "
+                  << queryPval << std::endl;
+        return false;
+      }
+    }
+  }
+  if (numPassed == 0u) {
+    std::cout << "No pair passed the p-value table test" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// compares the score cutoff to a scan over all scores for random, also 
+// non-monotone, polynomials and checks that the p-values below the 
+// threshold are unchanged by the early abandoning
+bool PvalueCalculator::scoreCutoffUnitTest() {
+  setSeed(3);
+  double pvalThreshold = -5.0;
+  unsigned int numBins = 300u;
+  for (unsigned int k = 0; k < 200; ++k) {
+    TestPvalueCalculator pvalCalc;
+    std::vector<short> peakBins;
+    drawUniquePeakBins(kMinScoringPeaks + k % 25, numBins, peakBins);
+    for (unsigned int i = 0; i < peakBins.size(); ++i) {
+      pvalCalc.peakBins_[i] = peakBins[i];
+      pvalCalc.peakScores_[i] = 1 + lcg_rand() % 100;
+      pvalCalc.maxScore_ += pvalCalc.peakScores_[i];
+    }
+    pvalCalc.numPeaks_ = peakBins.size();
+    for (unsigned int i = 0; i < kNumPolyfitCoeffs; ++i) {
+      pvalCalc.polyfit_[i] = (lcg_rand_unif() - 0.5) * 40.0;
+    }
+    if (k % 4 == 0) pvalCalc.polyfit_[0] = -5.0;
+    
+    unsigned int minMatchedScore = 0u;
+    while (minMatchedScore <= pvalCalc.maxScore_ && 
+           !(pvalCalc.computePvalPolyfitFromMatchedScore(minMatchedScore) < pvalThreshold)) {
+      ++minMatchedScore;
+    }
+    pvalCalc.initScoreCutoff(pvalThreshold);
+    if (pvalCalc.minMatchedScore_ != minMatchedScore) {
+      std::cout << "Score cutoff was " << pvalCalc.minMatchedScore_ 
+                << ", should be " << minMatchedScore << "." << std::endl;
+      return false;
+    }
+    
+    for (unsigned int l = 0; l < 20; ++l) {
+      std::vector<short> queryPeakBins;
+      for (unsigned int bin = 1; bin <= numBins; ++bin) {
+        bool hasPeak = std::binary_search(peakBins.begin(), peakBins.end(), 
+                                          static_cast<short>(bin));
+        if ((hasPeak && lcg_rand() % 4 != 0) || lcg_rand() % 10 == 0) {
+          queryPeakBins.push_back(bin);
+        }
+      }
+      double pval = pvalCalc.computePvalPolyfit(&queryPeakBins[0], 
+                                                queryPeakBins.size());
+      double pvalCutoff = pvalCalc.computePvalPolyfitWithCutoff(
+          &queryPeakBins[0], queryPeakBins.size());
+      bool isExpected = (pval < pvalThreshold) ? 
+          (pvalCutoff == pval) : !(pvalCutoff < pvalThreshold);
+      if (!isExpected) {
+        std::cout << "P-value with score cutoff was " << pvalCutoff 
+                  << " instead of " << pval << "." << std::endl;
+        return false;
+      }
+      
+      // the query side without a cutoff only passes the target direction
+      TestPvalueCalculator queryCalc;
+      double pvalPair = 0.0, queryPvalPair = 0.0;
+      bool isPair = TestPvalueCalculator::computePvalPolyfitPair(pvalCalc, &peakBins[0], 
+          peakBins.size(), queryCalc, &queryPeakBins[0], queryPeakBins.size(),
+          pvalPair, queryPvalPair);
+      isExpected = (pval < pvalThreshold) ? 
+          (isPair && pvalPair == pval) : (!isPair || pvalPair == pval);
+      if (!isExpected) {
+        std::cout << "Fused p-value with score cutoff was " << pvalPair 
+                  << " instead of " << pval << "." << std::endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// compares the single precision evaluation of the polynomial fits against 
+// the double precision one for all matched scores of fitted random spectra
+bool PvalueCalculator::polyvalPrecisionUnitTest() {
+  setSeed(5);
+  double pvalThreshold = -5.0, tolerance = 1e-3, maxAbsDiff = 0.0;
+  unsigned int numBins = 1000u, numEdgesDouble = 0u, numEdgesSingle = 0u;
+  for (unsigned int k = 0; k < 100; ++k) {
+    std::vector<double> peakDist(numBins);
+    for (unsigned int bin = 0; bin < numBins; ++bin) {
+      peakDist[bin] = 0.001 + 0.05 * lcg_rand_unif();
+    }
+    std::vector<short> peakBins;
+    drawUniquePeakBins(kMinScoringPeaks + k % 30, numBins - 1, peakBins);
     
-  BOOST_FOREACH(bool a, b) {
-    if (a) ++acc;
+    BasicPvalueCalculator<DoublePrecisionLayout> doubleCalc;
+    Scratch scratch;
+    doubleCalc.initFromPeakBins(&peakBins[0], peakBins.size(), &peakDist[0], 
+                                numBins, scratch);
+    doubleCalc.computePvalVectorPolyfit(scratch);
+    
+    short fitPeakBins[kMaxScoringPeaks], fitPeakScores[kMaxScoringPeaks];
+    double polyfitDouble[kNumPolyfitCoeffs];
+    float polyfitSingle[kNumPolyfitCoeffs];
+    doubleCalc.copyPolyfit(fitPeakBins, fitPeakScores, polyfitDouble);
+    for (unsigned int i = 0; i < kNumPolyfitCoeffs; ++i) {
+      polyfitSingle[i] = static_cast<float>(polyfitDouble[i]);
+    }
+    BasicPvalueCalculator<SinglePrecisionLayout> singleCalc;
+    singleCalc.initPolyfit(fitPeakBins, fitPeakScores, polyfitSingle);
+    
+    for (unsigned int score = 0; score <= doubleCalc.maxScore_; ++score) {
+      double pvalDouble = doubleCalc.computePvalPolyfitFromMatchedScore(score);
+      double pvalSingle = singleCalc.computePvalPolyfitFromMatchedScore(score);
+      maxAbsDiff = std::max(maxAbsDiff, std::abs(pvalDouble - pvalSingle));
+      
+      bool isEdgeDouble = pvalDouble < pvalThreshold;
+      bool isEdgeSingle = pvalSingle < pvalThreshold;
+      if (isEdgeDouble) ++numEdgesDouble;
+      if (isEdgeSingle) ++numEdgesSingle;
+      // edges may only flip for p-values right at the threshold
+      if (isEdgeDouble != isEdgeSingle && 
+          std::abs(pvalDouble - pvalThreshold) > tolerance) {
+        std::cout << "Single precision p-value " << pvalSingle 
+                  << " flipped the edge of p-value " << pvalDouble 
+                  << "." << std::endl;
+        return false;
+      }
+    }
   }
   
-  if (acc == 12) {
-    return true;
-  } else {
-    std::cout << "Matched peaks was " << acc << ", should be 12." << std::endl;
+  if (maxAbsDiff > tolerance) {
+    std::cout << "Single precision p-values differed by up to " << maxAbsDiff 
+              << " (" << numEdgesSingle << " instead of " << numEdgesDouble 
+              << " edges)." << std::endl;
     return false;
   }
+  return true;
 }
 
+// the p-value of the fitted polynomial at the relative unmatched score, 
+// the reference is computed from the intersection of the peak bins
 bool PvalueCalculator::pvalPolyfitUnitTest() {
   setSeed(10);
-  PvalueCalculator pvalCalc;
+  TestPvalueCalculator pvalCalc;
   
-  unsigned int numBins = 1000u, numPeaks = 100u;
-  double prob = 1-pow(1-1.0/numBins,numPeaks);
-
-  std::vector<double> p(numPeaks, prob);
+  // the calculator holds at most kMaxScoringPeaks scoring peaks
+  unsigned int numBins = 1000u, numPeaks = kMaxScoringPeaks, numQueryPeaks = 100u;
+  double polyfit[kNumPolyfitCoeffs] = { -40.236851088905013, 90.270774017803348,
+      -117.64110105643428, 154.88646213751957, -118.82877111418108, 
+      31.617289887393586 };
 
-  std::vector<unsigned int> d1, d2;
-  
-  std::map<unsigned int, bool> hasPeak;
+  std::vector<short> d1, d2;
+  drawUniquePeakBins(numPeaks, numBins, d1);
+  drawUniquePeakBins(numQueryPeaks, numBins, d2);
   for (unsigned int i = 0; i < numPeaks; ++i) {
-    bool peakAdded = false;
-    while (!peakAdded) {  
-      //unsigned int bin = rand() % numBins; // causes biases at 0 (higher density) and 1 (lower density)
-      unsigned int bin = lcg_rand() % numBins;
-      if (!hasPeak[bin]) {
-        d1.push_back(bin);
-        pvalCalc.maxScore_ += 100;
-        pvalCalc.peakScores_.push_back(100);
-        peakAdded = true;
-      }
-    }
+    pvalCalc.peakScores_[i] = 100;
+    pvalCalc.maxScore_ += 100;
   }
-  std::sort(d1.begin(), d1.end());
   
-  for (unsigned int i = 0; i < numPeaks; ++i) {
-    bool peakAdded = false;
-    while (!peakAdded) {  
-      //unsigned int bin = rand() % numBins; // causes biases at 0 (higher density) and 1 (lower density)
-      unsigned int bin = lcg_rand() % numBins;
-      if (!hasPeak[bin]) {
-        d2.push_back(bin);
-        peakAdded = true;
-      }
-    }
-  }
-  std::sort(d2.begin(), d2.end());
+  pvalCalc.init(&d1[0], d1.size());
+  std::copy(polyfit, polyfit + kNumPolyfitCoeffs, pvalCalc.polyfit_);
   
-  pvalCalc.peakProbs_ = p;
-  pvalCalc.peakBins_ = d1;
-  pvalCalc.polyfit_.push_back(-40.236851088905013);
-  pvalCalc.polyfit_.push_back(90.270774017803348);
-  pvalCalc.polyfit_.push_back(-117.64110105643428);
-  pvalCalc.polyfit_.push_back(154.88646213751957);
-  pvalCalc.polyfit_.push_back(-118.82877111418108);
-  pvalCalc.polyfit_.push_back(31.617289887393586);
+  std::vector<short> intersection;
+  std::set_intersection(d1.begin(), d1.end(), d2.begin(), d2.end(), 
+                        std::back_inserter(intersection));
+  unsigned int matchedScore = 100u * intersection.size();
+  double relScore = static_cast<double>(pvalCalc.maxScore_ - matchedScore) / 
+                    pvalCalc.maxScore_;
+  double expectedLogPval = 0.0;
+  for (unsigned int i = 0; i < kNumPolyfitCoeffs; ++i) {
+    expectedLogPval += polyfit[i] * std::pow(relScore, static_cast<int>(i));
+  }
+  expectedLogPval = (std::min)(0.0, expectedLogPval);
   
-  double logPval = pvalCalc.computePvalPolyfit(d2);
+  double logPval = pvalCalc.computePvalPolyfit(&d2[0], d2.size());
   
-  if (isEqual(logPval, -0.817751)) {
+  if (intersection.size() > 0u && isEqual(logPval, expectedLogPval)) {
     return true;
   } else {
-    std::cout << "log(pval) was " << logPval << ", should be -0.817751." << std::endl;
+    std::cout << "log(pval) was " << logPval << ", should be " 
+              << expectedLogPval << " for " << intersection.size() 
+              << " matched peaks." << std::endl;
     return false;
   }
 }
+
+// with fewer scores than coefficients the normal equations are singular and
+// the fit falls back to a constant, with exactly as many scores the 
+// polynomial interpolates them
+bool PvalueCalculator::polyfitFactorizationUnitTest() {
+  bool success = true;
+  for (unsigned int maxScore = 1u; maxScore <= kNumPolyfitCoeffs; ++maxScore) {
+    PolyfitFactorization uncachedFactorization;
+    const PolyfitFactorization& factorization = 
+        getPolyfitFactorization(maxScore, uncachedFactorization);
+    if (factorization.isValid != (maxScore >= kNumPolyfitCoeffs)) {
+      std::cerr << "Factorization for maxScore " << maxScore << " should " 
+                << (factorization.isValid ? "not " : "") << "be valid" 
+                << std::endl;
+      success = false;
+      continue;
+    }
+    
+    // y = -1 - 2x + 0.5x^3 at x = score / maxScore
+    double coeffs[kNumPolyfitCoeffs] = { -1.0, -2.0, 0.0, 0.5, 0.0, 0.0 };
+    double xty[kNumPolyfitCoeffs] = { 0.0 };
+    double sumY = 0.0;
+    for (unsigned int score = 0; score < maxScore; ++score) {
+      double x = static_cast<double>(score) / maxScore;
+      double y = -1.0 - 2.0*x + 0.5*x*x*x;
+      sumY += y;
+      double value = 1.0;
+      for (unsigned int col = 0; col < kNumPolyfitCoeffs; ++col) {
+        xty[col] += value * y;
+        value *= x;
+      }
+    }
+    
+    TestPvalueCalculator pvalCalc;
+    pvalCalc.solvePolyfit(xty, factorization, maxScore);
+    for (unsigned int col = 0; col < kNumPolyfitCoeffs; ++col) {
+      double expected = factorization.isValid ? coeffs[col] : 
+                        (col == 0 ? sumY / maxScore : 0.0);
+      if (!isEqual(pvalCalc.polyfit_[col], expected)) {
+        std::cerr << "Coefficient " << col << " for maxScore " << maxScore 
+                  << " was " << pvalCalc.polyfit_[col] << ", should be " 
+                  << expected << std::endl;
+        success = false;
+      }
+    }
+  }
+  return success;
+}
+
+// compares the saddle point approximation with the exact p-value vectors of
+// computePvalVector, both before and after fitting the polynomials. Below 
+// the smallest peak score, the exact vector is constant at P(U = 0), which
+// the approximation does not resolve, but it is exact at score 0 itself.
+bool PvalueCalculator::pvalApproxUnitTest() {
+  setSeed(7);
+  double maxRawDiff = 0.0, maxFitDiff = 0.0, sumFitDiff = 0.0;
+  double maxFitResidual = 0.0, maxApproxFitResidual = 0.0;
+  double rawTolerance = 1.0, fitTolerance = 1.0, meanFitTolerance = 0.1;
+  unsigned int numBins = 1000u, numFitScores = 0u;
+  for (unsigned int k = 0; k < 200; ++k) {
+    std::vector<double> peakDist(numBins);
+    for (unsigned int bin = 0; bin < numBins; ++bin) {
+      peakDist[bin] = 0.001 + 0.1 * lcg_rand_unif();
+    }
+    std::vector<short> peakBins;
+    drawUniquePeakBins(kMinScoringPeaks + k % 26, numBins - 1, peakBins);
+    
+    TestPvalueCalculator exactCalc, approxCalc;
+    Scratch scratch;
+    exactCalc.initFromPeakBins(&peakBins[0], peakBins.size(), &peakDist[0], 
+                               numBins, scratch);
+    approxCalc = exactCalc;
+    exactCalc.computePvalVectorPolyfit(scratch);
+    
+    approxPvalVectors_ = true;
+    approxCalc.computePvalVectorPolyfit(scratch);
+    approxPvalVectors_ = false;
+    
+    unsigned int maxScore = exactCalc.maxScore_;
+    double sumLogP = 0.0;
+    double disc = approxCalc.discretizePeakScores(scratch, sumLogP);
+    unsigned int scores[kMaxScoringPeaks];
+    unsigned int numScores = approxCalc.numPeaks_;
+    std::copy(approxCalc.peakScores_, approxCalc.peakScores_ + numScores, scores);
+    std::sort(scores, scores + numScores);
+    double dK, d2K, d3K;
+    double logTotalWeight = logisticCumulants(scores, numScores, disc, 
+                                              dK, d2K, d3K);
+    double t = 0.0;
+    for (unsigned int score = scores[0]; score < maxScore; ++score) {
+      double exact = log10(scratch.sumProb[score]);
+      double approx = (sumLogP + saddlepointLogCdf(scores, numScores, disc, 
+          logTotalWeight, score + 0.5, t)) / log(10.0);
+      maxRawDiff = std::max(maxRawDiff, std::abs(exact - approx));
+    }
+    
+    for (unsigned int score = 0; score < maxScore; ++score) {
+      double relScore = static_cast<double>(score) / (maxScore + 1);
+      double exactFit = polyval(exactCalc.polyfit_, relScore);
+      double approxFit = polyval(approxCalc.polyfit_, relScore);
+      maxFitDiff = std::max(maxFitDiff, std::abs(exactFit - approxFit));
+      sumFitDiff += std::abs(exactFit - approxFit);
+      double exact = std::min(0.0, log10(scratch.sumProb[score]));
+      maxFitResidual = std::max(maxFitResidual, std::abs(exactFit - exact));
+      maxApproxFitResidual = std::max(maxApproxFitResidual, 
+                                      std::abs(approxFit - exact));
+      ++numFitScores;
+    }
+  }
+  
+  double meanFitDiff = sumFitDiff / numFitScores;
+  std::cout << "Approximate p-value vectors differed by up to " << maxRawDiff
+            << " log10 units from the exact vectors and the fitted polynomials"
+            << " by up to " << maxFitDiff << " (mean " << meanFitDiff 
+            << "). The fits deviated from the exact vectors by up to " 
+            << maxApproxFitResidual << " (approximate) and " << maxFitResidual 
+            << " (exact)." << std::endl;
+  return maxRawDiff < rawTolerance && maxFitDiff < fitTolerance && 
+         meanFitDiff < meanFitTolerance;
+}
+
+// the signatures have to bound the number of shared bins from above, also 
+// for bins that fold onto the same bit
+bool PvalueCalculator::peakSignatureUnitTest() {
+  setSeed(17);
+  for (unsigned int k = 0; k < 1000; ++k) {
+    std::vector<short> peakBins[2];
+    for (unsigned int j = 0; j < 2; ++j) {
+      // narrow bin ranges share many bins, wide ones fold onto the same bits
+      unsigned int numBins = 50u + (lcg_rand() % 4) * 1000u;
+      drawUniquePeakBins(kMinScoringPeaks + lcg_rand() % 26, numBins, 
+                         peakBins[j]);
+    }
+    std::vector<short> sharedBins;
+    std::set_intersection(peakBins[0].begin(), peakBins[0].end(), 
+        peakBins[1].begin(), peakBins[1].end(), std::back_inserter(sharedBins));
+    
+    PeakSignature signatures[2];
+    for (unsigned int j = 0; j < 2; ++j) {
+      signatures[j].init(&peakBins[j][0], peakBins[j].size());
+    }
+    unsigned int maxSharedPeaks = signatures[0].maxSharedPeaks(signatures[1]);
+    if (maxSharedPeaks < sharedBins.size()) {
+      std::cout << "Signatures bounded the shared peaks by " << maxSharedPeaks 
+                << " instead of at least " << sharedBins.size() << "." << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
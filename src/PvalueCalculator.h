@@ -27,7 +27,10 @@ Adapted from https://code.google.com/p/in-silico-mass-fingerprinting/
 
 #include <cmath>
 #include <algorithm>
+#include <iterator>
 #include <numeric>
+#include <functional>
+#include <limits>
 
 #include <iostream>
 #include <sstream>
@@ -39,9 +42,92 @@ Adapted from https://code.google.com/p/in-silico-mass-fingerprinting/
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 
-#include <boost/numeric/ublas/matrix.hpp>
-#include <boost/numeric/ublas/lu.hpp>
+#include "PvalueKernels.h"
 
+/**
+ * Dense bin -> score table over the bin range of one spectrum. Scoring 
+ * another spectrum against it gathers that spectrum's bins from the table 
+ * instead of merging the two sorted peak lists, which pays off when the 
+ * same spectrum is compared to many others.
+ */
+struct PeakScoreLookup {
+  PeakScoreLookup() : minBin(0) {}
+  
+  int minBin;
+  // -1 for bins without a peak, the peak score for scoring peaks and 0 for
+  // peaks that only take part as query peaks
+  std::vector<short> table;
+  
+  inline short get(short bin) const {
+    unsigned int idx = bin - minBin;
+    return (idx < table.size()) ? table[idx] : static_cast<short>(-1);
+  }
+  
+  // sum of the scores of the scoring peaks in peakBins
+  inline unsigned int scoreOf(const short* peakBins, unsigned int numPeaks) const {
+    unsigned int score = 0u;
+    for (unsigned int i = 0; i < numPeaks; ++i) {
+      score += (std::max)(get(peakBins[i]), static_cast<short>(0));
+    }
+    return score;
+  }
+  
+  // sum of the peakScores of the peaks in peakBins that are in the table, 
+  // with the same cutoff on the unmatched score as PvalueKernels::matchedScore
+  inline unsigned int matchedScoreOf(const short* peakBins, 
+      const short* peakScores, unsigned int numPeaks,
+      unsigned int maxUnmatchedScore = PvalueKernels::kNoScoreCutoff) const {
+    unsigned int score = 0u, unmatchedScore = 0u;
+    for (unsigned int i = 0; i < numPeaks; ++i) {
+      if (get(peakBins[i]) >= 0) {
+        score += peakScores[i];
+      } else {
+        unmatchedScore += peakScores[i];
+        if (unmatchedScore > maxUnmatchedScore) break;
+      }
+    }
+    return score;
+  }
+};
+
+/**
+ * Bit signature of the peak bins of a spectrum, folded onto kNumBits bits 
+ * by the bin modulo kNumBits. A bin that two spectra share sets the same bit
+ * in both signatures, but several bins of one spectrum can fold onto the 
+ * same bit. With these collisions counted, the number of shared bins is at 
+ * most the number of shared bits plus the smaller number of collisions.
+ */
+struct PeakSignature {
+  static const unsigned int kNumBits = 64u * PvalueKernels::kSignatureWords;
+  
+  PeakSignature() : numCollisions(0u) {
+    std::fill(words, words + PvalueKernels::kSignatureWords, 0ULL);
+  }
+  
+  unsigned long long words[PvalueKernels::kSignatureWords];
+  unsigned int numCollisions;
+  
+  inline void init(const short* peakBins, unsigned int numPeakBins) {
+    std::fill(words, words + PvalueKernels::kSignatureWords, 0ULL);
+    numCollisions = 0u;
+    for (unsigned int i = 0; i < numPeakBins; ++i) {
+      unsigned int bit = static_cast<unsigned short>(peakBins[i]) % kNumBits;
+      unsigned long long mask = 1ULL << (bit % 64u);
+      if (words[bit / 64u] & mask) ++numCollisions;
+      words[bit / 64u] |= mask;
+    }
+  }
+  
+  inline unsigned int maxSharedPeaks(const PeakSignature& other) const {
+    return PvalueKernels::sharedBitCount(words, other.words) + 
+           (std::min)(numCollisions, other.numCollisions);
+  }
+};
+
+/**
+ * Settings and helpers of the p-value calculation that do not depend on the
+ * layout of the stored p-value vectors, see BasicPvalueCalculator.
+ */
 class PvalueCalculator {
  public:
   static unsigned int probDiscretizationLevels_;
@@ -49,65 +135,275 @@ class PvalueCalculator {
   static const double kMinProb, kMaxProb;
   static const unsigned int kMaxScoringPeaks = 40u, kMinScoringPeaks;
   static const bool kVariableScoringPeaks;
+  // number of peaks that is scored per spectrum, at most kMaxScoringPeaks. 
+  // Fewer peaks trade sensitivity for speed, the calculation of the p-value
+  // vectors and the peak matching only run over the scored peaks and the 
+  // layout with the smallest capacity that holds them is selected. The 
+  // background peak counts and the records depend on this number, so the 
+  // same value has to be used for creating the index and for calculating 
+  // the p-values.
+  static unsigned int maxScoringPeaks_;
+  // replaces the dynamic programming of the p-value vectors by a saddle 
+  // point approximation, which is only evaluated at kNumApproxScores scores
+  static bool approxPvalVectors_;
+  // stores and evaluates the polynomial fits in single precision, i.e. 
+  // selects a layout with float coefficients. The p-value vector files are 
+  // written in the selected layout, so the same setting has to be used for 
+  // creating and for reading them.
+  static bool singlePrecision_;
+  static const unsigned int kNumPolyfitCoeffs = kPolyfitDegree + 1u;
+  
+  // buffers that are only needed while the p-value vector is calculated.
+  // Each thread keeps one Scratch for all its spectra, reserve() sizes it 
+  // for the largest possible score vector so that it never reallocates.
+  struct Scratch {
+    std::vector<double> peakProbs;
+    std::vector<double> sumProb;
+    std::vector<double> scoreDist;
+    
+    // every peak scores at most probDiscretizationLevels_
+    void reserve() {
+      size_t maxScoreVectorSize = kMaxScoringPeaks * probDiscretizationLevels_ + 1u;
+      peakProbs.reserve(kMaxScoringPeaks);
+      sumProb.reserve(maxScoreVectorSize);
+      scoreDist.reserve(maxScoreVectorSize);
+    }
+  };
   
-  inline unsigned int getNumScoringPeaks() const { return peakBins_.size(); }
   static unsigned int getMaxScoringPeaks(double mass) { 
     if (kVariableScoringPeaks) {
-      return std::min(kMaxScoringPeaks, static_cast<unsigned int>(mass / 50.0));
+      return std::min(maxScoringPeaks_, static_cast<unsigned int>(mass / 50.0));
     } else {
-      return kMaxScoringPeaks;
+      return maxScoringPeaks_;
     }
   }
   
   static unsigned int getMinScoringPeaks(double mass) { 
+    unsigned int minScoringPeaks = std::min(kMinScoringPeaks, maxScoringPeaks_);
     if (kVariableScoringPeaks) {
-      return std::min(kMinScoringPeaks, static_cast<unsigned int>(mass / 50.0));
+      return std::min(minScoringPeaks, static_cast<unsigned int>(mass / 50.0));
     } else {
-      return kMinScoringPeaks;
+      return minScoringPeaks;
     }
   }
   
-  void init(const std::vector<unsigned int>& _peakBins, const std::vector<double>& _peakProbs);
-  void initFromPeakBins(const std::vector<unsigned int>& originalPeakBins, const std::vector<double>& peakDist);
-  void initPolyfit(const std::vector<unsigned int>& peakBins, const std::vector<unsigned int>& peakScores, const std::vector<double>& polyfit);
-  
-  void computePvalVector();
-  double computePval(const std::vector<unsigned int>& queryPeakBins, bool smoothing = false);
-  
-  void computePvalVectorPolyfit();
-  double computePvalPolyfit(const std::vector<unsigned int>& queryPeakBins);
-  
-  void copyPolyfit(short* peakBins, short* peakScores, double* polyfit);
-  void serialize(std::string& polyfitString, std::string& peakScorePairsString);
-  void deserialize(std::string& polyfitString, std::string& peakScorePairsString);
-  
   static bool pvalUnitTest();
   static bool pvalPolyfitUnitTest();
   static bool pvalUniformUnitTest();
   static bool binaryPeakMatchUnitTest();
+  static bool peakScoreLookupUnitTest();
+  static bool scoreCutoffUnitTest();
+  static bool polyvalPrecisionUnitTest();
+  static bool pvalApproxUnitTest();
+  static bool peakSignatureUnitTest();
+  static bool polyfitFactorizationUnitTest();
   
   // needed for smoothing and unit tests
   inline static void setSeed(unsigned long s) { seed_ = s; }
   static unsigned long lcg_rand();
   static double lcg_rand_unif();
+  static void drawUniquePeakBins(unsigned int numPeaks, unsigned int numBins,
+                                 std::vector<short>& peakBins);
   
- private:
-  
-  std::vector<double> polyfit_;
-  std::vector<double> sumProb_;
-  std::vector<double> peakProbs_;
+ protected:
+  // Horner's method in the precision of T, capped at a log p-value of 0
+  template <typename T>
+  static inline T polyval(const T* polyfit, T x) {
+    T y = polyfit[kNumPolyfitCoeffs - 1];
+    for (int i = kNumPolyfitCoeffs - 2; i >= 0; --i) {
+      y = polyfit[i] + y*x;
+    }
+    return (std::min)(T(0), y);
+  }
   
-  std::vector<unsigned int> peakBins_;
-  std::vector<unsigned int> peakScores_;
+  // Cholesky factor L of the normal equations X^T X of the least squares 
+  // polynomial fit, where X is the Vandermonde matrix of the abscissae 
+  // score / maxScore for score = 0, ..., maxScore - 1. These only depend on 
+  // maxScore and are precomputed for all maxScore that can occur with 
+  // kMaxScoringPeaks peaks.
+  struct PolyfitFactorization {
+    double L[kNumPolyfitCoeffs][kNumPolyfitCoeffs];
+    bool isValid;
+  };
+  static const std::vector<PolyfitFactorization> polyfitFactorizations_;
+  // pivots of the Cholesky factorization below this fraction of the 
+  // corresponding diagonal element of X^T X mark a singular system
+  static const double kMinRelativePivot;
   
-  unsigned int maxScore_;
+  static std::vector<PolyfitFactorization> initPolyfitFactorizations(
+      unsigned int maxCachedScore);
+  static void factorizeNormalEquations(const double powerSums[2*kPolyfitDegree + 1], 
+      unsigned int maxScore, PolyfitFactorization& factorization);
+  static const PolyfitFactorization& getPolyfitFactorization(
+      unsigned int maxScore, PolyfitFactorization& factorization);
   
-  void binaryMatchPeakBins(const std::vector<unsigned int>& queryPeakBins, std::vector<bool>& d);
-  double polyval(double x);
+  static const unsigned int kNumApproxScores;
+  static double logisticCumulants(const unsigned int* scores, 
+      unsigned int numScores, double tau, double& dK, double& d2K, double& d3K);
+  // log of the total weight exp(k*l(S)) of the subsets S of the scores with
+  // l(S) <= s, t is the saddle point
+  static double saddlepointLogCdf(const unsigned int* scores, 
+      unsigned int numScores, double k, double logTotalWeight, double s, 
+      double& t);
+  static double logNormalCdf(double x);
   
   // used for unit tests
   static inline bool isEqual(double a, double b) { return (std::abs(a - b) < 1e-5); }
   static unsigned long seed_;
 };
 
+/**
+ * Layout of the stored p-value vectors. PolyfitValue is the type of the 
+ * stored polynomial coefficients and of their evaluation, the p-value 
+ * vectors themselves are always calculated and fitted in double precision.
+ * kMaxScoringPeaks is the capacity of the peak arrays of the calculators, 
+ * rows and records, at most PvalueCalculator::kMaxScoringPeaks. The 
+ * pipeline is instantiated for each layout and one is selected per run, see
+ * BatchPvalueVectors::create.
+ */
+template <typename PolyfitValueT, unsigned int MaxScoringPeaks>
+struct PvalueVectorLayout {
+  typedef PolyfitValueT PolyfitValue;
+  static const unsigned int kMaxScoringPeaks = MaxScoringPeaks;
+};
+
+// the layouts with the full peak capacity
+typedef PvalueVectorLayout<double, PvalueCalculator::kMaxScoringPeaks> DoublePrecisionLayout;
+typedef PvalueVectorLayout<float, PvalueCalculator::kMaxScoringPeaks> SinglePrecisionLayout;
+
+/**
+ * The calculator only holds fixed size arrays, so that it is trivially 
+ * copyable and the p-value vector rows can be stored, sorted and written
+ * as contiguous arrays without any heap allocations per row. The buffers 
+ * of the p-value vector calculation are passed in through a Scratch object.
+ * The member functions are instantiated in PvalueCalculator.cpp for the 
+ * layouts that BatchPvalueVectors::create can select.
+ */
+template <class Layout>
+class BasicPvalueCalculator : public PvalueCalculator {
+ public:
+  // hides PvalueCalculator::kMaxScoringPeaks, so that the peak arrays and 
+  // loops of this calculator are sized by the layout
+  static const unsigned int kMaxScoringPeaks = Layout::kMaxScoringPeaks;
+  typedef typename Layout::PolyfitValue PolyfitValue;
+  
+  BasicPvalueCalculator() : numPeaks_(0u), maxScore_(0u), minMatchedScore_(0u),
+                            minMatchedPeaks_(0u) {
+    std::fill(polyfit_, polyfit_ + kNumPolyfitCoeffs, PolyfitValue(0));
+  }
+  
+  inline unsigned int getNumScoringPeaks() const { return numPeaks_; }
+  
+  void init(const short* peakBins, unsigned int numPeaks);
+  void initFromPeakBins(const short* originalPeakBins, unsigned int numOriginalPeaks, 
+                        const double* peakDist, size_t numBins, Scratch& scratch);
+  void initPolyfit(const short* peakBins, const short* peakScores, 
+                   const PolyfitValue* polyfit);
+  
+  void computePvalVector(Scratch& scratch);
+  double computePval(const short* queryPeakBins, unsigned int numQueryPeaks, 
+                     const Scratch& scratch, bool smoothing = false);
+  
+  void computePvalVectorPolyfit(Scratch& scratch);
+  double computePvalPolyfit(const short* queryPeakBins, unsigned int numQueryPeaks) const;
+  
+  // the lookup of this calculator's scoring peaks together with its query
+  // peaks, which have to include the scoring peaks
+  void initPeakScoreLookup(const short* queryPeakBins, unsigned int numQueryPeaks, 
+                           PeakScoreLookup& lookup) const;
+  // p-value of the query spectrum of the lookup against this calculator
+  double computePvalPolyfit(const PeakScoreLookup& queryLookup) const;
+  // p-value of queryPeakBins against this calculator using its own lookup
+  double computePvalPolyfit(const PeakScoreLookup& lookup, 
+      const short* queryPeakBins, unsigned int numQueryPeaks) const;
+  
+  // the p-values are monotone in the matched score in practice, but the 
+  // fitted polynomial need not be. This finds the smallest matched score 
+  // with a p-value below pvalThreshold, below which the peak matching of 
+  // computePvalPolyfitWithCutoff is abandoned.
+  void initScoreCutoff(double pvalThreshold);
+  // pairs that share fewer peaks than this cannot reach the score cutoff
+  inline unsigned int getMinMatchedPeaks() const { return minMatchedPeaks_; }
+  
+  // the matched scores that can pass the score cutoff are the integers 
+  // minMatchedScore_, ..., maxScore_. Their p-values are evaluated once per
+  // calculator into a table of getPvalueTableSize() values, which the 
+  // callers keep next to the calculator, as it would not fit in its fixed 
+  // size arrays. The functions below take the table of the calculator, or 
+  // NULL to evaluate the polynomial instead.
+  inline unsigned int getPvalueTableSize() const {
+    return (minMatchedScore_ > maxScore_) ? 0u : maxScore_ - minMatchedScore_ + 1u;
+  }
+  void initPvalueTable(PolyfitValue* pvalTable) const;
+  
+  // same as computePvalPolyfit for p-values below the threshold of
+  // initScoreCutoff, other pairs return 0.0 after matching as few peaks as
+  // possible
+  double computePvalPolyfitWithCutoff(const short* queryPeakBins, 
+      unsigned int numQueryPeaks, const PolyfitValue* pvalTable = NULL) const;
+  double computePvalPolyfitWithCutoff(const PeakScoreLookup& queryLookup, 
+      const PolyfitValue* pvalTable = NULL) const;
+  // p-value of queryPeakBins against this calculator using its own lookup
+  double computePvalPolyfitWithCutoff(const PeakScoreLookup& lookup, 
+      const short* queryPeakBins, unsigned int numQueryPeaks, 
+      const PolyfitValue* pvalTable = NULL) const;
+  // p-values of both directions of a pair from a single merge of the peak 
+  // bins of the two spectra, which have to include the scoring peaks of 
+  // their calculators. Returns false without setting the p-values as soon as
+  // one of the directions cannot reach the score cutoff of its calculator.
+  static bool computePvalPolyfitPair(
+      const BasicPvalueCalculator& targetCalc, const short* targetPeakBins, 
+      unsigned int numTargetPeaks, 
+      const BasicPvalueCalculator& queryCalc, const short* queryPeakBins, 
+      unsigned int numQueryPeaks, double& targetPval, double& queryPval,
+      const PolyfitValue* targetPvalTable = NULL, 
+      const PolyfitValue* queryPvalTable = NULL);
+  
+  void copyPolyfit(short* peakBins, short* peakScores, PolyfitValue* polyfit) const;
+  void serialize(std::string& polyfitString, std::string& peakScorePairsString) const;
+  void deserialize(std::string& polyfitString, std::string& peakScorePairsString);
+  
+ private:
+  // the unit tests of PvalueCalculator set up calculators directly
+  friend class PvalueCalculator;
+  
+  PolyfitValue polyfit_[kNumPolyfitCoeffs];
+  
+  // sorted peak bins with their discretized scores, only the first 
+  // numPeaks_ entries are used
+  short peakBins_[kMaxScoringPeaks];
+  short peakScores_[kMaxScoringPeaks];
+  unsigned int numPeaks_;
+  
+  unsigned int maxScore_;
+  // smallest matched score with a p-value below the cutoff threshold, 
+  // maxScore_ + 1 if there is none and 0 if no cutoff was initialized
+  unsigned int minMatchedScore_;
+  // fewest scoring peaks that can reach minMatchedScore_
+  unsigned int minMatchedPeaks_;
+  
+  inline double computePvalPolyfitFromMatchedScore(unsigned int matchedScore) const {
+    PolyfitValue relScore = static_cast<PolyfitValue>(maxScore_ - matchedScore)/maxScore_;
+    return polyval(polyfit_, relScore);
+  }
+  
+  // p-value of a matched score that passed the score cutoff
+  inline double computePvalFromMatchedScore(unsigned int matchedScore, 
+                                            const PolyfitValue* pvalTable) const {
+    return pvalTable ? pvalTable[matchedScore - minMatchedScore_] : 
+                       computePvalPolyfitFromMatchedScore(matchedScore);
+  }
+  
+  void initMinMatchedPeaks();
+  
+  // sets peakScores_ and maxScore_ from the peak probabilities, returns the
+  // discretization step of the logits and the sum of the log probabilities
+  double discretizePeakScores(const Scratch& scratch, double& sumLogP);
+  // solves the normal equations for polyfit_ from X^T y of numScores scores
+  void solvePolyfit(const double xty[kNumPolyfitCoeffs], 
+      const PolyfitFactorization& factorization, unsigned int numScores);
+  
+  void computePvalVectorApproxPolyfit(Scratch& scratch);
+};
+
 #endif // PVALUECALCULATOR_H
@@ -17,6 +17,7 @@
 #include "PvalueFilterAndSort.h"
 
 int PvalueFilterAndSort::maxPvalsPerFile_ = 5000000;
+bool PvalueFilterAndSort::compressPvals_ = false;
 
 void PvalueFilterAndSort::filterAndSort(const std::string& pvalFN) {
   bool tsvInput = false;
@@ -59,32 +60,42 @@ int PvalueFilterAndSort::splitByHash(const std::vector<std::string>& pvalFNs,
   long long i = 0;
   BOOST_FOREACH (const std::string& pvalFN, pvalFNs) {
     if (estimateNumPvals(pvalFN, tsvInput) == 0) continue;
-    boost::iostreams::mapped_file mmap(pvalFN, 
-            boost::iostreams::mapped_file::readonly);
-    const char* f = mmap.const_data();
-    const char* l = f + mmap.size();
-    
-    {
+    if (tsvInput) {
+      boost::iostreams::mapped_file mmap(pvalFN, 
+              boost::iostreams::mapped_file::readonly);
+      const char* f = mmap.const_data();
+      const char* l = f + mmap.size();
+      
       errno = 0;
       char* next = NULL;
       PvalueTriplet tmp;
       while (errno == 0 && f && f <= (l-sizeof(tmp)) ) {
-        if (tsvInput) {
-          tmp.readFromString(f, &next); f = next;
-        } else {
-          memcpy(&tmp, f, sizeof(tmp));
-          f += sizeof(tmp);
-        }
+        tmp.readFromString(f, &next); f = next;
         buffer.push_back(tmp);
-        //std::cerr << tmp.scannr1 << " " << tmp.scannr2 << " " << tmp.pval << std::endl;
         if (++i % maxPvalsPerFile_ == 0) {
           std::cerr << "Hashing p-value " << i << " (" << i*100/numPvals << "%)" << std::endl;
           writeBufferToPartFiles(buffer, numFiles, resultFN);
-          //std::cerr << "Written p-value " << i << "/" << numPvals << std::endl;
           buffer.clear();
           buffer.reserve(maxPvalsPerFile_);
         }
       }
+    } else {
+      // binary files are read in chunks that fill up the buffer, this also
+      // works for files inside the PackedFileStore
+      long long offset = 0;
+      size_t numRead = 0;
+      do {
+        numRead = BinaryInterface::readRange<PvalueTriplet>(pvalFN, offset,
+                      maxPvalsPerFile_ - buffer.size(), buffer);
+        offset += numRead;
+        i += numRead;
+        if (buffer.size() >= static_cast<size_t>(maxPvalsPerFile_)) {
+          std::cerr << "Hashing p-value " << i << " (" << i*100/numPvals << "%)" << std::endl;
+          writeBufferToPartFiles(buffer, numFiles, resultFN);
+          buffer.clear();
+          buffer.reserve(maxPvalsPerFile_);
+        }
+      } while (numRead > 0);
     }
   }
 
@@ -94,6 +105,9 @@ int PvalueFilterAndSort::splitByHash(const std::vector<std::string>& pvalFNs,
 
 void PvalueFilterAndSort::filterAndSortSingleFile(const std::string& partFileFN,
     bool removeUnidirected) {
+  // hash bins without any p-values are never written
+  if (!BinaryInterface::exists(partFileFN)) return;
+  
   std::vector<PvalueTriplet> buffer, filteredBuffer;
   buffer.reserve(maxPvalsPerFile_);
   
@@ -119,7 +133,7 @@ void PvalueFilterAndSort::filterAndSortSingleFile(const std::string& partFileFN,
   std::string sortedPvalFN = partFileFN;
   
   bool append = false;
-  BinaryInterface::write<PvalueTriplet>(buffer, sortedPvalFN, append);
+  writePvals(buffer, sortedPvalFN, append);
 }
 
 void PvalueFilterAndSort::externalMergeSort(const std::string& resultFN, int numFiles) {
@@ -127,7 +141,8 @@ void PvalueFilterAndSort::externalMergeSort(const std::string& resultFN, int num
   
   int numOpenFiles = numFiles;  
   std::vector<PvalueTriplet> pvecBuffer;
-  std::vector<long long> offsets(numFiles);
+  std::vector<long long> offsets(numFiles), numPvalsPerFile(numFiles);
+  std::vector<bool> closed(numFiles, false);
   int maxPvalSort = maxPvalsPerFile_;
   bool first = true;
   long long numPvals = 0, numWrittenPvals = 0;
@@ -137,33 +152,31 @@ void PvalueFilterAndSort::externalMergeSort(const std::string& resultFN, int num
     for (int bin = 0; bin < numFiles; ++bin) {
       std::string partFileFN = resultFN + "." + boost::lexical_cast<std::string>(bin);
       
-      boost::iostreams::mapped_file mmap(partFileFN, 
-            boost::iostreams::mapped_file::readonly);
-      
-      const char* f = mmap.const_data();
-      const char* l = f + mmap.size();
-      f += offsets[bin];
+      if (first) {
+        // empty hash bins are never written, getSize returns 0 for them
+        numPvalsPerFile[bin] = BinaryInterface::getSize(partFileFN) / sizeof(PvalueTriplet);
+        numPvals += numPvalsPerFile[bin];
+      }
       
-      if (first) numPvals += (l - f)/sizeof(PvalueTriplet);
+      if (closed[bin]) continue;
       
-      if (f && f <= (l-sizeof(PvalueTriplet))) {
-        errno = 0;
-        PvalueTriplet tmp;
-        int numPvalsAdded = 0;
-        while (errno == 0 && f && f<=(l-sizeof(tmp)) && 
-               ++numPvalsAdded <= maxPvalSort/numFiles) {
-          memcpy(&tmp, f, sizeof(tmp));
-          f += sizeof(tmp);
-          offsets[bin] += sizeof(tmp);
-          pvecBuffer.push_back(tmp);
-        }
+      if (offsets[bin] < numPvalsPerFile[bin]) {
+        size_t numRead = BinaryInterface::readRange<PvalueTriplet>(partFileFN,
+                             offsets[bin], maxPvalSort/numFiles, pvecBuffer);
+        offsets[bin] += numRead;
         
-        if (pvecBuffer.back().pval < maxMinPval) {
+        if (numRead > 0 && pvecBuffer.back().pval < maxMinPval) {
           maxMinPval = pvecBuffer.back().pval;
         }
+        
+        // avoid looping forever on a truncated part file
+        if (numRead == 0) offsets[bin] = numPvalsPerFile[bin];
       }
       
-      if (!(f && f <= (l-sizeof(PvalueTriplet)))) --numOpenFiles;
+      if (offsets[bin] >= numPvalsPerFile[bin]) {
+        closed[bin] = true;
+        --numOpenFiles;
+      }
     }
     
     if (first) first = false;
@@ -183,15 +196,15 @@ void PvalueFilterAndSort::externalMergeSort(const std::string& resultFN, int num
     pvecBuffer.erase(pvecBuffer.begin(), pvecBuffer.begin() + numPvalsToErase);
     
     numWrittenPvals += pvec.size();
-    std::cerr << "Writing p-value " << numWrittenPvals << "/" << numPvals << " (" << numWrittenPvals*100/numPvals << "%)"<< std::endl;
+    std::cerr << "Writing p-value " << numWrittenPvals << "/" << numPvals << " (" << numWrittenPvals*100/(std::max)(numPvals, 1LL) << "%)"<< std::endl;
     
     bool append = true;
-    BinaryInterface::write<PvalueTriplet>(pvec, resultFN, append);
+    writePvals(pvec, resultFN, append);
   }
   
   for (int bin = 0; bin < numFiles; ++bin) {
     std::string partFileFN = resultFN + "." + boost::lexical_cast<std::string>(bin);
-    remove(partFileFN.c_str());
+    BinaryInterface::remove(partFileFN);
   }
 }
 
@@ -211,7 +224,7 @@ void PvalueFilterAndSort::writeBufferToPartFiles(std::vector<PvalueTriplet>& buf
     if (pvec.size() > 0) {
       std::string partFileFN = resultFN + "." + boost::lexical_cast<std::string>(j);
       bool append = true;
-      BinaryInterface::write<PvalueTriplet>(pvec, partFileFN, append);
+      writePvals(pvec, partFileFN, append);
     }
     ++j;
   }
@@ -250,9 +263,8 @@ long long PvalueFilterAndSort::estimateNumPvals(const std::string& pvalFN, bool
 }
 
 long long PvalueFilterAndSort::getFileSize(const std::string& pvalFN) {
-  std::ifstream in(pvalFN.c_str(), std::ios::ate | std::ios::binary);
-  if (in.is_open()) {
-    return static_cast<long long>(in.tellg());
+  if (BinaryInterface::exists(pvalFN)) {
+    return BinaryInterface::getSize(pvalFN);
   } else {
     std::cerr << "WARNING: could not read any p-values from "
         << pvalFN << "." << std::endl;
@@ -299,6 +311,17 @@ void PvalueFilterAndSort::removeUndirectedDuplicates(
   }  
 }
 
+// binary p-value files are zlib compressed in blocks if compressPvals_ is set,
+// the readers in BinaryInterface detect compressed files automatically
+void PvalueFilterAndSort::writePvals(const std::vector<PvalueTriplet>& pvec,
+    const std::string& pvalFN, bool append) {
+  if (compressPvals_) {
+    BinaryInterface::writeCompressed<PvalueTriplet>(pvec, pvalFN, append);
+  } else {
+    BinaryInterface::write<PvalueTriplet>(pvec, pvalFN, append);
+  }
+}
+
 // TODO: check if file exists before reading
 void PvalueFilterAndSort::readPvals(const std::string& pvalFN, std::vector<PvalueTriplet>& pvec) {
 #pragma omp critical (read_pval_parts)
@@ -349,3 +372,48 @@ bool PvalueFilterAndSort::singleFileUnitTest() {
   
   return true;
 }
+
+// merges a run of part files where the middle hash bin did not receive any 
+// p-values, i.e. its part file was never written
+bool PvalueFilterAndSort::emptyBinUnitTest() {
+  std::string resultFN = "pvalue_filter_and_sort_unit_test.dat";
+  int numFiles = 3;
+  std::remove(resultFN.c_str());
+  
+  std::vector<PvalueTriplet> pvec, bin0, bin2;
+  for (unsigned int i = 0; i < 10; ++i) {
+    PvalueTriplet t(ScanId(0, i), ScanId(0, i + 1), -static_cast<float>(i));
+    pvec.push_back(t);
+    if (i % 2 == 0) {
+      bin0.push_back(t);
+    } else {
+      bin2.push_back(t);
+    }
+  }
+  std::sort(bin0.begin(), bin0.end(), lowerPval);
+  std::sort(bin2.begin(), bin2.end(), lowerPval);
+  
+  bool append = false;
+  writePvals(bin0, resultFN + ".0", append);
+  std::remove((resultFN + ".1").c_str());
+  writePvals(bin2, resultFN + ".2", append);
+  
+  externalMergeSort(resultFN, numFiles);
+  
+  std::vector<PvalueTriplet> merged;
+  readPvals(resultFN, merged);
+  std::remove(resultFN.c_str());
+  
+  std::sort(pvec.begin(), pvec.end(), lowerPval);
+  bool success = (merged.size() == pvec.size());
+  for (size_t i = 0; success && i < merged.size(); ++i) {
+    success = (merged[i].pval == pvec[i].pval && 
+               merged[i].scannr1 == pvec[i].scannr1);
+  }
+  if (!success) {
+    std::cerr << "Merging part files with an empty hash bin returned " 
+              << merged.size() << " p-values, should be " << pvec.size() 
+              << std::endl;
+  }
+  return success;
+}
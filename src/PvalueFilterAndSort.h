@@ -40,6 +40,7 @@
 class PvalueFilterAndSort {
  public:
   static int maxPvalsPerFile_;
+  static bool compressPvals_;
   
   static void filterAndSort(const std::string& pvalFN);
   static void filterAndSort(const std::vector<std::string>& pvalFNs, 
@@ -50,10 +51,14 @@ class PvalueFilterAndSort {
   
   static void externalMergeSort(const std::string& resultFN, int numFiles);
   
+  static void writePvals(const std::vector<PvalueTriplet>& pvec,
+                         const std::string& pvalFN, bool append);
+  
   static void convertBinaryPvalToTsv(std::string& binaryPvalFN, 
                                      std::string& tsvPvalFN);
   static bool unitTest();
   static bool singleFileUnitTest();
+  static bool emptyBinUnitTest();
   
   inline static bool uniDirectionPval(const PvalueTriplet& a, 
                                       const PvalueTriplet& b) { 
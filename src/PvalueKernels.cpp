@@ -0,0 +1,707 @@
+/******************************************************************************
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+ ******************************************************************************/
+
+#include "PvalueKernels.h"
+
+#ifdef MARACLUSTER_X86_KERNELS
+  #include <immintrin.h>
+#endif
+
+namespace {
+
+void addShiftedScalar(double* f, unsigned int shift, unsigned int maxIdx) {
+  for (unsigned int i = maxIdx; i >= shift; --i) {
+    f[i] += f[i - shift];
+  }
+}
+
+double normalizeScalar(double* f, unsigned int numElements) {
+  double fm = *std::max_element(f, f + numElements);
+  for (unsigned int i = 0; i < numElements; ++i) {
+    f[i] /= fm;
+  }
+  return fm;
+}
+
+unsigned int matchedScoreScalar(const short* peakBins, const short* peakScores,
+    unsigned int numPeaks, const short* queryPeakBins, unsigned int numQueryPeaks,
+    unsigned int maxUnmatchedScore) {
+  unsigned int score = 0u, unmatchedScore = 0u, candIdx = 0u;
+  for (unsigned int i = 0; i < numPeaks; ++i) {
+    while (candIdx < numQueryPeaks && peakBins[i] > queryPeakBins[candIdx]) {
+      ++candIdx;
+    }
+    if (candIdx >= numQueryPeaks) break;
+    if (peakBins[i] == queryPeakBins[candIdx]) {
+      score += peakScores[i];
+      ++candIdx;
+    } else {
+      unmatchedScore += peakScores[i];
+      if (unmatchedScore > maxUnmatchedScore) break;
+    }
+  }
+  return score;
+}
+
+bool matchedScorePairScalar(const short* peakBinsA, const short* peakScoresA, 
+    unsigned int numPeaksA, const short* peakBinsB, const short* peakScoresB, 
+    unsigned int numPeaksB, unsigned int maxUnmatchedScoreA, 
+    unsigned int maxUnmatchedScoreB, unsigned int& scoreA, unsigned int& scoreB) {
+  unsigned int i = 0u, j = 0u, unmatchedScoreA = 0u, unmatchedScoreB = 0u;
+  scoreA = 0u;
+  scoreB = 0u;
+  while (i < numPeaksA && j < numPeaksB) {
+    if (peakBinsA[i] < peakBinsB[j]) {
+      unmatchedScoreA += peakScoresA[i++];
+      if (unmatchedScoreA > maxUnmatchedScoreA) return false;
+    } else if (peakBinsA[i] > peakBinsB[j]) {
+      unmatchedScoreB += peakScoresB[j++];
+      if (unmatchedScoreB > maxUnmatchedScoreB) return false;
+    } else {
+      scoreA += peakScoresA[i++];
+      scoreB += peakScoresB[j++];
+    }
+  }
+  return true;
+}
+
+// parallel bit count, as there is no portable popcount
+unsigned int sharedBitCountScalar(const unsigned long long* a, 
+                                  const unsigned long long* b) {
+  unsigned int count = 0u;
+  for (unsigned int i = 0; i < PvalueKernels::kSignatureWords; ++i) {
+    unsigned long long x = a[i] & b[i];
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    count += static_cast<unsigned int>((x * 0x0101010101010101ULL) >> 56);
+  }
+  return count;
+}
+
+#ifdef MARACLUSTER_X86_KERNELS
+
+// the blocks are processed from high to low indices. The source block is
+// loaded before the destination block is stored, so overlapping blocks for
+// shift < vector width still read the old values.
+void addShiftedSse2(double* f, unsigned int shift, unsigned int maxIdx) {
+  int i = maxIdx, minIdx = shift, s = shift;
+  for (; i - 1 >= minIdx; i -= 2) {
+    __m128d src = _mm_loadu_pd(f + i - 1 - s);
+    __m128d dst = _mm_loadu_pd(f + i - 1);
+    _mm_storeu_pd(f + i - 1, _mm_add_pd(dst, src));
+  }
+  for (; i >= minIdx; --i) f[i] += f[i - s];
+}
+
+double normalizeSse2(double* f, unsigned int numElements) {
+  int n = numElements, i = 0;
+  __m128d maxVec = _mm_set1_pd(f[0]);
+  for (; i + 1 < n; i += 2) maxVec = _mm_max_pd(maxVec, _mm_loadu_pd(f + i));
+  double maxVals[2];
+  _mm_storeu_pd(maxVals, maxVec);
+  double fm = (std::max)(maxVals[0], maxVals[1]);
+  for (; i < n; ++i) fm = (std::max)(fm, f[i]);
+
+  __m128d fmVec = _mm_set1_pd(fm);
+  for (i = 0; i + 1 < n; i += 2) {
+    _mm_storeu_pd(f + i, _mm_div_pd(_mm_loadu_pd(f + i), fmVec));
+  }
+  for (; i < n; ++i) f[i] /= fm;
+  return fm;
+}
+
+inline int horizontalSumSse2(__m128i v) {
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(v);
+}
+
+// the peaks are processed in blocks of 8. Each query bin up to the last bin
+// of the block is compared to all bins of the block at once. As the peak 
+// bins are unique and sorted, these query bins cannot match a later block.
+// The cutoff on the unmatched score is checked after every block.
+unsigned int matchedScoreSse2(const short* peakBins, const short* peakScores,
+    unsigned int numPeaks, const short* queryPeakBins, unsigned int numQueryPeaks,
+    unsigned int maxUnmatchedScore) {
+  __m128i acc = _mm_setzero_si128(), unmatchedAcc = _mm_setzero_si128();
+  bool hasCutoff = (maxUnmatchedScore != PvalueKernels::kNoScoreCutoff);
+  unsigned int j = 0;
+  for (unsigned int i = 0; i < numPeaks && j < numQueryPeaks; i += 8) {
+    unsigned int blockSize = (std::min)(8u, numPeaks - i);
+    __m128i bins, scores;
+    if (blockSize == 8) {
+      bins = _mm_loadu_si128(reinterpret_cast<const __m128i*>(peakBins + i));
+      scores = _mm_loadu_si128(reinterpret_cast<const __m128i*>(peakScores + i));
+    } else {
+      short paddedBins[8] = { 0 }, paddedScores[8] = { 0 };
+      std::copy(peakBins + i, peakBins + numPeaks, paddedBins);
+      std::copy(peakScores + i, peakScores + numPeaks, paddedScores);
+      bins = _mm_loadu_si128(reinterpret_cast<const __m128i*>(paddedBins));
+      scores = _mm_loadu_si128(reinterpret_cast<const __m128i*>(paddedScores));
+    }
+    
+    short blockMax = peakBins[i + blockSize - 1];
+    __m128i matches = _mm_setzero_si128();
+    for (; j < numQueryPeaks && queryPeakBins[j] <= blockMax; ++j) {
+      matches = _mm_or_si128(matches, 
+          _mm_cmpeq_epi16(bins, _mm_set1_epi16(queryPeakBins[j])));
+    }
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_and_si128(matches, scores), 
+                                            _mm_set1_epi16(1)));
+    if (hasCutoff) {
+      unmatchedAcc = _mm_add_epi32(unmatchedAcc, _mm_madd_epi16(
+          _mm_andnot_si128(matches, scores), _mm_set1_epi16(1)));
+      if (static_cast<unsigned int>(horizontalSumSse2(unmatchedAcc)) > maxUnmatchedScore) break;
+    }
+  }
+  return horizontalSumSse2(acc);
+}
+
+// same blocks as matchedScoreSse2. The score of a matched bin of B is put
+// into the lane of the bin of A that it matched, which gives the scores of
+// both directions from the same compares.
+bool matchedScorePairSse2(const short* peakBinsA, const short* peakScoresA, 
+    unsigned int numPeaksA, const short* peakBinsB, const short* peakScoresB, 
+    unsigned int numPeaksB, unsigned int maxUnmatchedScoreA, 
+    unsigned int maxUnmatchedScoreB, unsigned int& scoreA, unsigned int& scoreB) {
+  __m128i acc = _mm_setzero_si128(), unmatchedAcc = _mm_setzero_si128();
+  __m128i accB = _mm_setzero_si128();
+  bool hasCutoff = (maxUnmatchedScoreA != PvalueKernels::kNoScoreCutoff ||
+                    maxUnmatchedScoreB != PvalueKernels::kNoScoreCutoff);
+  unsigned int j = 0, sumScoresB = 0u;
+  for (unsigned int i = 0; i < numPeaksA && j < numPeaksB; i += 8) {
+    unsigned int blockSize = (std::min)(8u, numPeaksA - i);
+    __m128i bins, scores;
+    if (blockSize == 8) {
+      bins = _mm_loadu_si128(reinterpret_cast<const __m128i*>(peakBinsA + i));
+      scores = _mm_loadu_si128(reinterpret_cast<const __m128i*>(peakScoresA + i));
+    } else {
+      short paddedBins[8] = { 0 }, paddedScores[8] = { 0 };
+      std::copy(peakBinsA + i, peakBinsA + numPeaksA, paddedBins);
+      std::copy(peakScoresA + i, peakScoresA + numPeaksA, paddedScores);
+      bins = _mm_loadu_si128(reinterpret_cast<const __m128i*>(paddedBins));
+      scores = _mm_loadu_si128(reinterpret_cast<const __m128i*>(paddedScores));
+    }
+    
+    short blockMax = peakBinsA[i + blockSize - 1];
+    __m128i matches = _mm_setzero_si128(), scoresB = _mm_setzero_si128();
+    for (; j < numPeaksB && peakBinsB[j] <= blockMax; ++j) {
+      __m128i isMatch = _mm_cmpeq_epi16(bins, _mm_set1_epi16(peakBinsB[j]));
+      matches = _mm_or_si128(matches, isMatch);
+      scoresB = _mm_or_si128(scoresB, 
+          _mm_and_si128(isMatch, _mm_set1_epi16(peakScoresB[j])));
+      sumScoresB += peakScoresB[j];
+    }
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_and_si128(matches, scores), 
+                                            _mm_set1_epi16(1)));
+    accB = _mm_add_epi32(accB, _mm_madd_epi16(scoresB, _mm_set1_epi16(1)));
+    if (hasCutoff) {
+      unmatchedAcc = _mm_add_epi32(unmatchedAcc, _mm_madd_epi16(
+          _mm_andnot_si128(matches, scores), _mm_set1_epi16(1)));
+      if (static_cast<unsigned int>(horizontalSumSse2(unmatchedAcc)) > maxUnmatchedScoreA ||
+          sumScoresB - horizontalSumSse2(accB) > maxUnmatchedScoreB) {
+        return false;
+      }
+    }
+  }
+  scoreA = horizontalSumSse2(acc);
+  scoreB = horizontalSumSse2(accB);
+  return true;
+}
+
+__attribute__((target("avx2")))
+void addShiftedAvx2(double* f, unsigned int shift, unsigned int maxIdx) {
+  int i = maxIdx, minIdx = shift, s = shift;
+  for (; i - 3 >= minIdx; i -= 4) {
+    __m256d src = _mm256_loadu_pd(f + i - 3 - s);
+    __m256d dst = _mm256_loadu_pd(f + i - 3);
+    _mm256_storeu_pd(f + i - 3, _mm256_add_pd(dst, src));
+  }
+  for (; i >= minIdx; --i) f[i] += f[i - s];
+}
+
+__attribute__((target("avx2")))
+double normalizeAvx2(double* f, unsigned int numElements) {
+  int n = numElements, i = 0;
+  __m256d maxVec = _mm256_set1_pd(f[0]);
+  for (; i + 3 < n; i += 4) maxVec = _mm256_max_pd(maxVec, _mm256_loadu_pd(f + i));
+  double maxVals[4];
+  _mm256_storeu_pd(maxVals, maxVec);
+  double fm = *std::max_element(maxVals, maxVals + 4);
+  for (; i < n; ++i) fm = (std::max)(fm, f[i]);
+
+  __m256d fmVec = _mm256_set1_pd(fm);
+  for (i = 0; i + 3 < n; i += 4) {
+    _mm256_storeu_pd(f + i, _mm256_div_pd(_mm256_loadu_pd(f + i), fmVec));
+  }
+  for (; i < n; ++i) f[i] /= fm;
+  return fm;
+}
+
+__attribute__((target("avx2")))
+inline int horizontalSumAvx2(__m256i v) {
+  return horizontalSumSse2(_mm_add_epi32(_mm256_castsi256_si128(v), 
+                                         _mm256_extracti128_si256(v, 1)));
+}
+
+// same as matchedScoreSse2 with blocks of 16 peaks
+__attribute__((target("avx2")))
+unsigned int matchedScoreAvx2(const short* peakBins, const short* peakScores,
+    unsigned int numPeaks, const short* queryPeakBins, unsigned int numQueryPeaks,
+    unsigned int maxUnmatchedScore) {
+  __m256i acc = _mm256_setzero_si256(), unmatchedAcc = _mm256_setzero_si256();
+  bool hasCutoff = (maxUnmatchedScore != PvalueKernels::kNoScoreCutoff);
+  unsigned int j = 0;
+  for (unsigned int i = 0; i < numPeaks && j < numQueryPeaks; i += 16) {
+    unsigned int blockSize = (std::min)(16u, numPeaks - i);
+    __m256i bins, scores;
+    if (blockSize == 16) {
+      bins = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(peakBins + i));
+      scores = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(peakScores + i));
+    } else {
+      short paddedBins[16] = { 0 }, paddedScores[16] = { 0 };
+      std::copy(peakBins + i, peakBins + numPeaks, paddedBins);
+      std::copy(peakScores + i, peakScores + numPeaks, paddedScores);
+      bins = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(paddedBins));
+      scores = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(paddedScores));
+    }
+    
+    short blockMax = peakBins[i + blockSize - 1];
+    __m256i matches = _mm256_setzero_si256();
+    for (; j < numQueryPeaks && queryPeakBins[j] <= blockMax; ++j) {
+      matches = _mm256_or_si256(matches, 
+          _mm256_cmpeq_epi16(bins, _mm256_set1_epi16(queryPeakBins[j])));
+    }
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(
+        _mm256_and_si256(matches, scores), _mm256_set1_epi16(1)));
+    if (hasCutoff) {
+      unmatchedAcc = _mm256_add_epi32(unmatchedAcc, _mm256_madd_epi16(
+          _mm256_andnot_si256(matches, scores), _mm256_set1_epi16(1)));
+      if (static_cast<unsigned int>(horizontalSumAvx2(unmatchedAcc)) > maxUnmatchedScore) break;
+    }
+  }
+  return horizontalSumAvx2(acc);
+}
+
+// same as matchedScorePairSse2 with blocks of 16 peaks
+__attribute__((target("avx2")))
+bool matchedScorePairAvx2(const short* peakBinsA, const short* peakScoresA, 
+    unsigned int numPeaksA, const short* peakBinsB, const short* peakScoresB, 
+    unsigned int numPeaksB, unsigned int maxUnmatchedScoreA, 
+    unsigned int maxUnmatchedScoreB, unsigned int& scoreA, unsigned int& scoreB) {
+  __m256i acc = _mm256_setzero_si256(), unmatchedAcc = _mm256_setzero_si256();
+  __m256i accB = _mm256_setzero_si256();
+  bool hasCutoff = (maxUnmatchedScoreA != PvalueKernels::kNoScoreCutoff ||
+                    maxUnmatchedScoreB != PvalueKernels::kNoScoreCutoff);
+  unsigned int j = 0, sumScoresB = 0u;
+  for (unsigned int i = 0; i < numPeaksA && j < numPeaksB; i += 16) {
+    unsigned int blockSize = (std::min)(16u, numPeaksA - i);
+    __m256i bins, scores;
+    if (blockSize == 16) {
+      bins = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(peakBinsA + i));
+      scores = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(peakScoresA + i));
+    } else {
+      short paddedBins[16] = { 0 }, paddedScores[16] = { 0 };
+      std::copy(peakBinsA + i, peakBinsA + numPeaksA, paddedBins);
+      std::copy(peakScoresA + i, peakScoresA + numPeaksA, paddedScores);
+      bins = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(paddedBins));
+      scores = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(paddedScores));
+    }
+    
+    short blockMax = peakBinsA[i + blockSize - 1];
+    __m256i matches = _mm256_setzero_si256(), scoresB = _mm256_setzero_si256();
+    for (; j < numPeaksB && peakBinsB[j] <= blockMax; ++j) {
+      __m256i isMatch = _mm256_cmpeq_epi16(bins, _mm256_set1_epi16(peakBinsB[j]));
+      matches = _mm256_or_si256(matches, isMatch);
+      scoresB = _mm256_or_si256(scoresB, 
+          _mm256_and_si256(isMatch, _mm256_set1_epi16(peakScoresB[j])));
+      sumScoresB += peakScoresB[j];
+    }
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(
+        _mm256_and_si256(matches, scores), _mm256_set1_epi16(1)));
+    accB = _mm256_add_epi32(accB, _mm256_madd_epi16(scoresB, _mm256_set1_epi16(1)));
+    if (hasCutoff) {
+      unmatchedAcc = _mm256_add_epi32(unmatchedAcc, _mm256_madd_epi16(
+          _mm256_andnot_si256(matches, scores), _mm256_set1_epi16(1)));
+      if (static_cast<unsigned int>(horizontalSumAvx2(unmatchedAcc)) > maxUnmatchedScoreA ||
+          sumScoresB - horizontalSumAvx2(accB) > maxUnmatchedScoreB) {
+        return false;
+      }
+    }
+  }
+  scoreA = horizontalSumAvx2(acc);
+  scoreB = horizontalSumAvx2(accB);
+  return true;
+}
+
+__attribute__((target("avx512f")))
+void addShiftedAvx512(double* f, unsigned int shift, unsigned int maxIdx) {
+  int i = maxIdx, minIdx = shift, s = shift;
+  for (; i - 7 >= minIdx; i -= 8) {
+    __m512d src = _mm512_loadu_pd(f + i - 7 - s);
+    __m512d dst = _mm512_loadu_pd(f + i - 7);
+    _mm512_storeu_pd(f + i - 7, _mm512_add_pd(dst, src));
+  }
+  for (; i >= minIdx; --i) f[i] += f[i - s];
+}
+
+__attribute__((target("avx512f")))
+double normalizeAvx512(double* f, unsigned int numElements) {
+  int n = numElements, i = 0;
+  __m512d maxVec = _mm512_set1_pd(f[0]);
+  for (; i + 7 < n; i += 8) maxVec = _mm512_max_pd(maxVec, _mm512_loadu_pd(f + i));
+  double maxVals[8];
+  _mm512_storeu_pd(maxVals, maxVec);
+  double fm = *std::max_element(maxVals, maxVals + 8);
+  for (; i < n; ++i) fm = (std::max)(fm, f[i]);
+
+  __m512d fmVec = _mm512_set1_pd(fm);
+  for (i = 0; i + 7 < n; i += 8) {
+    _mm512_storeu_pd(f + i, _mm512_div_pd(_mm512_loadu_pd(f + i), fmVec));
+  }
+  for (; i < n; ++i) f[i] /= fm;
+  return fm;
+}
+
+// the POPCNT instruction is available on all CPUs with AVX2
+__attribute__((target("popcnt")))
+unsigned int sharedBitCountPopcnt(const unsigned long long* a, 
+                                  const unsigned long long* b) {
+  unsigned int count = 0u;
+  for (unsigned int i = 0; i < PvalueKernels::kSignatureWords; ++i) {
+    count += __builtin_popcountll(a[i] & b[i]);
+  }
+  return count;
+}
+
+#endif // MARACLUSTER_X86_KERNELS
+
+} // namespace
+
+PvalueKernels::InstructionSet PvalueKernels::instructionSet_ = PvalueKernels::SCALAR;
+PvalueKernels::AddShiftedFunction PvalueKernels::addShiftedFunction_ = addShiftedScalar;
+PvalueKernels::NormalizeFunction PvalueKernels::normalizeFunction_ = normalizeScalar;
+PvalueKernels::MatchedScoreFunction PvalueKernels::matchedScoreFunction_ = matchedScoreScalar;
+PvalueKernels::MatchedScorePairFunction PvalueKernels::matchedScorePairFunction_ = matchedScorePairScalar;
+PvalueKernels::SharedBitCountFunction PvalueKernels::sharedBitCountFunction_ = sharedBitCountScalar;
+
+namespace {
+  // selects the best supported kernels before main is entered
+  struct PvalueKernelsInitializer {
+    PvalueKernelsInitializer() {
+      PvalueKernels::setInstructionSet(PvalueKernels::AVX512);
+    }
+  } pvalueKernelsInitializer;
+}
+
+bool PvalueKernels::isSupported(InstructionSet instructionSet) {
+#ifdef MARACLUSTER_X86_KERNELS
+  __builtin_cpu_init();
+  switch (instructionSet) {
+    case AVX512: return __builtin_cpu_supports("avx512f");
+    case AVX2: return __builtin_cpu_supports("avx2");
+    case SSE2: return __builtin_cpu_supports("sse2");
+    default: return true;
+  }
+#else
+  return instructionSet == SCALAR;
+#endif
+}
+
+// uses the requested instruction set or the best supported one below it
+void PvalueKernels::setInstructionSet(InstructionSet instructionSet) {
+  while (instructionSet > SCALAR && !isSupported(instructionSet)) {
+    instructionSet = static_cast<InstructionSet>(instructionSet - 1);
+  }
+
+  instructionSet_ = instructionSet;
+  switch (instructionSet) {
+#ifdef MARACLUSTER_X86_KERNELS
+    case AVX512:
+      addShiftedFunction_ = addShiftedAvx512;
+      normalizeFunction_ = normalizeAvx512;
+      // 16 bit compares need AVX-512BW, AVX2 is available on all AVX-512 CPUs
+      matchedScoreFunction_ = matchedScoreAvx2;
+      matchedScorePairFunction_ = matchedScorePairAvx2;
+      sharedBitCountFunction_ = sharedBitCountPopcnt;
+      break;
+    case AVX2:
+      addShiftedFunction_ = addShiftedAvx2;
+      normalizeFunction_ = normalizeAvx2;
+      matchedScoreFunction_ = matchedScoreAvx2;
+      matchedScorePairFunction_ = matchedScorePairAvx2;
+      sharedBitCountFunction_ = sharedBitCountPopcnt;
+      break;
+    case SSE2:
+      addShiftedFunction_ = addShiftedSse2;
+      normalizeFunction_ = normalizeSse2;
+      matchedScoreFunction_ = matchedScoreSse2;
+      matchedScorePairFunction_ = matchedScorePairSse2;
+      sharedBitCountFunction_ = sharedBitCountScalar;
+      break;
+#endif
+    default:
+      instructionSet_ = SCALAR;
+      addShiftedFunction_ = addShiftedScalar;
+      normalizeFunction_ = normalizeScalar;
+      matchedScoreFunction_ = matchedScoreScalar;
+      matchedScorePairFunction_ = matchedScorePairScalar;
+      sharedBitCountFunction_ = sharedBitCountScalar;
+      break;
+  }
+}
+
+std::string PvalueKernels::getInstructionSetName(InstructionSet instructionSet) {
+  switch (instructionSet) {
+    case AVX512: return "AVX-512";
+    case AVX2: return "AVX2";
+    case SSE2: return "SSE2";
+    default: return "scalar";
+  }
+}
+
+bool PvalueKernels::unitTest() {
+  InstructionSet bestInstructionSet = instructionSet_;
+  bool success = dynamicProgrammingUnitTest();
+  success = matchedScoreUnitTest() && success;
+  success = matchedScorePairUnitTest() && success;
+  success = sharedBitCountUnitTest() && success;
+  setInstructionSet(bestInstructionSet);
+  return success;
+}
+
+// runs the dynamic programming of computePvalVector with every supported
+// instruction set and compares it to the scalar version
+bool PvalueKernels::dynamicProgrammingUnitTest() {
+  unsigned long seed = 1;
+  std::vector<unsigned int> scores;
+  unsigned int sumScores = 0u;
+  for (unsigned int j = 0; j < 60; ++j) {
+    seed = (seed * 279470273) % 4294967291;
+    // include scores smaller than the vector widths
+    unsigned int score = 1 + seed % (j % 3 == 0 ? 7 : 100);
+    scores.push_back(score);
+    sumScores += score;
+  }
+
+  std::vector<double> reference;
+  bool success = true;
+  for (int is = SCALAR; is <= AVX512; ++is) {
+    InstructionSet instructionSet = static_cast<InstructionSet>(is);
+    if (!isSupported(instructionSet)) continue;
+    setInstructionSet(instructionSet);
+
+    std::vector<double> f(sumScores + 1, 0.0);
+    f[0] = 1.0;
+    double c = 0.0;
+    unsigned int partSumL = 0u;
+    for (unsigned int j = 0; j < scores.size(); ++j) {
+      if (j % 30 == 29) {
+        c += std::log(normalize(&f[0], partSumL + 1));
+      }
+      partSumL += scores[j];
+      addShifted(&f[0], scores[j], partSumL);
+    }
+    f.push_back(c);
+
+    if (instructionSet == SCALAR) {
+      reference = f;
+    } else {
+      for (size_t i = 0; i < f.size(); ++i) {
+        if (std::abs(f[i] - reference[i]) > 1e-12 * std::abs(reference[i])) {
+          std::cerr << getInstructionSetName(instructionSet) << " kernel gave "
+                    << f[i] << " instead of " << reference[i] << " at index "
+                    << i << std::endl;
+          success = false;
+          break;
+        }
+      }
+    }
+  }
+  return success;
+}
+
+// compares the matched scores of random peak lists with every supported
+// instruction set to the scalar version, including partial blocks and 
+// duplicated query bins
+bool PvalueKernels::matchedScoreUnitTest() {
+  unsigned long seed = 7;
+  bool success = true;
+  for (unsigned int t = 0; t < 1000 && success; ++t) {
+    short peakBins[40], peakScores[40], queryPeakBins[45];
+    seed = (seed * 279470273) % 4294967291;
+    unsigned int numPeaks = seed % 41, numBins = 60 + seed % 200;
+    unsigned int numQueryPeaks = 0;
+    
+    short bin = 0;
+    for (unsigned int i = 0; i < numPeaks; ++i) {
+      seed = (seed * 279470273) % 4294967291;
+      bin += 1 + seed % (numBins / 40);
+      peakBins[i] = bin;
+      peakScores[i] = 1 + seed % 100;
+    }
+    for (short b = 1; b <= bin + 5 && numQueryPeaks < 45; ++b) {
+      seed = (seed * 279470273) % 4294967291;
+      if (seed % 4 == 0) queryPeakBins[numQueryPeaks++] = b;
+      if (seed % 23 == 0 && numQueryPeaks > 0 && numQueryPeaks < 45) {
+        queryPeakBins[numQueryPeaks] = queryPeakBins[numQueryPeaks - 1];
+        ++numQueryPeaks;
+      }
+    }
+    
+    unsigned int reference = matchedScoreScalar(peakBins, peakScores, 
+        numPeaks, queryPeakBins, numQueryPeaks, kNoScoreCutoff);
+    int sumScores = std::accumulate(peakScores, peakScores + numPeaks, 0);
+    seed = (seed * 279470273) % 4294967291;
+    unsigned int maxUnmatchedScore = seed % (sumScores + 1);
+    for (int is = SCALAR; is <= AVX512; ++is) {
+      InstructionSet instructionSet = static_cast<InstructionSet>(is);
+      if (!isSupported(instructionSet)) continue;
+      setInstructionSet(instructionSet);
+      unsigned int score = matchedScore(peakBins, peakScores, numPeaks, 
+                                        queryPeakBins, numQueryPeaks);
+      if (score != reference) {
+        std::cerr << getInstructionSetName(instructionSet) << " kernel matched "
+                  << "a score of " << score << " instead of " << reference 
+                  << std::endl;
+        success = false;
+      }
+      
+      // with a cutoff, scores that reach sumScores - maxUnmatchedScore have
+      // to be exact and all others have to stay below it
+      int minScore = sumScores - static_cast<int>(maxUnmatchedScore);
+      int cutoffScore = matchedScore(peakBins, peakScores, numPeaks, 
+          queryPeakBins, numQueryPeaks, maxUnmatchedScore);
+      bool isExpected = (static_cast<int>(reference) >= minScore) ? 
+          (cutoffScore == static_cast<int>(reference)) : (cutoffScore < minScore);
+      if (!isExpected) {
+        std::cerr << getInstructionSetName(instructionSet) << " kernel matched "
+                  << "a score of " << cutoffScore << " with cutoff " 
+                  << maxUnmatchedScore << " instead of " << reference 
+                  << std::endl;
+        success = false;
+      }
+    }
+  }
+  return success;
+}
+
+// compares the fused matching of two peak lists with every supported 
+// instruction set to two separate scalar matches, with and without cutoffs
+bool PvalueKernels::matchedScorePairUnitTest() {
+  unsigned long seed = 11;
+  bool success = true;
+  for (unsigned int t = 0; t < 1000 && success; ++t) {
+    short peakBins[2][40], peakScores[2][40];
+    unsigned int numPeaks[2], sumScores[2];
+    seed = (seed * 279470273) % 4294967291;
+    unsigned int numBins = 60 + seed % 200;
+    for (unsigned int k = 0; k < 2; ++k) {
+      seed = (seed * 279470273) % 4294967291;
+      numPeaks[k] = seed % 41;
+      sumScores[k] = 0u;
+      short bin = 0;
+      for (unsigned int i = 0; i < numPeaks[k]; ++i) {
+        seed = (seed * 279470273) % 4294967291;
+        bin += 1 + seed % (numBins / 40);
+        peakBins[k][i] = bin;
+        peakScores[k][i] = 1 + seed % 100;
+        sumScores[k] += peakScores[k][i];
+      }
+    }
+    
+    unsigned int referenceA = matchedScoreScalar(peakBins[0], peakScores[0], 
+        numPeaks[0], peakBins[1], numPeaks[1], kNoScoreCutoff);
+    unsigned int referenceB = matchedScoreScalar(peakBins[1], peakScores[1], 
+        numPeaks[1], peakBins[0], numPeaks[0], kNoScoreCutoff);
+    unsigned int maxUnmatchedScores[2];
+    for (unsigned int k = 0; k < 2; ++k) {
+      seed = (seed * 279470273) % 4294967291;
+      maxUnmatchedScores[k] = seed % (sumScores[k] + 1);
+    }
+    bool isReachable = (referenceA + maxUnmatchedScores[0] >= sumScores[0] && 
+                        referenceB + maxUnmatchedScores[1] >= sumScores[1]);
+    
+    for (int is = SCALAR; is <= AVX512; ++is) {
+      InstructionSet instructionSet = static_cast<InstructionSet>(is);
+      if (!isSupported(instructionSet)) continue;
+      setInstructionSet(instructionSet);
+      unsigned int scoreA = 0u, scoreB = 0u;
+      bool isPair = matchedScorePair(peakBins[0], peakScores[0], numPeaks[0], 
+          peakBins[1], peakScores[1], numPeaks[1], kNoScoreCutoff, 
+          kNoScoreCutoff, scoreA, scoreB);
+      if (!isPair || scoreA != referenceA || scoreB != referenceB) {
+        std::cerr << getInstructionSetName(instructionSet) << " kernel matched "
+                  << "scores of " << scoreA << " and " << scoreB << " instead of " 
+                  << referenceA << " and " << referenceB << std::endl;
+        success = false;
+      }
+      
+      // pairs that reach both cutoffs have to be exact
+      isPair = matchedScorePair(peakBins[0], peakScores[0], numPeaks[0], 
+          peakBins[1], peakScores[1], numPeaks[1], maxUnmatchedScores[0], 
+          maxUnmatchedScores[1], scoreA, scoreB);
+      if (isReachable && (!isPair || scoreA != referenceA || scoreB != referenceB)) {
+        std::cerr << getInstructionSetName(instructionSet) << " kernel abandoned "
+                  << "a pair that reaches the score cutoffs" << std::endl;
+        success = false;
+      }
+    }
+  }
+  return success;
+}
+
+// compares the shared bit counts of random signatures with every supported
+// instruction set to a bit by bit count
+bool PvalueKernels::sharedBitCountUnitTest() {
+  unsigned long seed = 13;
+  bool success = true;
+  for (unsigned int t = 0; t < 1000 && success; ++t) {
+    unsigned long long a[kSignatureWords], b[kSignatureWords];
+    for (unsigned int i = 0; i < kSignatureWords; ++i) {
+      a[i] = 0ULL;
+      b[i] = 0ULL;
+      for (unsigned int bit = 0; bit < 64; ++bit) {
+        seed = (seed * 279470273) % 4294967291;
+        // include empty and full words
+        if (seed % 5 < t % 6) a[i] |= 1ULL << bit;
+        if (seed % 3 != 0) b[i] |= 1ULL << bit;
+      }
+    }
+    
+    unsigned int reference = 0u;
+    for (unsigned int i = 0; i < kSignatureWords; ++i) {
+      for (unsigned int bit = 0; bit < 64; ++bit) {
+        if ((a[i] >> bit) & (b[i] >> bit) & 1ULL) ++reference;
+      }
+    }
+    
+    for (int is = SCALAR; is <= AVX512; ++is) {
+      InstructionSet instructionSet = static_cast<InstructionSet>(is);
+      if (!isSupported(instructionSet)) continue;
+      setInstructionSet(instructionSet);
+      unsigned int count = sharedBitCount(a, b);
+      if (count != reference) {
+        std::cerr << getInstructionSetName(instructionSet) << " kernel counted "
+                  << count << " shared bits instead of " << reference 
+                  << std::endl;
+        success = false;
+      }
+    }
+  }
+  return success;
+}
@@ -0,0 +1,126 @@
+/******************************************************************************
+  Copyright 2015 Matthew The <matthew.the@scilifelab.se>
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+ ******************************************************************************/
+
+#ifndef PVALUE_KERNELS_H
+#define PVALUE_KERNELS_H
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <numeric>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define MARACLUSTER_X86_KERNELS
+#endif
+
+/**
+ * Vectorized inner loops of the dynamic programming in
+ * PvalueCalculator::computePvalVector and of the peak matching in 
+ * PvalueCalculator::computePvalPolyfit. The implementation is selected once
+ * at startup from the instruction sets supported by the CPU. All variants
+ * perform the same floating point operations per element as the scalar
+ * loops, so they give identical results.
+ */
+class PvalueKernels {
+ public:
+  enum InstructionSet { SCALAR = 0, SSE2 = 1, AVX2 = 2, AVX512 = 3 };
+
+  // f[i] += f[i - shift] for i = maxIdx, ..., shift, i.e. in place with the
+  // old values of f on the right-hand side. shift has to be at least 1.
+  static inline void addShifted(double* f, unsigned int shift,
+                                unsigned int maxIdx) {
+    addShiftedFunction_(f, shift, maxIdx);
+  }
+
+  // divides f[0], ..., f[numElements - 1] by their maximum, which is returned
+  static inline double normalize(double* f, unsigned int numElements) {
+    return normalizeFunction_(f, numElements);
+  }
+
+  static const unsigned int kNoScoreCutoff = 0xFFFFFFFFu;
+  
+  // sum of peakScores[i] over all peaks i with peakBins[i] in queryPeakBins.
+  // Both bin lists have to be sorted and the peakBins have to be unique,
+  // bins of 0 never match. This is the innermost loop of the p-value 
+  // calculation and does not allocate.
+  // The matching is abandoned as soon as the scores of the unmatched peaks 
+  // exceed maxUnmatchedScore, the returned score is then below 
+  // sum(peakScores) - maxUnmatchedScore but not necessarily exact.
+  static inline unsigned int matchedScore(const short* peakBins, 
+      const short* peakScores, unsigned int numPeaks, 
+      const short* queryPeakBins, unsigned int numQueryPeaks,
+      unsigned int maxUnmatchedScore = kNoScoreCutoff) {
+    return matchedScoreFunction_(peakBins, peakScores, numPeaks, 
+                                 queryPeakBins, numQueryPeaks, maxUnmatchedScore);
+  }
+  
+  // matched scores of two spectra in both directions from a single pass 
+  // over their sorted and unique peak lists: scoreA of the peaks of A in B 
+  // and scoreB of the peaks of B in A. Returns false as soon as the scores 
+  // of the unmatched peaks of A or B exceed their maximum, the scores are 
+  // only set if true is returned.
+  static inline bool matchedScorePair(const short* peakBinsA, 
+      const short* peakScoresA, unsigned int numPeaksA, 
+      const short* peakBinsB, const short* peakScoresB, unsigned int numPeaksB,
+      unsigned int maxUnmatchedScoreA, unsigned int maxUnmatchedScoreB,
+      unsigned int& scoreA, unsigned int& scoreB) {
+    return matchedScorePairFunction_(peakBinsA, peakScoresA, numPeaksA, 
+        peakBinsB, peakScoresB, numPeaksB, maxUnmatchedScoreA, 
+        maxUnmatchedScoreB, scoreA, scoreB);
+  }
+  
+  static const unsigned int kSignatureWords = 4u;
+  
+  // number of bits that are set in both of the bit signatures a and b of 
+  // kSignatureWords words each
+  static inline unsigned int sharedBitCount(const unsigned long long* a, 
+                                            const unsigned long long* b) {
+    return sharedBitCountFunction_(a, b);
+  }
+  
+  static InstructionSet getInstructionSet() { return instructionSet_; }
+  static bool isSupported(InstructionSet instructionSet);
+  static void setInstructionSet(InstructionSet instructionSet);
+  static std::string getInstructionSetName(InstructionSet instructionSet);
+
+  static bool unitTest();
+ private:
+  typedef void (*AddShiftedFunction)(double*, unsigned int, unsigned int);
+  typedef double (*NormalizeFunction)(double*, unsigned int);
+  typedef unsigned int (*MatchedScoreFunction)(const short*, const short*, 
+      unsigned int, const short*, unsigned int, unsigned int);
+  typedef bool (*MatchedScorePairFunction)(const short*, const short*, 
+      unsigned int, const short*, const short*, unsigned int, unsigned int,
+      unsigned int, unsigned int&, unsigned int&);
+  typedef unsigned int (*SharedBitCountFunction)(const unsigned long long*, 
+      const unsigned long long*);
+
+  static InstructionSet instructionSet_;
+  static AddShiftedFunction addShiftedFunction_;
+  static NormalizeFunction normalizeFunction_;
+  static MatchedScoreFunction matchedScoreFunction_;
+  static MatchedScorePairFunction matchedScorePairFunction_;
+  static SharedBitCountFunction sharedBitCountFunction_;
+  
+  static bool dynamicProgrammingUnitTest();
+  static bool matchedScoreUnitTest();
+  static bool matchedScorePairUnitTest();
+  static bool sharedBitCountUnitTest();
+};
+
+#endif // PVALUE_KERNELS_H
@@ -16,6 +16,8 @@
  
 #include "SparseClustering.h"
 
+bool SparseClustering::singleLinkage_ = false;
+
 void SparseClustering::initMatrix(const std::string& matrixFN) {
   matrixLoader_.initStream(matrixFN);
 }
@@ -46,20 +48,21 @@ void SparseClustering::clusterInit(const ScanId row) {
   }
 }
 
+template <class LinkagePolicy>
 void SparseClustering::loadNextEdges(
     boost::unordered_map<ScanId, ScanId>& mergeRoots) {
   boost::unordered_map<ScanId, ScanId> clusterMemberships;
   getClusterMemberships(clusterMemberships);
-#ifndef SINGLE_LINKAGE
-  updateMissingEdges(clusterMemberships, mergeRoots);
-#endif
-  addNewEdges(clusterMemberships);
+  if (LinkagePolicy::kKeepMissingEdges) {
+    updateMissingEdges(clusterMemberships, mergeRoots);
+  }
+  addNewEdges<LinkagePolicy>(clusterMemberships);
   
   size_t beforeSize = edgeList_.size();
 
-#ifndef SINGLE_LINKAGE
-  pruneEdges();
-#endif
+  if (LinkagePolicy::kKeepMissingEdges) {
+    pruneEdges();
+  }
   
   std::cerr << "  Loaded new edges: new: " << edgeList_.size() - beforeSize << 
       ", total: " << numTotalEdges_ << "/" << matrixLoader_.numPvals_ << 
@@ -116,6 +119,7 @@ void SparseClustering::updateMissingEdges(
   }
 }
 
+template <class LinkagePolicy>
 void SparseClustering::addNewEdges(
     boost::unordered_map<ScanId, ScanId>& clusterMemberships) {
   std::cerr << "  Loading new edges." << std::endl;
@@ -127,9 +131,9 @@ void SparseClustering::addNewEdges(
   size_t numNewEdges = pvec.size();
   size_t insertOffset = missingEdges_.size();
   numTotalEdges_ += numNewEdges;
-#ifndef SINGLE_LINKAGE
-  missingEdges_.resize(missingEdges_.size() + numNewEdges);
-#endif
+  if (LinkagePolicy::kKeepMissingEdges) {
+    missingEdges_.resize(missingEdges_.size() + numNewEdges);
+  }
 #pragma omp parallel for schedule(dynamic, 10000) 
   for (unsigned int i = 0; i < numNewEdges; ++i) {
     ScanId row = pvec[i].scannr1;
@@ -150,14 +154,12 @@ void SparseClustering::addNewEdges(
     
     ScanId s1 = (std::min)(row, col);
     ScanId s2 = (std::max)(row, col);
-#ifdef SINGLE_LINKAGE
-    if (!(row == col)) {
+    if (LinkagePolicy::kKeepMissingEdges) {
+      missingEdges_[insertOffset + i] = SparseMissingEdge(pvec[i].pval, s1, s2, 1u);
+    } else if (!(row == col)) {
       size_t idx = 0;
-      addNewEdge(SparseMissingEdge(pvec[i].pval, s1, s2, clusters_[s1].size()*clusters_[s2].size()), idx);
+      addNewEdge<LinkagePolicy>(SparseMissingEdge(pvec[i].pval, s1, s2, clusters_[s1].size()*clusters_[s2].size()), idx);
     }
-#else
-    missingEdges_[insertOffset + i] = SparseMissingEdge(pvec[i].pval, s1, s2, 1u);
-#endif
   }
 }
 
@@ -190,11 +192,11 @@ void SparseClustering::pruneEdges() {
       if (lastEdge.col == missingEdges_[j].col && lastEdge.row == missingEdges_[j].row) {
         lastEdge.numEdges += missingEdges_[j].numEdges;
       } else {
-        addNewEdge(lastEdge, tmpIdx);
+        addNewEdge<CompleteLinkage>(lastEdge, tmpIdx);
         lastEdge = missingEdges_[j];
       }
     }
-    addNewEdge(lastEdge, tmpIdx);
+    addNewEdge<CompleteLinkage>(lastEdge, tmpIdx);
   #pragma omp critical (tmp_edges_idx_insert)
     {
       collapsingIndices.push_back(tmpIdx);
@@ -217,6 +219,7 @@ void SparseClustering::pruneEdges() {
   missingEdges_.resize(curIdx);
 }
 
+template <class LinkagePolicy>
 void SparseClustering::addNewEdge(const SparseMissingEdge& edge, size_t& idx) {
   if (!(edge.row == edge.col)) {
     if (edge.numEdges == clusters_[edge.row].size()*clusters_[edge.col].size()) {
@@ -228,9 +231,9 @@ void SparseClustering::addNewEdge(const SparseMissingEdge& edge, size_t& idx) {
         edgeList_.push(se);
       }
     }
-#ifndef SINGLE_LINKAGE
-    missingEdges_[idx++] = edge;
-#endif
+    if (LinkagePolicy::kKeepMissingEdges) {
+      missingEdges_[idx++] = edge;
+    }
   }
 }
 
@@ -241,8 +244,17 @@ void SparseClustering::updateEntry(const ScanId row, const ScanId col,
   matrix_[col][row] = value;
 }
 
+void SparseClustering::doClustering(double cutoff) {
+  if (singleLinkage_) {
+    runClustering<SingleLinkage>(cutoff);
+  } else {
+    runClustering<CompleteLinkage>(cutoff);
+  }
+}
+
 // Based on http://www.ncbi.nlm.nih.gov/pmc/articles/PMC2718652/
-void SparseClustering::doClustering(double cutoff) {  
+template <class LinkagePolicy>
+void SparseClustering::runClustering(double cutoff) {  
   std::cerr << "Starting MinHeap clustering" << std::endl;
   
   unsigned int itNr = 0;
@@ -264,7 +276,7 @@ void SparseClustering::doClustering(double cutoff) {
   clock_t startClock = clock(), elapsedClock;
   
   if (matrixLoader_.hasEdgesAvailable()) {
-    loadNextEdges(mergeRoots);
+    loadNextEdges<LinkagePolicy>(mergeRoots);
   } else {
     std::cerr << "Could not read edges from input file." << std::endl;
     return;
@@ -283,7 +295,7 @@ void SparseClustering::doClustering(double cutoff) {
     if (minEdge.value >= cutoff) break;
     if (edgeList_.size() == 0) {
       if (matrixLoader_.hasEdgesAvailable()) {
-        loadNextEdges(mergeRoots);
+        loadNextEdges<LinkagePolicy>(mergeRoots);
         continue;
       } else {
         break;
@@ -324,11 +336,7 @@ void SparseClustering::doClustering(double cutoff) {
       if (col == minCol || col == minRow || !isAlive_[col]) continue;
       if (matrix_[minCol].find(col) != matrix_[minCol].end()) {
         //double value = (colValPair.second * n + matrix_[minCol][col] * m)/(n+m); // UPGMA
-#ifdef SINGLE_LINKAGE
-        double value = (std::min)(colValPair.second, matrix_[minCol][col]); // single linkage
-#else
-        double value = (std::max)(colValPair.second, matrix_[minCol][col]); // complete linkage
-#endif
+        double value = LinkagePolicy::merge(colValPair.second, matrix_[minCol][col]);
         updateEntry(mergeScanId, col, value);
       }
     }
@@ -351,7 +359,7 @@ void SparseClustering::doClustering(double cutoff) {
   std::cerr << "Finished MinHeap clustering" << std::endl;
   
   if (writeMissingEdges_) {
-    loadNextEdges(mergeRoots);
+    loadNextEdges<LinkagePolicy>(mergeRoots);
     std::sort(missingEdges_.begin(), missingEdges_.end(), lowerPval);
     std::string clusterPairMissingFN = clusterPairFN_ + ".missing_edges.tsv";
     std::ofstream resultMissingFNStream(clusterPairMissingFN.c_str());
@@ -61,6 +61,25 @@ struct SparseMissingEdge : public SparseEdge {
   unsigned int numEdges;
 };
 
+// linkage policies of SparseClustering, the clustering loop is instantiated 
+// for each of them and merge() gives the edge between a merged cluster and 
+// a third cluster from the two edges before the merge
+struct CompleteLinkage {
+  // an edge between two clusters is only known after all edges between 
+  // their members were loaded, until then the edges are kept as missing edges
+  static const bool kKeepMissingEdges = true;
+  static inline double merge(double value1, double value2) {
+    return (std::max)(value1, value2);
+  }
+};
+
+struct SingleLinkage {
+  static const bool kKeepMissingEdges = false;
+  static inline double merge(double value1, double value2) {
+    return (std::min)(value1, value2);
+  }
+};
+
 class SparseClustering {
  public:
   SparseClustering() : numTotalEdges_(0), clusterPairFN_(""), 
@@ -93,6 +112,9 @@ class SparseClustering {
   
   void setMergeOffset(unsigned int mergeOffset) { mergeOffset_ = mergeOffset; }
   
+  // use single instead of complete linkage
+  static bool singleLinkage_;
+  
   static bool clusteringUnitTest();
  protected:
   unsigned int edgeLoadingBatchSize_;
@@ -113,8 +135,14 @@ class SparseClustering {
   bool writeMissingEdges_;
   
   void makeSymmetric();
+  
+  template <class LinkagePolicy>
+  void runClustering(double cutoff);
+  
+  template <class LinkagePolicy>
   void addNewEdge(const SparseMissingEdge& edge, size_t& idx);
   
+  template <class LinkagePolicy>
   void loadNextEdges(
     boost::unordered_map<ScanId, ScanId>& mergeRoots);
   
@@ -125,6 +153,7 @@ class SparseClustering {
     boost::unordered_map<ScanId, ScanId>& clusterMemberships, 
     boost::unordered_map<ScanId, ScanId>& mergeRoots);
   
+  template <class LinkagePolicy>
   void addNewEdges(
     boost::unordered_map<ScanId, ScanId>& clusterMemberships);
   
@@ -45,6 +45,8 @@
 #include "MSFileMerger.h"
 #include "MSClusterMerge.h"
 #include "PvalueFilterAndSort.h"
+#include "PackedFileStore.h"
+#include "BinaryInterface.h"
 #include "SparseClustering.h"
 
 enum Mode { BATCH, PVALUE, UNIT_TEST, INDEX, CLUSTER, CONSENSUS, SEARCH };
@@ -71,6 +73,7 @@ std::string spectrumLibraryFN_ = "";
 std::string matrixFN_ = "";
 std::string resultTreeFN_ = "";
 bool skipFilterAndSort_ = false;
+bool usePackedStore_ = false;
 std::vector<double> clusterThresholds_;
 
 bool parseOptions(int argc, char **argv) {
@@ -170,6 +173,67 @@ bool parseOptions(int argc, char **argv) {
       "specOut",
       "File where you want the merged spectra to be written",
       "filename");
+  cmd.defineOption("P",
+      "packedStore",
+      "Write the binary intermediate files into a single append-only file "
+      "<prefix>.intermediates.dat in the output folder, instead of thousands "
+      "of small files. Only supported in batch mode, as the store cannot be "
+      "shared between the processes of the index, pvalue and cluster steps.",
+      "",
+      TRUE_IF_SET);
+  cmd.defineOption("Z",
+      "compressPvals",
+      "Compress the binary p-value files, hash part files and sorted p-value "
+      "files in zlib blocks to reduce disk I/O. Has to be passed to every "
+      "step that reads these files.",
+      "",
+      TRUE_IF_SET);
+  cmd.defineOption("S",
+      "peakCountSampleRate",
+      "Estimate the peak counts for the background model from this fraction "
+      "of the spectra, sampled per file and precursor bin, instead of from "
+      "all spectra (default: 1.0).",
+      "double");
+  cmd.defineOption("D",
+      "dotProduct",
+      "Use the dot product instead of p-values as similarity measure between "
+      "spectra.",
+      "",
+      TRUE_IF_SET);
+  cmd.defineOption("F",
+      "fingerprintFilter",
+      "Only calculate p-values for spectrum pairs that pass a pre-filter on "
+      "their fragment fingerprints.",
+      "",
+      TRUE_IF_SET);
+  cmd.defineOption("L",
+      "singleLinkage",
+      "Use single instead of complete linkage for clustering.",
+      "",
+      TRUE_IF_SET);
+  cmd.defineOption("N",
+      "maxScoringPeaks",
+      "Maximum number of peaks per spectrum used for scoring, fewer peaks "
+      "give faster but less sensitive p-value calculations and smaller "
+      "p-value vectors, which are stored with room for 20, 30 or 40 peaks. "
+      "Use the same value for the index and pvalue steps (range: 15-40, "
+      "default: 40).",
+      "int");
+  cmd.defineOption("A",
+      "approxPvalVectors",
+      "Approximate the p-value vectors with a saddle point approximation "
+      "instead of calculating them exactly, which is faster for large data "
+      "sets at the cost of small errors in the p-values.",
+      "",
+      TRUE_IF_SET);
+  cmd.defineOption("E",
+      "singlePrecision",
+      "Store and evaluate the polynomial fits of the p-value vectors in "
+      "single precision, which halves their size at the cost of small "
+      "errors in the p-values. Use the same setting for the index and "
+      "pvalue steps.",
+      "",
+      TRUE_IF_SET);
   cmd.defineOption("v",
       "verbatim",
       "Set the verbatim level (lowest: 0, highest: 5, default: 3).",
@@ -257,6 +321,20 @@ bool parseOptions(int argc, char **argv) {
   if (cmd.optionSet("t")) BatchPvalueVectors::dbPvalThreshold_ = cmd.getDouble("t", -1000.0, 0.0);
   if (cmd.optionSet("p")) BatchPvalueVectors::massRangePPM_ = cmd.getDouble("p", 0.0, 1e6);
   if (cmd.optionSet("v")) BatchGlobals::VERB = cmd.getInt("v", 0, 5);
+  if (cmd.optionSet("P")) usePackedStore_ = true;
+  if (cmd.optionSet("Z")) {
+    PvalueFilterAndSort::compressPvals_ = true;
+    BinaryInterface::setCompressionEnabled(true);
+  }
+  if (cmd.optionSet("S")) BatchSpectrumFiles::peakCountSampleRate_ = cmd.getDouble("S", 1e-6, 1.0);
+  if (cmd.optionSet("D")) BatchPvalueVectors::dotProduct_ = true;
+  if (cmd.optionSet("F")) BatchPvalueVectors::fingerprintFilter_ = true;
+  if (cmd.optionSet("L")) SparseClustering::singleLinkage_ = true;
+  if (cmd.optionSet("N")) PvalueCalculator::maxScoringPeaks_ = 
+      cmd.getInt("N", PvalueCalculator::kMinScoringPeaks, 
+                 PvalueCalculator::kMaxScoringPeaks);
+  if (cmd.optionSet("A")) PvalueCalculator::approxPvalVectors_ = true;
+  if (cmd.optionSet("E")) PvalueCalculator::singlePrecision_ = true;
 
   return true;
 }
@@ -365,6 +443,17 @@ int main(int argc, char* argv[]) {
         return EXIT_FAILURE;
       }
       
+      if (usePackedStore_) {
+        if (mode_ != BATCH) {
+          std::cerr << "Error: the packed intermediate file store (-P) is "
+                    << "only supported in batch mode" << std::endl;
+          return EXIT_FAILURE;
+        }
+        std::string storeFN = outputFolder_ + "/" + fnPrefix_ + ".intermediates.dat";
+        std::cerr << "Writing intermediate files to " << storeFN << std::endl;
+        PackedFileStore::open(storeFN);
+      }
+      
       switch (mode_) {
         case BATCH: {
           // This executes the entire pipeline in one go
@@ -430,8 +519,9 @@ int main(int argc, char* argv[]) {
           std::string pvaluesFN = outputFolder_ + "/overlaps.pvalues.dat";
           if (overlapFNs.size() > 0) {
             if (!BatchGlobals::fileExists(pvaluesFN)) {
-              BatchPvalueVectors pvecs(pvaluesFN);
-              pvecs.processOverlapFiles(overlapFNs);
+              boost::shared_ptr<BatchPvalueVectors> pvecs(
+                  BatchPvalueVectors::create(pvaluesFN));
+              pvecs->processOverlapFiles(overlapFNs);
             } else {
               std::cerr << "Using p-values from " << pvaluesFN << 
                   ". Remove this file to generate new p-values." << std::endl;
@@ -468,16 +558,18 @@ int main(int argc, char* argv[]) {
             // direct input of p-value vector file
             // maracluster pvalue -y /media/storage/mergespec/data/batchtest/1300.ms2.pvalue_vectors.tsv
             
-            BatchPvalueVectors pvecs(pvaluesFN_);
-            pvecs.parsePvalueVectorFile(pvalVecInFileFN_);
-            pvecs.batchCalculatePvalues();
+            boost::shared_ptr<BatchPvalueVectors> pvecs(
+                BatchPvalueVectors::create(pvaluesFN_));
+            pvecs->parsePvalueVectorFile(pvalVecInFileFN_);
+            pvecs->batchCalculatePvalues();
           } else if (overlapBatchFileFN_.size() > 0) { 
             // calculate p-values in overlap between two windows
             // maracluster pvalue -w data/batchcluster/overlap_files.txt
-            BatchPvalueVectors pvecs(pvaluesFN_);
+            boost::shared_ptr<BatchPvalueVectors> pvecs(
+                BatchPvalueVectors::create(pvaluesFN_));
             std::vector< std::pair<std::string, std::string> > overlapFNs;
-            pvecs.parseBatchOverlapFile(overlapBatchFileFN_, overlapFNs);
-            pvecs.processOverlapFiles(overlapFNs);
+            pvecs->parseBatchOverlapFile(overlapBatchFileFN_, overlapFNs);
+            pvecs->processOverlapFiles(overlapFNs);
           } else if (clusterFileFN_.size() > 0) {
             // calculate p-values from a cluster in a scan description list
             // maracluster pvalue -l <scan_desc_file> -g <peak_counts_file>
@@ -490,7 +582,8 @@ int main(int argc, char* argv[]) {
             
             std::vector<BatchSpectrum> batchSpectra;
             fileExtractor.parseClusterFileForExtract(clusterFileFN_);
-            fileExtractor.extractToBatchSpectrumList(batchSpectra);
+            fileExtractor.extractToBatchSpectrumList(batchSpectra, 
+                BatchPvalueVectors::dotProduct_);
             
             PeakCounts peakCounts;
             peakCounts.readFromFile(peakCountFN_);
@@ -643,6 +736,27 @@ int main(int argc, char* argv[]) {
             ++failures;
           }
           
+          if (PeakCounts::peakCountsFlatFileUnitTest()) {
+            std::cerr << "PeakCounts flat file unit tests succeeded" << std::endl;
+          } else {
+            std::cerr << "PeakCounts flat file unit tests failed" << std::endl;
+            ++failures;
+          }
+          
+          if (PeakCounts::peakDistributionLookupUnitTest()) {
+            std::cerr << "PeakCounts distribution lookup unit tests succeeded" << std::endl;
+          } else {
+            std::cerr << "PeakCounts distribution lookup unit tests failed" << std::endl;
+            ++failures;
+          }
+          
+          if (PeakDistributionTable::unitTest()) {
+            std::cerr << "PeakDistributionTable unit tests succeeded" << std::endl;
+          } else {
+            std::cerr << "PeakDistributionTable unit tests failed" << std::endl;
+            ++failures;
+          }
+          
           if (PvalueCalculator::binaryPeakMatchUnitTest()) {
             std::cerr << "PvalueCalculator peak matching unit tests succeeded" << std::endl;
           } else {
@@ -658,12 +772,81 @@ int main(int argc, char* argv[]) {
           }
           */
           
+          if (PvalueKernels::unitTest()) {
+            std::cerr << "PvalueKernels unit tests succeeded" << std::endl;
+          } else {
+            std::cerr << "PvalueKernels unit tests failed" << std::endl;
+            ++failures;
+          }
+          
           if (PvalueCalculator::pvalPolyfitUnitTest()) {
             std::cerr << "PvalueCalculator polyfit unit tests succeeded" << std::endl;
           } else {
             std::cerr << "PvalueCalculator polyfit unit tests failed" << std::endl;
             ++failures;
           }
+          
+          if (PvalueCalculator::peakScoreLookupUnitTest()) {
+            std::cerr << "PvalueCalculator peak score lookup unit tests succeeded" << std::endl;
+          } else {
+            std::cerr << "PvalueCalculator peak score lookup unit tests failed" << std::endl;
+            ++failures;
+          }
+          
+          if (PvalueCalculator::scoreCutoffUnitTest()) {
+            std::cerr << "PvalueCalculator score cutoff unit tests succeeded" << std::endl;
+          } else {
+            std::cerr << "PvalueCalculator score cutoff unit tests failed" << std::endl;
+            ++failures;
+          }
+          
+          if (PvalueCalculator::polyvalPrecisionUnitTest()) {
+            std::cerr << "PvalueCalculator polyval precision unit tests succeeded" << std::endl;
+          } else {
+            std::cerr << "PvalueCalculator polyval precision unit tests failed" << std::endl;
+            ++failures;
+          }
+          
+          if (BatchPvalueVectors::precisionUnitTest()) {
+            std::cerr << "BatchPvalueVectors precision unit tests succeeded" << std::endl;
+          } else {
+            std::cerr << "BatchPvalueVectors precision unit tests failed" << std::endl;
+            ++failures;
+          }
+          
+          if (BatchPvalueVectors::peakLayoutUnitTest()) {
+            std::cerr << "BatchPvalueVectors peak layout unit tests succeeded" << std::endl;
+          } else {
+            std::cerr << "BatchPvalueVectors peak layout unit tests failed" << std::endl;
+            ++failures;
+          }
+          
+          if (PvalueCalculator::polyfitFactorizationUnitTest()) {
+            std::cerr << "PvalueCalculator polyfit factorization unit tests succeeded" << std::endl;
+          } else {
+            std::cerr << "PvalueCalculator polyfit factorization unit tests failed" << std::endl;
+            ++failures;
+          }
+          
+          if (PvalueCalculator::pvalApproxUnitTest()) {
+            std::cerr << "PvalueCalculator approximate p-value vector unit tests succeeded" << std::endl;
+          } else {
+            std::cerr << "PvalueCalculator approximate p-value vector unit tests failed" << std::endl;
+            ++failures;
+          }
+          
+          if (PvalueCalculator::peakSignatureUnitTest()) {
+            std::cerr << "PvalueCalculator peak signature unit tests succeeded" << std::endl;
+          } else {
+            std::cerr << "PvalueCalculator peak signature unit tests failed" << std::endl;
+            ++failures;
+          }
+          if (PvalueFilterAndSort::emptyBinUnitTest()) {
+            std::cerr << "PvalueFilterAndSort empty hash bin unit tests succeeded" << std::endl;
+          } else {
+            std::cerr << "PvalueFilterAndSort empty hash bin unit tests failed" << std::endl;
+            ++failures;
+          }
           /*
           if (PvalueFilterAndSort::unitTest()) {
             std::cerr << "PvalueFilterAndSort unit tests succeeded" << std::endl;
@@ -688,6 +871,13 @@ int main(int argc, char* argv[]) {
             ++failures;
           }
           */
+          if (PackedFileStore::unitTest()) {
+            std::cerr << "PackedFileStore unit tests succeeded" << std::endl;
+          } else {
+            std::cerr << "PackedFileStore unit tests failed" << std::endl;
+            ++failures;
+          }
+          
           if (MSClusterMerge::mergeUnitTest()) {
             std::cerr << "Consensus spectra unit tests succeeded" << std::endl;
           } else {